@@ -37,46 +37,10 @@ fi
  
 cd src
 
-for lock in {1..3}
-do
-	for m in {1..100}
-	do
-		for iterations in {1..100}
-		do
-			if [[ $iterations -lt $LOW_ITER ]]; then
-				continue
-			fi
+make &> /dev/null
+sync
+echo 3 > /proc/sys/vm/drop_caches
 
-			for i in {1..100}
-			do
-				if [[ $i -lt $LOW_THREAD ]]; then
-					continue
-				fi
-
-				# Clean everything
-				make clean &> /dev/null
-				make &> /dev/null
-				hash -r
-				sync
-				echo 3 > /proc/sys/vm/drop_caches 
-
-				# Run
-				./test_prios -n $i -p $lock -i $iterations
-	
-				if [[ $i -eq $HIGH_THREAD ]]; then
-					break
-				fi
-			done
-
-			if [[ $iterations -eq $HIGH_ITER ]]; then
-				break
-			fi
-		done
-
-		if [[ $m -eq $TIMES ]]; then
-			break
-		fi
-
-		echo "-----------------------------------------------"
-	done
-done
+# The whole sweep runs in one process, see test_prios -h
+./test_prios -P 1-6 -N $LOW_THREAD-$HIGH_THREAD -I $LOW_ITER-$HIGH_ITER \
+	-R $TIMES -W 1 $BENCH_ARGS
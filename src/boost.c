@@ -0,0 +1,173 @@
+#include <stdint.h>
+
+#include "util.h"
+#include "prio.h"
+#include "boost.h"
+
+#ifndef SCHED_FLAG_KEEP_POLICY
+#define SCHED_FLAG_KEEP_POLICY    0x08
+#define SCHED_FLAG_KEEP_PARAMS    0x10
+#endif
+#ifndef SCHED_FLAG_UTIL_CLAMP_MIN
+#define SCHED_FLAG_UTIL_CLAMP_MIN 0x20
+#endif
+
+#define UCLAMP_MAX 1024
+
+/* glibc has no wrapper for sched_setattr(), this is the kernel's layout */
+struct cb2_sched_attr {
+	uint32_t size;
+	uint32_t sched_policy;
+	uint64_t sched_flags;
+	int32_t  sched_nice;
+	uint32_t sched_priority;
+	uint64_t sched_runtime;
+	uint64_t sched_deadline;
+	uint64_t sched_period;
+	uint32_t sched_util_min;
+	uint32_t sched_util_max;
+};
+
+/* nice -20..19 onto real-time priorities 99..1 */
+int rt_priority(int nice)
+{
+	nice = (nice < -20) ? -20 : (nice > 19) ? 19 : nice;
+	return 1 + (19 - nice) * 98 / 39;
+}
+
+/* nice -20..19 onto a minimum utilization of 1024..0 */
+static inline unsigned int util_min(int nice)
+{
+	nice = (nice < -20) ? -20 : (nice > 19) ? 19 : nice;
+	return (19 - nice) * UCLAMP_MAX / 39;
+}
+
+/* ----------------------------- nice ------------------------------------- */
+
+static int nice_boost_fn(pid_t tid, int nice)
+{
+	return prio_set(tid, nice);
+}
+
+static int nice_restore(int nice, long long delay_ns)
+{
+	return prio_restore(nice, delay_ns);
+}
+
+/* The original CB2 formula */
+static int nice_tickets(int hp_nice, int owner_nice)
+{
+	return hp_nice + owner_nice;
+}
+
+boost_backend nice_boost = {
+	.description = "nice",
+	.boost       = nice_boost_fn,
+	.restore     = nice_restore,
+	.tickets     = nice_tickets
+};
+
+/* --------------------------- SCHED_FIFO/RR ------------------------------ */
+
+static int rt_boost(pid_t tid, int nice, int policy)
+{
+	struct sched_param param = { .sched_priority = rt_priority(nice) };
+
+	prio_syscalls_self++;
+	return sched_setscheduler(tid, policy, &param);
+}
+
+static int fifo_boost_fn(pid_t tid, int nice)
+{
+	return rt_boost(tid, nice, SCHED_FIFO);
+}
+
+static int rr_boost_fn(pid_t tid, int nice)
+{
+	return rt_boost(tid, nice, SCHED_RR);
+}
+
+/* Back to CFS right away, staying real-time any longer is not worth it */
+static int rt_restore(int nice, __attribute__((unused)) long long delay_ns)
+{
+	struct sched_param param = { .sched_priority = 0 };
+
+	prio_syscalls_self++;
+	if (sched_setscheduler(self_tid(), SCHED_OTHER, &param) == -1) {
+		return -1;
+	}
+
+	return prio_set(self_tid(), nice);
+}
+
+/* A real-time owner preempts every CFS bystander, so the boost is worth
+ * the whole real-time priority it grants */
+static int rt_tickets(int hp_nice, __attribute__((unused)) int owner_nice)
+{
+	return rt_priority(hp_nice);
+}
+
+boost_backend fifo_boost = {
+	.description = "SCHED_FIFO",
+	.boost       = fifo_boost_fn,
+	.restore     = rt_restore,
+	.tickets     = rt_tickets
+};
+
+boost_backend rr_boost = {
+	.description = "SCHED_RR",
+	.boost       = rr_boost_fn,
+	.restore     = rt_restore,
+	.tickets     = rt_tickets
+};
+
+/* ---------------------------- util clamp -------------------------------- */
+
+static int set_util_min(pid_t tid, unsigned int min)
+{
+	struct cb2_sched_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.sched_flags = SCHED_FLAG_KEEP_POLICY | SCHED_FLAG_KEEP_PARAMS |
+		SCHED_FLAG_UTIL_CLAMP_MIN;
+	attr.sched_util_min = min;
+
+	prio_syscalls_self++;
+	return syscall(SYS_sched_setattr, tid, &attr, 0);
+}
+
+/* The nice value goes through the registry, the clamp is on top of it */
+static int uclamp_boost_fn(pid_t tid, int nice)
+{
+	if (prio_set(tid, nice) == -1) {
+		return -1;
+	}
+
+	return set_util_min(tid, util_min(nice));
+}
+
+static int uclamp_restore(int nice, long long delay_ns)
+{
+	int rc = set_util_min(self_tid(), 0);
+
+	/* Give back the nice value even if the clamp could not be reset */
+	if (prio_restore(nice, delay_ns) == -1) {
+		return -1;
+	}
+
+	return rc;
+}
+
+/* Same weight as nice, plus up to 16 tickets for the extra capacity */
+static int uclamp_tickets(int hp_nice, int owner_nice)
+{
+	return hp_nice + owner_nice + util_min(hp_nice) / 64;
+}
+
+boost_backend uclamp_boost = {
+	.description = "sched_setattr util clamp",
+	.boost       = uclamp_boost_fn,
+	.restore     = uclamp_restore,
+	.tickets     = uclamp_tickets
+};
@@ -0,0 +1,60 @@
+#ifndef __BOOST_H_
+#define __BOOST_H_
+
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+	How a lock raises the priority of another thread. Protocols talk in
+	nice values (-20 is the best) and the backend turns them into whatever
+	the scheduler understands:
+
+	- nice:   setpriority(), i.e. only the CFS weight changes.
+	- fifo:   the boosted thread moves to SCHED_FIFO (rr: SCHED_RR) with a
+	          real-time priority mapped from the nice value, so it preempts
+	          every CFS bystander on its core.
+	- uclamp: the nice value plus a minimum utilization clamp through
+	          sched_setattr(), so the boosted thread also gets a faster
+	          (or bigger) CPU.
+
+	The backend also tells the CB2 lottery how many tickets a boost is
+	worth in its own units.
+*/
+
+typedef struct _boost_backend {
+
+	char *description;
+
+	/* Raise tid to the priority of a thread at nice */
+	int (*boost)(pid_t tid, int nice);
+
+	/* Undo a boost of the calling thread, leaving it at nice. A delay
+	 * asks to keep the boost for that long (see prio_restore()), which
+	 * backends may ignore. */
+	int (*restore)(int nice, long long delay_ns);
+
+	/* Tickets the owner holds in the lottery when a thread at hp_nice
+	 * wants to boost it from owner_nice */
+	int (*tickets)(int hp_nice, int owner_nice);
+
+} boost_backend;
+
+extern boost_backend nice_boost;
+extern boost_backend fifo_boost;
+extern boost_backend rr_boost;
+extern boost_backend uclamp_boost;
+
+/* Real-time priority (1..99) a nice value (-20..19) maps onto */
+int rt_priority(int nice);
+
+/* No boost applied to the current owner */
+#define BOOST_NONE 0x7fffffff
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,231 @@
+#include "cb2_cond.h"
+#include "util.h"
+#include "futex.h"
+#include "prio.h"
+#include "lottery.h"
+
+#define COND_WAITING  0
+#define COND_WOKEN    1
+#define COND_REQUEUED 2
+
+/* Under meta_lock */
+static void cond_link(cb2_cond_t *c, struct cb2_cond_waiter *w)
+{
+	w->next = NULL;
+	w->prev = c->tail;
+
+	if (c->tail) {
+		c->tail->next = w;
+	} else {
+		c->head = w;
+	}
+	c->tail = w;
+
+	__atomic_store_n(&c->waiters, c->waiters + 1, __ATOMIC_RELEASE);
+}
+
+/* Under meta_lock */
+static void cond_unlink(cb2_cond_t *c, struct cb2_cond_waiter *w)
+{
+	if (w->prev) {
+		w->prev->next = w->next;
+	} else {
+		c->head = w->next;
+	}
+
+	if (w->next) {
+		w->next->prev = w->prev;
+	} else {
+		c->tail = w->prev;
+	}
+
+	__atomic_store_n(&c->waiters, c->waiters - 1, __ATOMIC_RELAXED);
+}
+
+/* Under meta_lock. The same tickets the sampler in tickets.c gives. */
+static struct cb2_cond_waiter *cond_draw(cb2_cond_t *c)
+{
+	struct cb2_cond_waiter *w;
+	uint32_t *tickets;
+	int n = 0, i;
+
+	if (c->waiters == 1) {
+		return c->head;
+	}
+
+	tickets = lottery_scratch(c->waiters);
+	for (w = c->head; w; w = w->next) {
+		tickets[n++] = 20 - w->prio;
+	}
+
+	for (w = c->head, i = lottery_pick(tickets, n); i > 0; i--) {
+		w = w->next;
+	}
+
+	return w;
+}
+
+/* Under meta_lock, w is unlinked already. Once its state changes the waiter
+ * may return and w is gone, so nothing touches it after that. */
+static void cond_hand_over(cb2_cond_t *c, struct cb2_cond_waiter *w)
+{
+	cb2_lock_t *l = c->lock;
+	int cur;
+
+	if (l->ops == &CB2_lock) {
+		/* With the waiters bit set the owner cannot release without
+		 * meta_lock, so the word stays held until w sleeps on it. That
+		 * also keeps w from taking the lock, and returning, until we
+		 * are done with it. */
+		pthread_mutex_lock(&l->meta_lock);
+
+		cur = __atomic_load_n(&l->word, __ATOMIC_RELAXED);
+		while (cur != LOCK_WORD_FREE && !(cur & LOCK_WORD_WAITERS) &&
+		       !__atomic_compare_exchange_n(&l->word, &cur,
+				cur | LOCK_WORD_WAITERS, 0, __ATOMIC_RELAXED,
+				__ATOMIC_RELAXED)) {
+			;
+		}
+
+		if (cur != LOCK_WORD_FREE) {
+			/* Counted as parked so that spinners keep the bit */
+			__atomic_add_fetch(&l->parked, 1, __ATOMIC_RELAXED);
+			__atomic_store_n(&w->state, COND_REQUEUED, __ATOMIC_RELEASE);
+			futex_requeue(&w->state, COND_REQUEUED, 1, &l->word);
+			pthread_mutex_unlock(&l->meta_lock);
+			c->requeued++;
+			return;
+		}
+
+		pthread_mutex_unlock(&l->meta_lock);
+	}
+
+	/* Nobody holds the lock, the waiter has to race for it */
+	__atomic_store_n(&w->state, COND_WOKEN, __ATOMIC_RELEASE);
+	futex_wake(&w->state, 1);
+}
+
+int cb2_cond_timedwait(cb2_cond_t *c, cb2_lock_t *l,
+		const struct timespec *abstime)
+{
+	struct cb2_cond_waiter w;
+	struct timespec timeout;
+	long long left;
+	int state, rc = 0;
+
+	/* Our own priority, not one lent to us while we held the lock */
+	w.state = COND_WAITING;
+	w.prio = prio_base_self();
+
+	pthread_mutex_lock(&c->meta_lock);
+	assert((!c->waiters || c->lock == l) && "All waiters must use the same lock");
+	c->lock = l;
+	cond_link(c, &w);
+	pthread_mutex_unlock(&c->meta_lock);
+
+	/* Any boost or demotion goes back with the lock */
+	cb2_lock_release(l);
+
+	while ((state = __atomic_load_n(&w.state, __ATOMIC_ACQUIRE)) ==
+	       COND_WAITING) {
+		if (!abstime) {
+			futex_wait(&w.state, COND_WAITING, NULL);
+			continue;
+		}
+
+		left = abstime->tv_sec * 1000000000LL + abstime->tv_nsec - now_ns();
+		if (left > 0) {
+			timeout.tv_sec = left / 1000000000LL;
+			timeout.tv_nsec = left % 1000000000LL;
+			futex_wait(&w.state, COND_WAITING, &timeout);
+			continue;
+		}
+
+		/* Unless a signal got to us first */
+		pthread_mutex_lock(&c->meta_lock);
+		if (w.state == COND_WAITING) {
+			cond_unlink(c, &w);
+			rc = ETIMEDOUT;
+		}
+		pthread_mutex_unlock(&c->meta_lock);
+
+		if (rc) {
+			break;
+		}
+	}
+
+	if (state == COND_REQUEUED) {
+		cb2_lock_woken(l);
+		__atomic_sub_fetch(&l->parked, 1, __ATOMIC_RELAXED);
+	} else {
+		cb2_lock_acquire(l);
+	}
+
+	return rc;
+}
+
+void cb2_cond_wait(cb2_cond_t *c, cb2_lock_t *l)
+{
+	cb2_cond_timedwait(c, l, NULL);
+}
+
+void cb2_cond_signal(cb2_cond_t *c)
+{
+	struct cb2_cond_waiter *w;
+
+	/* Waiters queue up before they release the lock, so a signaler that
+	 * holds it sees them */
+	if (!__atomic_load_n(&c->waiters, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+
+	pthread_mutex_lock(&c->meta_lock);
+
+	if (c->head) {
+		w = cond_draw(c);
+		cond_unlink(c, w);
+		cond_hand_over(c, w);
+	}
+
+	pthread_mutex_unlock(&c->meta_lock);
+}
+
+void cb2_cond_broadcast(cb2_cond_t *c)
+{
+	struct cb2_cond_waiter *w, *next;
+
+	if (!__atomic_load_n(&c->waiters, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+
+	pthread_mutex_lock(&c->meta_lock);
+
+	for (w = c->head; w; w = next) {
+		next = w->next;
+		cond_unlink(c, w);
+		cond_hand_over(c, w);
+	}
+
+	pthread_mutex_unlock(&c->meta_lock);
+}
+
+void cb2_cond_init(cb2_cond_t *c)
+{
+	if (pthread_mutex_init(&c->meta_lock, NULL) != 0) {
+		errExit("failed to init CB2 condition");
+	}
+
+	c->head = c->tail = NULL;
+	c->waiters = 0;
+	c->lock = NULL;
+	c->requeued = 0;
+}
+
+void cb2_cond_destroy(cb2_cond_t *c)
+{
+	assert(!c->waiters && "Destroying a CB2 condition with waiters");
+
+	if (pthread_mutex_destroy(&c->meta_lock) != 0) {
+		errExit("failed to destroy CB2 condition");
+	}
+}
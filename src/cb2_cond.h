@@ -0,0 +1,57 @@
+#ifndef __CB2_COND_H_
+#define __CB2_COND_H_
+
+#include <time.h>
+#include "runtime_lock.h"
+
+/*
+	Condition variable for the locks in runtime_lock.h. Every waiter
+	sleeps on a word of its own, so signal can choose who to wake: it
+	draws among the waiters, each holding 20 - nice tickets (1 to 40) of
+	the priority it had on its own when it started waiting.
+
+	With a CB2 lock that is held, signal and broadcast don't wake anybody.
+	They move the waiters to sleep on the lock word, and unlocking hands
+	the lock to them one at a time, so a broadcast has no thundering herd.
+
+	A waiter releases the lock, and with it any boost or demotion it got
+	as the owner, so it never sleeps at a priority that was lent to it.
+	All waiters of a condition must use the same lock.
+*/
+
+struct cb2_cond_waiter {
+	int state;
+	/* Nice value of the waiter, for the draw */
+	int prio;
+	struct cb2_cond_waiter *prev, *next;
+};
+
+typedef struct _cb2_cond {
+
+	pthread_mutex_t meta_lock;
+
+	struct cb2_cond_waiter *head, *tail;
+	int waiters;
+
+	/* Lock the waiters use */
+	cb2_lock_t *lock;
+
+	/* Waiters moved to the lock word instead of woken */
+	unsigned long requeued;
+
+} cb2_cond_t;
+
+void cb2_cond_init(cb2_cond_t *c);
+void cb2_cond_destroy(cb2_cond_t *c);
+
+void cb2_cond_wait(cb2_cond_t *c, cb2_lock_t *l);
+
+/* abstime is on CLOCK_MONOTONIC. Returns 0, or ETIMEDOUT once it passed
+ * (with the lock held again in both cases). */
+int cb2_cond_timedwait(cb2_cond_t *c, cb2_lock_t *l,
+		const struct timespec *abstime);
+
+void cb2_cond_signal(cb2_cond_t *c);
+void cb2_cond_broadcast(cb2_cond_t *c);
+
+#endif
@@ -0,0 +1,179 @@
+#ifndef __CB2_FAST_H_
+#define __CB2_FAST_H_
+
+#include <assert.h>
+#include <errno.h>
+
+#include "runtime_lock.h"
+#include "util.h"
+#include "futex.h"
+#include "held.h"
+#include "lockstat.h"
+#include "prio.h"
+#include "trace.h"
+
+/*
+	Uncontended paths of the CB2 protocols (CB2_lock and CB2_queue_lock).
+	Both keep the owner TID plus a waiters bit in the lock word, so taking
+	a free lock or giving back one nobody waits for is a single CAS. The
+	vtables in cb2_lock.c and cb2_queue_lock.c are built from these, and
+	so is the C++ API (cb2_mutex.hpp), which gets them inlined. Anything
+	that has to wait goes to the protocol's slow path.
+*/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* CB2 slow path, with a deadline (CLOCK_MONOTONIC ns, 0 for none). Returns
+ * 0 with the lock held, or ETIMEDOUT. See cb2_lock.c. */
+int cb2_lock_contended(cb2_lock_t *l, pid_t me, long long deadline);
+void cb2_unlock_contended(cb2_lock_t *l, pid_t me);
+
+/* CB2 queue slow paths, see cb2_queue_lock.c */
+void cb2q_lock_contended(cb2_lock_t *l, pid_t me);
+void cb2q_unlock_contended(cb2_lock_t *l, pid_t me);
+
+/* A new owner on one of demote_cpus drops itself to nice 19 */
+void cb2_demote_owner(cb2_lock_t *l, pid_t me);
+
+#ifdef __cplusplus
+}
+#endif
+
+static inline int cb2_fast_take(cb2_lock_t *l, pid_t me, int waiters)
+{
+	int cur = LOCK_WORD_FREE;
+
+	return __atomic_compare_exchange_n(&l->word, &cur, me | waiters, 0,
+			__ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+/* Bookkeeping of a new owner */
+static inline void cb2_fast_acquired(cb2_lock_t *l, pid_t me)
+{
+	lockstat_acquired(l);
+
+	/* sched_getcpu() reads the rseq area, this is not a syscall */
+	l->owner_cpu = sched_getcpu();
+	held_push(l);
+
+	if (cb2_lock_demotes(l, l->owner_cpu)) {
+		cb2_demote_owner(l, me);
+	}
+
+	trace(TRACE_ACQUIRE, l, prio_self(), 0, 0);
+}
+
+/* Never waits, so a try never boosts anybody */
+static inline int cb2_fast_trylock(cb2_lock_t *l)
+{
+	pid_t me = self_tid();
+
+	/* Keep the waiters bit if somebody may be parked */
+	if (!cb2_fast_take(l, me, __atomic_load_n(&l->parked,
+			__ATOMIC_RELAXED) ? LOCK_WORD_WAITERS : 0)) {
+		return EBUSY;
+	}
+
+	cb2_fast_acquired(l, me);
+	return 0;
+}
+
+/* Nobody waits and nobody touched our priority. Returns 0 if the slow path
+ * has to release the lock. */
+static inline int cb2_fast_release(cb2_lock_t *l, pid_t me)
+{
+	int expected = me;
+
+	assert((l->word & LOCK_WORD_TID_MASK) == me);
+
+	if (l->restore_pending || !__atomic_compare_exchange_n(&l->word,
+			&expected, LOCK_WORD_FREE, 0, __ATOMIC_RELEASE,
+			__ATOMIC_RELAXED)) {
+		return 0;
+	}
+
+	held_release(l, NULL, 0);
+	return 1;
+}
+
+/* --------------------------------- CB2 ---------------------------------- */
+
+static inline void cb2_fast_lock(cb2_lock_t *l)
+{
+	pid_t me = self_tid();
+	unsigned long since;
+
+	if (!cb2_fast_take(l, me, 0)) {
+		since = lockstat_now();
+		trace(TRACE_ATTEMPT, l, prio_self(), 0, 0);
+		cb2_lock_contended(l, me, 0);
+		lockstat_waited(l, since);
+	}
+
+	cb2_fast_acquired(l, me);
+}
+
+/* deadline is CLOCK_MONOTONIC ns. Returns 0, or ETIMEDOUT. */
+static inline int cb2_fast_timedlock(cb2_lock_t *l, long long deadline)
+{
+	pid_t me = self_tid();
+	unsigned long since;
+
+	if (!cb2_fast_take(l, me, 0)) {
+		since = lockstat_now();
+		trace(TRACE_ATTEMPT, l, prio_self(), 0, 0);
+
+		/* A deadline of 0 would mean none, but it is long gone anyway */
+		if (cb2_lock_contended(l, me, (deadline > 0) ? deadline : 1) ==
+				ETIMEDOUT) {
+			return ETIMEDOUT;
+		}
+		lockstat_waited(l, since);
+	}
+
+	cb2_fast_acquired(l, me);
+	return 0;
+}
+
+static inline void cb2_fast_unlock(cb2_lock_t *l)
+{
+	pid_t me = self_tid();
+
+	lockstat_released(l);
+	trace(TRACE_RELEASE, l, 0, 0, 0);
+	if (!cb2_fast_release(l, me)) {
+		cb2_unlock_contended(l, me);
+	}
+}
+
+/* ------------------------------ CB2 queue ------------------------------- */
+
+static inline void cb2q_fast_lock(cb2_lock_t *l)
+{
+	pid_t me = self_tid();
+	unsigned long since;
+
+	if (!cb2_fast_take(l, me, 0)) {
+		since = lockstat_now();
+		trace(TRACE_ATTEMPT, l, prio_self(), 0, 0);
+		cb2q_lock_contended(l, me);
+		lockstat_waited(l, since);
+	}
+
+	cb2_fast_acquired(l, me);
+}
+
+static inline void cb2q_fast_unlock(cb2_lock_t *l)
+{
+	pid_t me = self_tid();
+
+	lockstat_released(l);
+	trace(TRACE_RELEASE, l, 0, 0, 0);
+	if (!cb2_fast_release(l, me)) {
+		cb2q_unlock_contended(l, me);
+	}
+}
+
+#endif
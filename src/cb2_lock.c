@@ -7,22 +7,32 @@
 */
 #include "runtime_lock.h"
 #include "util.h"
+#include "futex.h"
+#include "prio.h"
+#include "lottery.h"
+#include "tickets.h"
+#include "boost.h"
+#include "chain.h"
+#include "held.h"
+#include "topology.h"
+#include "cb2_fast.h"
+#include "trace.h"
+
+/* Spin budget, in cpu_relax() rounds, before parking on the futex */
+#define CB2_SPIN_MIN 16
+#define CB2_SPIN_MAX 4096
+#define CB2_BACKOFF_MAX 64
+
+/* Rounds a spinner lets a nearer one take a free lock first */
+#define CB2_COHORT_DEFER 64
+
+/* How often a waiter that lost the lottery draws again */
+#define CB2_LOTTERY_PERIOD_NS 1000000
 
 #ifdef __APPLY_MAP_K__
 #include "map.h"
 #endif
 
-static pthread_mutex_t lock;
-static pthread_mutex_t meta_lock;
-static __thread int original_priority = 0;
-
-static volatile pid_t owner_tid = 0;
-static volatile int owner_priority;
-
-static volatile int bystander_tickets_cpu;
-
-static time_t t;
-
 /* The K factor accounts for the number of times the high-priority thread
  * and the low-priority thread have benefited from the Priority Inversion.
  * We need to maintain a hash map of pids-times and also apply a tunning
@@ -38,7 +48,6 @@ int compute_times_factor(pid_t HP_pid)
 	*/ 
 
 #ifdef __APPLY_MAP_K__
-	insert_if_new(HP_pid);
 	ret = initial_K;
 	ret -= get_and_increase(HP_pid);
 	ret = (ret > 0)? ret : 0;
@@ -49,25 +58,29 @@ int compute_times_factor(pid_t HP_pid)
 	return ret;
 }
 
-/* Lottery system to guarantee fairness on the affected core */
-int cb2_lock_inversion(int HP_prio, pid_t HP_pid)
-{
-	int winning_ticket,sum = bystander_tickets_cpu;
-	int tickets_LP, K, ret = 0;
+__thread struct cb2_thread_stats cb2_self_stats;
 
-	K = compute_times_factor(HP_pid);
+/* The draw itself: the low-priority side holds tickets_LP, the bystanders it
+ * would take CPU time from hold the rest */
+int cb2_lottery(int bystander_tickets, int tickets_LP, pid_t HP_pid)
+{
+	int winning_ticket = 0, sum = bystander_tickets, ret = 0;
 
-	tickets_LP = HP_prio + owner_priority + K;
-	
+	tickets_LP += compute_times_factor(HP_pid);
 	sum += tickets_LP;
 
-	winning_ticket = rand() % sum;
+	/* Without tickets of its own the owner can never win */
+	if (tickets_LP > 0) {
+		winning_ticket = lottery_bounded(sum);
+	}
 
 	/* Has the high-priority thread won the lottery? */
-	if (winning_ticket > bystander_tickets_cpu){
+	if (winning_ticket > bystander_tickets){
 		ret = 1;
+		cb2_self_stats.lottery_won++;
 	} 
 	else {
+		cb2_self_stats.lottery_lost++;
 #ifdef __APPLY_MAP_K__
 		map_decrease(HP_pid);
 #endif
@@ -76,138 +89,434 @@ int cb2_lock_inversion(int HP_prio, pid_t HP_pid)
 	return ret;
 }
 
-static void cb2_lock(void)
+/* Lottery system to guarantee fairness on the affected core */
+int cb2_lock_inversion(cb2_lock_t *l, int HP_prio, pid_t HP_pid)
 {
-	pid_t me = gettid();
-	int rc;
+	int bystander_tickets, tickets_LP, cpu, won;
+	pid_t owner = l->word & LOCK_WORD_TID_MASK;
 
-	original_priority = getpriority(PRIO_PROCESS, me);
+	/* The owner may have moved since it took the lock. If it did not
+	 * register, the CPU it took the lock on is the best we know. */
+	if ((cpu = tickets_cpu_of(owner)) >= 0) {
+		l->owner_cpu = cpu;
+	}
 
-	if (original_priority == -1) {
-		errExit("Error getting the thread priority");
+	/* The bystanders that matter are the ones sharing the owner's core.
+	 * Without any live accounting, use what we were told at init. */
+	bystander_tickets = tickets_on_cpu(l->owner_cpu, owner);
+	if (bystander_tickets == 0) {
+		bystander_tickets = l->bystander_tickets_cpu;
 	}
 
-try_again:
-	/* Acquire the metadata lock then the other mutex */
-	pthread_mutex_lock(&meta_lock);
+	/* Each boost backend values a boost in its own units */
+	tickets_LP = l->boost->tickets(HP_prio, l->owner_priority);
+	won = cb2_lottery(bystander_tickets, tickets_LP, HP_pid);
+	trace(TRACE_LOTTERY, l, bystander_tickets, tickets_LP, won);
 
-	rc = pthread_mutex_trylock(&lock);
+	if (won) {
+		lockstat_count(l, lottery_won);
+	} else {
+		lockstat_count(l, lottery_lost);
+	}
 
-	if (rc == 0) {
-		/* We acquired the lock. Set metadata and continue into CS */
-		owner_tid = me;
-		LOG_DEBUG("got it %d\n", me);
+	return won;
+}
 
-		if (sched_getcpu() == 0) {
-			if (setpriority(PRIO_PROCESS, me, 19) == -1) {
-				errExit("Error setting the thread priority");
-			}
+/* The owner drops itself to nice 19 on the benchmark's low-priority CPUs, and
+ * the unlock must undo it. */
+void cb2_demote_owner(cb2_lock_t *l, pid_t me)
+{
+	unsigned long calls = prio_syscalls_self;
+
+	pthread_mutex_lock(&l->meta_lock);
+
+	/* A waiter may have boosted us before we got here, we should not
+	 * undo its work */
+	if (!l->restore_pending) {
+		l->restore_pending = 1;
+
+		if (prio_set(me, 19) == -1) {
+			errExit("Error setting the thread priority");
 		}
+		lockstat_syscalls(l, calls);
+	}
 
-		pthread_mutex_unlock(&meta_lock);
-	} 
-	else if (rc == EBUSY) {
-		/* We did not acquire the lock. We might be able to update
-		 * owner priority to speed things up. */
-
-		assert(owner_tid != -1);
-		owner_priority = getpriority(PRIO_PROCESS, owner_tid);
-		if (owner_priority == -1) {
-			errExit("Error getting the owner priority");
+	pthread_mutex_unlock(&l->meta_lock);
+}
+
+/* Is there a spinner closer to the last owner than level? */
+static inline int cb2_nearer_spinner(cb2_lock_t *l, int level)
+{
+	int i;
+
+	for (i = 0; i < level; i++) {
+		if (__atomic_load_n(&l->cohort[i], __ATOMIC_RELAXED)) {
+			return 1;
 		}
+	}
+
+	return 0;
+}
+
+/* Spin for a while in the hope that the owner leaves soon. There is no point
+ * in it if the owner shares our CPU: it cannot run while we spin. The budget
+ * adapts to how long the lock was held the last times we spun on it.
+ *
+ * Spinners are all equal, so when the lock is freed the ones that share a
+ * last level cache (or else a node) with the last owner get the first go at
+ * it, cohort style: the lock and the data it protects stay in that cache. */
+static int cb2_spin(cb2_lock_t *l, pid_t me)
+{
+	int spins = 0, backoff = 1, deferred = 0, taken = 0, limit, level, i;
+	int max = l->spin_limit * 2 + CB2_SPIN_MIN, cpu = sched_getcpu();
+
+	limit = (max < CB2_SPIN_MAX) ? max : CB2_SPIN_MAX;
 
-		/* If the priority of the owner is already high enough, then we can
-		 * just sleep on the main lock */
-		LOG_DEBUG("owner %d\tme %d\n", owner_priority, original_priority);
-		if (owner_priority > original_priority) {
-			LOG_DEBUG("time to beef up the owner %d\n", me);
-
-			/* Can we update his priority? */
-			if (cb2_lock_inversion(original_priority,me)){
-				LOG_DEBUG("HEY, in lock inversion %d\n", me);
-
-				/* Raise owner priority */
-				if (setpriority(PRIO_PROCESS, owner_tid, 
-				   original_priority) == -1) {
-					errExit("Error setting the owner priority");
-				}
+	level = topology_distance(cpu, l->owner_cpu) - TOPO_SAME_LLC;
+	level = (level < 0) ? 0 : level;
+	__atomic_add_fetch(&l->cohort[level], 1, __ATOMIC_RELAXED);
+
+	while (spins < limit) {
+		int cur = __atomic_load_n(&l->word, __ATOMIC_RELAXED);
+
+		if (cur == LOCK_WORD_FREE) {
+			if (deferred < CB2_COHORT_DEFER && cb2_nearer_spinner(l, level)) {
+				deferred++;
+				cpu_relax();
+				continue;
+			}
+
+			/* Keep the waiters bit if somebody may be parked */
+			if (cb2_fast_take(l, me, __atomic_load_n(&l->parked,
+					__ATOMIC_RELAXED) ? LOCK_WORD_WAITERS : 0)) {
+				taken = 1;
+				break;
 			}
-			pthread_mutex_unlock(&meta_lock);
-			goto try_again;
+			continue;
 		}
 
-		/* Now, we can wait for the main lock */
-		pthread_mutex_unlock(&meta_lock);
+		if (__atomic_load_n(&l->owner_cpu, __ATOMIC_RELAXED) == cpu) {
+			break;
+		}
+
+		for (i = 0; i < backoff; i++) {
+			cpu_relax();
+		}
+		spins += backoff;
+		backoff = (backoff < CB2_BACKOFF_MAX) ? backoff * 2 : backoff;
+	}
 
-		LOG_DEBUG("now we wait... %d\n", me);
-		pthread_mutex_lock(&lock);
+	__atomic_sub_fetch(&l->cohort[level], 1, __ATOMIC_RELAXED);
+	l->spin_limit += (spins - l->spin_limit) / 8;
+	return taken;
+}
 
-		/* Reacquire the metadata lock, fix metadata, then enter CS */
-		pthread_mutex_lock(&meta_lock);
-		owner_tid = me;
+/* Under meta_lock. Make sure the owner cannot release without meta_lock, so
+ * it stays the owner for as long as we hold it. Returns the lock word, or
+ * LOCK_WORD_FREE if there is no owner. */
+static int cb2_set_waiters(cb2_lock_t *l)
+{
+	int cur = __atomic_load_n(&l->word, __ATOMIC_RELAXED);
 
-		if (sched_getcpu() == 0) {
-			if (setpriority(PRIO_PROCESS, me, 19) == -1) {
-				errExit("Error setting the thread priority");
-			}
+	while (cur != LOCK_WORD_FREE && !(cur & LOCK_WORD_WAITERS)) {
+		if (__atomic_compare_exchange_n(&l->word, &cur,
+				cur | LOCK_WORD_WAITERS, 0, __ATOMIC_RELAXED,
+				__ATOMIC_RELAXED)) {
+			return cur | LOCK_WORD_WAITERS;
 		}
-		pthread_mutex_unlock(&meta_lock);
-	} 
-	else {
-		errExit("something went terribly wrong when we tried to get a lock...");
 	}
+
+	return cur;
 }
 
-static void cb2_unlock(void)
+/* Under meta_lock, with the waiters bit set. Returns 0 if the owner is below
+ * prio and we lost the lottery, 1 otherwise. */
+static int cb2_boost_locked(cb2_lock_t *l, pid_t owner, int prio, pid_t me)
 {
-	pid_t me = gettid();
+	unsigned long calls;
 
-	pthread_mutex_lock(&meta_lock);
+	/* Not every backend shows up in the nice value, so we also remember
+	 * what we boosted the owner to */
+	l->owner_priority = prio_of(owner);
+	if (l->boosted_to < l->owner_priority) {
+		l->owner_priority = l->boosted_to;
+	}
 
-	/* Release the CS lock now */
-	pthread_mutex_unlock(&lock);
+	/* If the priority of the owner is already high enough, then we can
+	 * just sleep on the lock word */
+	if (l->owner_priority <= prio) {
+		return 1;
+	}
 
-	/* reset priority and metadata */
-	owner_tid = -1;
-	pthread_mutex_unlock(&meta_lock);
+	LOG_DEBUG("time to beef up the owner %d\n", me);
 
-	if (setpriority(PRIO_PROCESS, me, original_priority) == -1) {
-		errExit("Error setting the thread priority");
+	/* Can we update his priority? */
+	if (!cb2_lock_inversion(l, prio, me)) {
+		return 0;
 	}
+	LOG_DEBUG("HEY, in lock inversion %d\n", me);
+
+	/* The unlock works out what the owner goes back to (see held.h) */
+	l->restore_pending = 1;
+
+	/* Raise owner priority. The owner may be giving back a boost of
+	 * another lock right now, and it must see this one first. */
+	__atomic_store_n(&l->boosted_to, prio, __ATOMIC_SEQ_CST);
+	calls = prio_syscalls_self;
+	if (l->boost->boost(owner, prio) == -1) {
+		errExit("Error setting the owner priority");
+	}
+	cb2_self_stats.boosts++;
+	lockstat_count(l, boosts);
+	lockstat_syscalls(l, calls);
+	trace(TRACE_BOOST, l, owner, prio, 0);
+
+	return 1;
 }
 
-static void 
-cb2_init(runtime_lock_attr *attr)
+static pid_t cb2_owner(cb2_lock_t *l)
 {
-	int rc = 0;
-	rc |= pthread_mutex_init(&lock, NULL);
-	rc |= pthread_mutex_init(&meta_lock, NULL);
+	return __atomic_load_n(&l->word, __ATOMIC_RELAXED) & LOCK_WORD_TID_MASK;
+}
 
-	if (rc != 0) {
-		errExit("failed to init CB2lock");
+/* For a waiter at the other end of a chain of blocked owners */
+static int cb2_boost_owner(cb2_lock_t *l, int prio, pid_t waiter)
+{
+	int cur, ret = 1;
+
+	pthread_mutex_lock(&l->meta_lock);
+
+	if ((cur = cb2_set_waiters(l)) != LOCK_WORD_FREE) {
+		ret = cb2_boost_locked(l, cur & LOCK_WORD_TID_MASK, prio, waiter);
 	}
 
-	/* Initialize random num generator */
-	srand((unsigned) time(&t));
+	pthread_mutex_unlock(&l->meta_lock);
 
-	/* We should update this value everytime a thread is assigned to a core,
-	*  but unless this is implemented at CFS, it's a big overhead. For the 
-	*  purpose of this proof of concept, we will assume a scenario where 
-	*  bystander threads do not come and go, without losing generality.                                     
-	*/   
-	bystander_tickets_cpu = attr->by_tickets_cpu;
-	assert(bystander_tickets_cpu > 0 && "We need a positive value of tickets");
+	return ret;
 }
 
-static void cb2_destroy(void) 
+/* Only reached when the lock word was not free. We spin for a bounded time
+ * and then park on the lock word. The priority bookkeeping and the lottery
+ * happen once per trip to the futex, never in a busy loop. With a deadline
+ * (CLOCK_MONOTONIC ns, 0 for none) we give up with ETIMEDOUT once it passed,
+ * otherwise this returns 0 with the lock held. */
+int cb2_lock_contended(cb2_lock_t *l, pid_t me, long long deadline)
 {
-	int rc = 0;
-	rc |= pthread_mutex_destroy(&lock);
-	rc |= pthread_mutex_destroy(&meta_lock);
+	struct timespec timeout, *wait_for;
+	long long blocked_since = 0, blocked_for;
+	int cur, original_priority, chained;
+	pid_t owner;
+
+	if (cb2_spin(l, me)) {
+		lockstat_count(l, spin_acquired);
+		return 0;
+	}
+
+	original_priority = prio_base_self();
+	__atomic_add_fetch(&l->parked, 1, __ATOMIC_RELAXED);
+	prio_blocked_on(l);
+
+	if (l->boost_delay_ns) {
+		blocked_since = now_ns();
+	}
 
-	if (rc != 0) {
+try_again:
+	/* Somebody else may still sleep on the word, so keep the waiters
+	 * bit: the unlock will then wake the next one. */
+	if (cb2_fast_take(l, me, LOCK_WORD_WAITERS)) {
+		LOG_DEBUG("got it %d\n", me);
+		prio_blocked_on(NULL);
+		__atomic_sub_fetch(&l->parked, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	pthread_mutex_lock(&l->meta_lock);
+
+	if ((cur = cb2_set_waiters(l)) == LOCK_WORD_FREE) {
+		pthread_mutex_unlock(&l->meta_lock);
+		lockstat_count(l, try_again);
+		goto try_again;
+	}
+	owner = cur & LOCK_WORD_TID_MASK;
+	wait_for = NULL;
+	chained = 0;
+
+	/* We did not acquire the lock. We might be able to update
+	 * owner priority to speed things up. */
+	l->owner_priority = prio_of(owner);
+	if (l->boosted_to < l->owner_priority) {
+		l->owner_priority = l->boosted_to;
+	}
+
+	LOG_DEBUG("owner %d\tme %d\n", l->owner_priority, original_priority);
+	blocked_for = blocked_since ? now_ns() - blocked_since : 0;
+
+	if (l->owner_priority > original_priority &&
+	    blocked_for < l->boost_delay_ns) {
+		/* Most critical sections are over before this, so the owner is
+		 * left alone until we have been blocked for long enough */
+		timeout.tv_sec = (l->boost_delay_ns - blocked_for) / 1000000000LL;
+		timeout.tv_nsec = (l->boost_delay_ns - blocked_for) % 1000000000LL;
+		wait_for = &timeout;
+	}
+	else if (prio_blocked_of(owner)) {
+		/* The owner sleeps itself, whoever it waits for is the one to
+		 * boost. The chain may change, so we look again later. */
+		chained = 1;
+	}
+	else if (!cb2_boost_locked(l, owner, original_priority, me)) {
+		timeout.tv_sec = 0;
+		timeout.tv_nsec = CB2_LOTTERY_PERIOD_NS;
+		wait_for = &timeout;
+	}
+
+	/* Now, we can wait for the lock word. If we lost the lottery, or it's
+	 * too early to draw, we wake up after a while to try again. */
+	pthread_mutex_unlock(&l->meta_lock);
+
+	if (chained) {
+		chain_boost(l, original_priority, me);
+		timeout.tv_sec = 0;
+		timeout.tv_nsec = CB2_LOTTERY_PERIOD_NS;
+		wait_for = &timeout;
+	}
+
+	if (deadline) {
+		long long left = deadline - now_ns();
+
+		/* The waiters bit stays, the owner just wakes nobody for us */
+		if (left <= 0) {
+			prio_blocked_on(NULL);
+			__atomic_sub_fetch(&l->parked, 1, __ATOMIC_RELAXED);
+			return ETIMEDOUT;
+		}
+
+		if (!wait_for || left < timeout.tv_sec * 1000000000LL +
+				timeout.tv_nsec) {
+			timeout.tv_sec = left / 1000000000LL;
+			timeout.tv_nsec = left % 1000000000LL;
+			wait_for = &timeout;
+		}
+	}
+
+	LOG_DEBUG("now we wait... %d\n", me);
+	lockstat_count(l, futex_waits);
+	futex_wait(&l->word, cur, wait_for);
+	lockstat_count(l, try_again);
+	goto try_again;
+}
+
+/* Uncontended, this is a single CAS on the lock word */
+static void cb2_lock(cb2_lock_t *l)
+{
+	cb2_fast_lock(l);
+}
+
+static int cb2_trylock(cb2_lock_t *l)
+{
+	return cb2_fast_trylock(l);
+}
+
+static int cb2_timedlock(cb2_lock_t *l, const struct timespec *abstime)
+{
+	return cb2_fast_timedlock(l, abstime->tv_sec * 1000000000LL +
+		abstime->tv_nsec);
+}
+
+/* For threads that were moved to sleep on the lock word from somewhere else
+ * (see cb2_cond.c). Others may still sleep there, so we go straight to the
+ * slow path, which keeps the waiters bit. */
+void cb2_lock_woken(cb2_lock_t *l)
+{
+	pid_t me = self_tid();
+	unsigned long since;
+
+	if (!cb2_fast_take(l, me, LOCK_WORD_WAITERS)) {
+		since = lockstat_now();
+		trace(TRACE_ATTEMPT, l, prio_self(), 0, 0);
+		cb2_lock_contended(l, me, 0);
+		lockstat_waited(l, since);
+	}
+
+	cb2_fast_acquired(l, me);
+}
+
+static void cb2_unlock(cb2_lock_t *l)
+{
+	cb2_fast_unlock(l);
+}
+
+/* The lock word has the waiters bit, or the priority of the owner changed */
+void cb2_unlock_contended(cb2_lock_t *l, __attribute__((unused)) pid_t me)
+{
+	unsigned long calls = prio_syscalls_self;
+	int restore, boosted;
+
+	pthread_mutex_lock(&l->meta_lock);
+
+	restore = l->restore_pending;
+	boosted = (l->boosted_to != BOOST_NONE);
+	l->restore_pending = 0;
+	__atomic_store_n(&l->boosted_to, BOOST_NONE, __ATOMIC_SEQ_CST);
+
+	/* Release the lock word now and hand it to one sleeper */
+	if (__atomic_exchange_n(&l->word, LOCK_WORD_FREE, __ATOMIC_RELEASE) &
+	    LOCK_WORD_WAITERS) {
+		futex_wake(&l->word, 1);
+	}
+
+	pthread_mutex_unlock(&l->meta_lock);
+
+	/* Giving back a boost is deferred if we were told so, in case we get
+	 * the lock (and the boost) again soon. A demotion was a nice value. */
+	if (held_release(l, !restore ? NULL : boosted ? l->boost : &nice_boost,
+			l->unboost_delay_ns) == -1) {
+		errExit("Error restoring the thread priority");
+	}
+	if (restore) {
+		lockstat_syscalls(l, calls);
+		trace(TRACE_UNBOOST, l, boosted, 0, 0);
+	}
+}
+
+static void 
+cb2_init(cb2_lock_t *l, runtime_lock_attr *attr)
+{
+	if (pthread_mutex_init(&l->meta_lock, NULL) != 0) {
+		errExit("failed to init CB2lock");
+	}
+
+	l->word = LOCK_WORD_FREE;
+	l->restore_pending = 0;
+	l->parked = 0;
+	l->spin_limit = 0;
+	memset(l->cohort, 0, sizeof(l->cohort));
+	lockstat_init(l);
+	l->demote_cpus = attr->demote_cpus;
+	l->boost = attr->boost ? attr->boost : &nice_boost;
+	l->boosted_to = BOOST_NONE;
+	l->boost_delay_ns = attr->boost_delay_ns;
+	l->unboost_delay_ns = attr->unboost_delay_ns;
+
+	/* The live per-CPU tickets (see tickets.c) are used whenever threads
+	*  registered on the owner's core. This value is only the fallback for
+	*  cores nobody reported on.
+	*/
+	l->owner_cpu = 0;
+	l->bystander_tickets_cpu = attr->by_tickets_cpu;
+	assert(l->bystander_tickets_cpu >= 0 && "We need a positive value of tickets");
+}
+
+static void cb2_destroy(cb2_lock_t *l) 
+{
+	assert(l->word == LOCK_WORD_FREE && "Destroying a CB2lock that is held");
+
+	if (pthread_mutex_destroy(&l->meta_lock) != 0) {
 		errExit("failed to destroy CB2lock");
 	}
+
+	chain_quiesce();
+	lockstat_destroy(l);
 }
 
 runtime_lock CB2_lock = {
@@ -216,5 +525,10 @@ runtime_lock CB2_lock = {
 	.lock         = cb2_lock,
 	.unlock       = cb2_unlock,
 	.init         = cb2_init,
-	.destroy      = cb2_destroy
+	.destroy      = cb2_destroy,
+	.owner        = cb2_owner,
+	.boost_owner  = cb2_boost_owner,
+	.trylock      = cb2_trylock,
+	.timedlock    = cb2_timedlock,
+	.stats        = lockstat_collect
 };
@@ -0,0 +1,246 @@
+#ifndef __CB2_MUTEX_HPP_
+#define __CB2_MUTEX_HPP_
+
+#include <chrono>
+#include <ctime>
+#include <cstring>
+#include <type_traits>
+
+#include "cb2_fast.h"
+#include "boost.h"
+
+/*
+	C++ API. cb2::basic_mutex<Protocol, BoostBackend, TicketSource> meets
+	the Lockable and TimedLockable requirements, so it works with
+	std::lock_guard, std::unique_lock and std::scoped_lock:
+
+		cb2::basic_mutex<cb2::cb2_protocol, cb2::boost_fifo> m;
+
+		std::scoped_lock guard(m);
+
+	The policies are types, so the compiler knows which protocol it calls:
+	for the CB2 protocols an uncontended lock or unlock inlines down to a
+	CAS on the lock word (see cb2_fast.h), and only the slow paths are
+	function calls. The C vtables are built from the same code.
+
+	Any other protocol of runtime_lock.h goes through its vtable, with
+	cb2::vtable_protocol<mutex_lock>. It has to be able to try a lock, so
+	making a mutex of any other protocol exits with an error. Attributes
+	the policies do not cover (demote_cpus, boost delays, the ceiling)
+	can be passed to the constructor.
+
+	cb2::queue_mutex is only Lockable. Its waiters queue up, and a queued
+	waiter cannot leave before its turn, so it has no try_lock_for() or
+	try_lock_until(). Its try_lock() fails while anybody waits.
+
+	make check builds and runs mutex_check.cpp, which takes every policy
+	through the standard lock guards from several threads.
+*/
+
+namespace cb2 {
+
+/* Deadlines are CLOCK_MONOTONIC, which is what steady_clock is on Linux */
+static inline long long steady_ns(std::chrono::steady_clock::time_point t)
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		t.time_since_epoch()).count();
+}
+
+/* For protocols that cannot wait with a deadline */
+static inline bool poll_until(cb2_lock_t *l, int (*trylock)(cb2_lock_t *),
+		long long deadline)
+{
+	struct timespec poll = { 0, 50000 };
+
+	while (trylock(l) == EBUSY) {
+		if (now_ns() >= deadline) {
+			return false;
+		}
+		nanosleep(&poll, NULL);
+	}
+
+	return true;
+}
+
+/* ------------------------------ protocols ------------------------------- */
+
+/* timed says whether the protocol has lock_until(), for a TimedLockable
+ * mutex */
+struct cb2_protocol {
+	static const bool timed = true;
+	static const runtime_lock &ops() { return CB2_lock; }
+
+	static void lock(cb2_lock_t *l) { cb2_fast_lock(l); }
+	static bool try_lock(cb2_lock_t *l) { return cb2_fast_trylock(l) == 0; }
+	static void unlock(cb2_lock_t *l) { cb2_fast_unlock(l); }
+
+	static bool lock_until(cb2_lock_t *l, long long deadline)
+	{
+		return cb2_fast_timedlock(l, deadline) == 0;
+	}
+};
+
+struct cb2_queue_protocol {
+	static const bool timed = false;
+	static const runtime_lock &ops() { return CB2_queue_lock; }
+
+	static void lock(cb2_lock_t *l) { cb2q_fast_lock(l); }
+	static bool try_lock(cb2_lock_t *l) { return cb2_fast_trylock(l) == 0; }
+	static void unlock(cb2_lock_t *l) { cb2q_fast_unlock(l); }
+};
+
+/* Through the vtable, one indirect call per operation. The protocol needs
+ * trylock to be Lockable, see basic_mutex::init(). */
+template <runtime_lock &Ops>
+struct vtable_protocol {
+	static const bool timed = true;
+	static const runtime_lock &ops() { return Ops; }
+
+	static void lock(cb2_lock_t *l) { Ops.lock(l); }
+	static void unlock(cb2_lock_t *l) { Ops.unlock(l); }
+
+	static bool try_lock(cb2_lock_t *l) { return Ops.trylock(l) == 0; }
+
+	static bool lock_until(cb2_lock_t *l, long long deadline)
+	{
+		struct timespec abstime = {
+			(time_t)(deadline / 1000000000LL),
+			(long)(deadline % 1000000000LL)
+		};
+
+		if (!Ops.timedlock) {
+			return poll_until(l, Ops.trylock, deadline);
+		}
+		return Ops.timedlock(l, &abstime) == 0;
+	}
+};
+
+/* --------------------------- boost backends ----------------------------- */
+
+struct boost_nice {
+	static const boost_backend *get() { return &nice_boost; }
+};
+
+struct boost_fifo {
+	static const boost_backend *get() { return &fifo_boost; }
+};
+
+struct boost_rr {
+	static const boost_backend *get() { return &rr_boost; }
+};
+
+struct boost_uclamp {
+	static const boost_backend *get() { return &uclamp_boost; }
+};
+
+/* ---------------------------- ticket sources ---------------------------- */
+
+/* Only what threads register on each CPU (see tickets.h) */
+struct live_tickets {
+	static int by_tickets_cpu() { return 0; }
+};
+
+/* Like live_tickets, but N per CPU for the CPUs nobody registered on */
+template <int N>
+struct fixed_tickets {
+	static_assert(N >= 0, "We need a positive value of tickets");
+	static int by_tickets_cpu() { return N; }
+};
+
+/* -------------------------------- mutex --------------------------------- */
+
+template <class Protocol, class BoostBackend = boost_nice,
+	class TicketSource = live_tickets>
+class basic_mutex {
+
+public:
+	typedef cb2_lock_t *native_handle_type;
+
+	basic_mutex()
+	{
+		runtime_lock_attr attr;
+
+		memset(&attr, 0, sizeof(attr));
+		init(attr);
+	}
+
+	/* The policies override attr.boost and attr.by_tickets_cpu */
+	explicit basic_mutex(runtime_lock_attr attr)
+	{
+		init(attr);
+	}
+
+	~basic_mutex()
+	{
+		Protocol::ops().destroy(&l_);
+	}
+
+	basic_mutex(const basic_mutex &) = delete;
+	basic_mutex &operator=(const basic_mutex &) = delete;
+
+	void lock() { Protocol::lock(&l_); }
+	bool try_lock() { return Protocol::try_lock(&l_); }
+	void unlock() { Protocol::unlock(&l_); }
+
+	/* Only there if the protocol is timed */
+	template <class Rep, class Period, class P = Protocol>
+	std::enable_if_t<P::timed, bool>
+	try_lock_for(const std::chrono::duration<Rep, Period> &d)
+	{
+		return try_lock_until(std::chrono::steady_clock::now() + d);
+	}
+
+	template <class Duration, class P = Protocol>
+	std::enable_if_t<P::timed, bool>
+	try_lock_until(const std::chrono::time_point<
+			std::chrono::steady_clock, Duration> &t)
+	{
+		return P::lock_until(&l_, steady_ns(
+			std::chrono::time_point_cast<
+				std::chrono::steady_clock::duration>(t)));
+	}
+
+	/* Other clocks are taken as an amount of time from now */
+	template <class Clock, class Duration, class P = Protocol>
+	std::enable_if_t<P::timed, bool>
+	try_lock_until(const std::chrono::time_point<Clock, Duration> &t)
+	{
+		return try_lock_for(t - Clock::now());
+	}
+
+	native_handle_type native_handle() { return &l_; }
+
+	/* See lockstat.h. False if the protocol keeps none. */
+	bool stats(cb2_lock_stats &s)
+	{
+		return cb2_lock_get_stats(&l_, &s) == 0;
+	}
+
+private:
+	void init(runtime_lock_attr &attr)
+	{
+		/* The vtable is only known at run time */
+		if (!Protocol::ops().trylock) {
+			errno = EINVAL;
+			errExit("A mutex needs a protocol that can try a lock");
+		}
+
+		attr.boost = BoostBackend::get();
+
+		/* Shares room with the ceiling of the protect protocols */
+		if (Protocol::ops().type == RT_CB2 ||
+		    Protocol::ops().type == RT_CB2_QUEUE) {
+			attr.by_tickets_cpu = TicketSource::by_tickets_cpu();
+		}
+		cb2_lock_init(&l_, &Protocol::ops(), &attr);
+	}
+
+	cb2_lock_t l_;
+};
+
+typedef basic_mutex<cb2_protocol> mutex;
+typedef basic_mutex<cb2_queue_protocol> queue_mutex;
+
+}
+
+#endif
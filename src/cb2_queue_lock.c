@@ -0,0 +1,313 @@
+#include "runtime_lock.h"
+#include "util.h"
+#include "futex.h"
+#include "prio.h"
+#include "lottery.h"
+#include "held.h"
+#include "boost.h"
+#include "topology.h"
+#include "cb2_fast.h"
+#include "trace.h"
+
+/* Queue-based CB2Lock. Waiters queue up, each one spinning and then sleeping
+ * on a cache line of its own, and the owner hands the lock straight to a
+ * waiter drawn by lottery, with 20 - nice tickets each (1 to 40). Nobody
+ * races for a released lock, and waiters get the lock in proportion to their
+ * priority. Among waiters with the same tickets the one closest to the owner
+ * gets it, unless it already got ahead of the drawn one CB2Q_MAX_SKIPS times.
+ *
+ * The lock word has the same layout as the CB2 one (owner TID plus a waiters
+ * bit), so boosting the owner is done by the CB2 protocol itself. */
+
+#define CB2Q_SPIN 1024
+#define CB2Q_MAX_SKIPS 4
+
+/* How often a waiter that lost the boost lottery draws again */
+#define CB2Q_LOTTERY_PERIOD_NS 1000000
+
+/* The owner grants the lock, wakes the waiter if it sleeps, and is done
+ * with the node. Only then may the waiter return, and its node go away. */
+#define NODE_WAITING 0
+#define NODE_GRANTED 1
+#define NODE_DONE    2
+
+struct cb2q_node {
+	int state;
+	int parked;
+	pid_t tid;
+	int tickets;
+	int cpu;
+	int skips;
+	struct cb2q_node *prev, *next;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/* A thread waits for one lock at a time */
+static __thread struct cb2q_node me_node;
+
+static inline void queue_lock(cb2_lock_t *l)
+{
+	while (__atomic_exchange_n(&l->queue_lock, 1, __ATOMIC_ACQUIRE)) {
+		cpu_relax();
+	}
+}
+
+static inline void queue_unlock(cb2_lock_t *l)
+{
+	__atomic_store_n(&l->queue_lock, 0, __ATOMIC_RELEASE);
+}
+
+/* Under the queue lock */
+static void queue_unlink(cb2_lock_t *l, struct cb2q_node *n)
+{
+	if (n->prev) {
+		n->prev->next = n->next;
+	} else {
+		l->queue_head = n->next;
+	}
+
+	if (n->next) {
+		n->next->prev = n->prev;
+	} else {
+		l->queue_tail = n->prev;
+	}
+}
+
+/* Under the queue lock, with at least one waiter */
+static struct cb2q_node *queue_draw(cb2_lock_t *l)
+{
+	struct cb2q_node *n, *winner, *near;
+	int cpu = sched_getcpu(), best, count = 0, i;
+	uint32_t *tickets;
+
+	for (n = l->queue_head; n; n = n->next) {
+		count++;
+	}
+
+	tickets = lottery_scratch(count);
+	for (n = l->queue_head, i = 0; n; n = n->next) {
+		tickets[i++] = n->tickets;
+	}
+
+	for (winner = l->queue_head, i = lottery_pick(tickets, count); i > 0; i--) {
+		winner = winner->next;
+	}
+
+	/* A tie goes to the waiter sharing the most with us */
+	if (winner->skips >= CB2Q_MAX_SKIPS) {
+		return winner;
+	}
+
+	near = winner;
+	best = topology_distance(cpu, winner->cpu);
+	for (n = l->queue_head; n && best > TOPO_SAME_CORE; n = n->next) {
+		if (n->tickets == winner->tickets &&
+		    topology_distance(cpu, n->cpu) < best) {
+			near = n;
+			best = topology_distance(cpu, n->cpu);
+		}
+	}
+
+	if (near != winner) {
+		winner->skips++;
+	}
+
+	return near;
+}
+
+/* Queue up, or take the lock if it was released meanwhile. Returns 1 if we
+ * got it. */
+static int cb2q_enqueue(cb2_lock_t *l, struct cb2q_node *n, pid_t me)
+{
+	int cur;
+
+	n->state = NODE_WAITING;
+	n->parked = 0;
+	n->tid = me;
+	n->skips = 0;
+	n->cpu = sched_getcpu();
+	n->tickets = 20 - prio_base_self();
+	n->next = NULL;
+
+	queue_lock(l);
+
+	/* The owner must see us, so it cannot take the fast unlock */
+	cur = __atomic_load_n(&l->word, __ATOMIC_RELAXED);
+	do {
+		if (cur == LOCK_WORD_FREE) {
+			if (__atomic_compare_exchange_n(&l->word, &cur, me, 0,
+					__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+				queue_unlock(l);
+				return 1;
+			}
+			continue;
+		}
+	} while (!(cur & LOCK_WORD_WAITERS) &&
+		 !__atomic_compare_exchange_n(&l->word, &cur,
+			cur | LOCK_WORD_WAITERS, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	n->prev = l->queue_tail;
+	if (l->queue_tail) {
+		l->queue_tail->next = n;
+	} else {
+		l->queue_head = n;
+	}
+	l->queue_tail = n;
+
+	queue_unlock(l);
+	return 0;
+}
+
+/* The lock is ours, wait for the owner to let go of our node. It is a
+ * futex_wake() away at most, unless it got preempted. */
+static void cb2q_granted(struct cb2q_node *n)
+{
+	while (__atomic_load_n(&n->state, __ATOMIC_ACQUIRE) != NODE_DONE) {
+		sched_yield();
+	}
+}
+
+static void cb2q_wait(cb2_lock_t *l, struct cb2q_node *n, pid_t me)
+{
+	struct timespec timeout = { 0, CB2Q_LOTTERY_PERIOD_NS };
+	int i, prio = prio_base_self();
+	long long blocked_since = now_ns();
+
+	/* The owner cannot run while we spin on its CPU */
+	for (i = (l->owner_cpu == n->cpu) ? CB2Q_SPIN : 0; i < CB2Q_SPIN; i++) {
+		if (__atomic_load_n(&n->state, __ATOMIC_ACQUIRE) != NODE_WAITING) {
+			lockstat_count(l, spin_acquired);
+			cb2q_granted(n);
+			return;
+		}
+		cpu_relax();
+	}
+
+	prio_blocked_on(l);
+	__atomic_store_n(&n->parked, 1, __ATOMIC_SEQ_CST);
+
+	while (__atomic_load_n(&n->state, __ATOMIC_SEQ_CST) == NODE_WAITING) {
+		/* The owner is boosted the CB2 way, lottery included */
+		if (now_ns() - blocked_since >= l->boost_delay_ns) {
+			CB2_lock.boost_owner(l, prio, me);
+		}
+
+		lockstat_count(l, futex_waits);
+		futex_wait(&n->state, NODE_WAITING, &timeout);
+		lockstat_count(l, try_again);
+	}
+
+	prio_blocked_on(NULL);
+	cb2q_granted(n);
+}
+
+static void cb2q_lock(cb2_lock_t *l)
+{
+	cb2q_fast_lock(l);
+}
+
+void cb2q_lock_contended(cb2_lock_t *l, pid_t me)
+{
+	/* The owner set the word for us when it picked us */
+	if (!cb2q_enqueue(l, &me_node, me)) {
+		cb2q_wait(l, &me_node, me);
+	}
+}
+
+/* The word is only free when nobody is queued, so this is fair too */
+static int cb2q_trylock(cb2_lock_t *l)
+{
+	return cb2_fast_trylock(l);
+}
+
+static void cb2q_unlock(cb2_lock_t *l)
+{
+	cb2q_fast_unlock(l);
+}
+
+/* Somebody is queued, or the priority of the owner changed */
+void cb2q_unlock_contended(cb2_lock_t *l, __attribute__((unused)) pid_t me)
+{
+	struct cb2q_node *next = NULL;
+	unsigned long calls = prio_syscalls_self;
+	int restore, boosted;
+
+	pthread_mutex_lock(&l->meta_lock);
+
+	restore = l->restore_pending;
+	boosted = (l->boosted_to != BOOST_NONE);
+	l->restore_pending = 0;
+	__atomic_store_n(&l->boosted_to, BOOST_NONE, __ATOMIC_SEQ_CST);
+
+	queue_lock(l);
+
+	if (l->queue_head) {
+		next = queue_draw(l);
+		queue_unlink(l, next);
+
+		/* Direct handoff: the lock is never free in between */
+		__atomic_store_n(&l->word, next->tid |
+			(l->queue_head ? LOCK_WORD_WAITERS : 0), __ATOMIC_RELEASE);
+	} else {
+		__atomic_store_n(&l->word, LOCK_WORD_FREE, __ATOMIC_RELEASE);
+	}
+
+	queue_unlock(l);
+	pthread_mutex_unlock(&l->meta_lock);
+
+	/* The waiter stays until NODE_DONE, nothing touches next after it */
+	if (next) {
+		__atomic_store_n(&next->state, NODE_GRANTED, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&next->parked, __ATOMIC_SEQ_CST)) {
+			futex_wake(&next->state, 1);
+		}
+		__atomic_store_n(&next->state, NODE_DONE, __ATOMIC_RELEASE);
+	}
+
+	if (held_release(l, !restore ? NULL : boosted ? l->boost : &nice_boost,
+			l->unboost_delay_ns) == -1) {
+		errExit("Error restoring the thread priority");
+	}
+	if (restore) {
+		lockstat_syscalls(l, calls);
+		trace(TRACE_UNBOOST, l, boosted, 0, 0);
+	}
+}
+
+static pid_t cb2q_owner(cb2_lock_t *l)
+{
+	return __atomic_load_n(&l->word, __ATOMIC_RELAXED) & LOCK_WORD_TID_MASK;
+}
+
+static int cb2q_boost_owner(cb2_lock_t *l, int prio, pid_t waiter)
+{
+	return CB2_lock.boost_owner(l, prio, waiter);
+}
+
+/* Everything but the queue is the CB2 lock's */
+static void cb2q_init(cb2_lock_t *l, runtime_lock_attr *attr)
+{
+	CB2_lock.init(l, attr);
+
+	l->queue_head = l->queue_tail = NULL;
+	l->queue_lock = 0;
+}
+
+static void cb2q_destroy(cb2_lock_t *l)
+{
+	assert(!l->queue_head && "Destroying a CB2 queue lock with waiters");
+
+	CB2_lock.destroy(l);
+}
+
+runtime_lock CB2_queue_lock = {
+	.type         = RT_CB2_QUEUE,
+	.description  = "CB2Lock with lottery handoff",
+	.lock         = cb2q_lock,
+	.unlock       = cb2q_unlock,
+	.init         = cb2q_init,
+	.destroy      = cb2q_destroy,
+	.owner        = cb2q_owner,
+	.boost_owner  = cb2q_boost_owner,
+	.trylock      = cb2q_trylock,
+	.stats        = lockstat_collect
+};
@@ -0,0 +1,296 @@
+#include "cb2_rwlock.h"
+#include "util.h"
+#include "futex.h"
+#include "prio.h"
+#include "tickets.h"
+#include "boost.h"
+#include "held.h"
+
+/* Rounds a writer spins on the readers before it starts boosting them */
+#define CB2_RW_SPIN 1024
+
+/* How often a writer that lost the lottery draws again */
+#define CB2_RW_LOTTERY_PERIOD_NS 1000000
+
+static inline struct cb2_rw_shard *rw_shard(cb2_rwlock_t *rw)
+{
+	return &rw->shards[sched_getcpu() % rw->nshards];
+}
+
+static int rw_readers(cb2_rwlock_t *rw)
+{
+	int i, sum = 0;
+
+	/* A reader may leave on another shard than it came in, only the sum
+	 * means anything */
+	for (i = 0; i < rw->nshards; i++) {
+		sum += __atomic_load_n(&rw->shards[i].readers, __ATOMIC_SEQ_CST);
+	}
+
+	return sum;
+}
+
+static inline unsigned long long rw_reader_word(pid_t tid, int lent)
+{
+	struct cb2_rw_reader r;
+
+	r.tid = tid;
+	r.lent = lent;
+	return r.word;
+}
+
+/* Publish the reader so that a writer can boost it. NULL if there was no
+ * free slot. */
+static struct cb2_rw_reader *rw_track(struct cb2_rw_shard *s, pid_t me)
+{
+	int i;
+
+	for (i = 0; i < CB2_RW_SLOTS; i++) {
+		unsigned long long empty = 0;
+
+		if (!__atomic_load_n(&s->slot[i].word, __ATOMIC_RELAXED) &&
+		    __atomic_compare_exchange_n(&s->slot[i].word, &empty,
+				rw_reader_word(me, BOOST_NONE), 0,
+				__ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+			return &s->slot[i];
+		}
+	}
+
+	return NULL;
+}
+
+/* Give the slot back, NULL if we had none. *lent is what a writer lent us,
+ * BOOST_NONE if it didn't boost us. */
+static struct cb2_rw_reader *rw_untrack(cb2_rwlock_t *rw, pid_t me, int *lent)
+{
+	struct cb2_rw_reader *r, was;
+	int i, j, first = sched_getcpu() % rw->nshards;
+
+	for (i = 0; i < rw->nshards; i++) {
+		struct cb2_rw_shard *s = &rw->shards[(first + i) % rw->nshards];
+
+		for (j = 0; j < CB2_RW_SLOTS; j++) {
+			r = &s->slot[j];
+
+			if (__atomic_load_n(&r->tid, __ATOMIC_RELAXED) != me) {
+				continue;
+			}
+
+			/* A writer only boosts us while the slot is ours. If it
+			 * did, it may still be in the syscall, under meta_lock. */
+			was.word = __atomic_exchange_n(&r->word, 0, __ATOMIC_SEQ_CST);
+			*lent = was.lent;
+			if (was.lent != BOOST_NONE) {
+				pthread_mutex_lock(&rw->writer.meta_lock);
+				pthread_mutex_unlock(&rw->writer.meta_lock);
+			}
+			return r;
+		}
+	}
+
+	return NULL;
+}
+
+void cb2_rwlock_rdlock(cb2_rwlock_t *rw)
+{
+	struct cb2_rw_shard *s = rw_shard(rw);
+	struct cb2_rw_reader *r;
+
+	__atomic_add_fetch(&s->readers, 1, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&rw->writing, __ATOMIC_SEQ_CST)) {
+		/* Step back so the writer can drain, and queue behind it. While
+		 * we hold the writer lock no writer can be inside. */
+		__atomic_sub_fetch(&s->readers, 1, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&rw->drained, 1, __ATOMIC_RELEASE);
+		futex_wake(&rw->drained, 1);
+
+		cb2_lock_acquire(&rw->writer);
+		s = rw_shard(rw);
+		__atomic_add_fetch(&s->readers, 1, __ATOMIC_SEQ_CST);
+		cb2_lock_release(&rw->writer);
+	}
+
+	if ((r = rw_track(s, self_tid()))) {
+		held_lend(r, &r->lent, rw->writer.boost);
+	}
+}
+
+void cb2_rwlock_rdunlock(cb2_rwlock_t *rw)
+{
+	int lent = BOOST_NONE;
+	struct cb2_rw_reader *r = rw_untrack(rw, self_tid(), &lent);
+
+	__atomic_sub_fetch(&rw_shard(rw)->readers, 1, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&rw->writing, __ATOMIC_SEQ_CST)) {
+		__atomic_add_fetch(&rw->drained, 1, __ATOMIC_RELEASE);
+		futex_wake(&rw->drained, 1);
+	}
+
+	/* Other locks we hold may still lend us something */
+	if (r && held_release(r, lent != BOOST_NONE ? rw->writer.boost : NULL,
+			rw->writer.unboost_delay_ns) == -1) {
+		errExit("Error restoring the thread priority");
+	}
+}
+
+/* Under meta_lock. The reader may be leaving while we boost it, see
+ * rw_untrack() for the other half. */
+static void rw_boost_reader(cb2_rwlock_t *rw, struct cb2_rw_reader *r,
+		pid_t tid, int prio)
+{
+	unsigned long long unboosted = rw_reader_word(tid, BOOST_NONE);
+
+	/* Lend it before the syscall, as a waiter of a CB2 lock would (see
+	 * held_release()), and only if the slot is still tid's */
+	if (!__atomic_compare_exchange_n(&r->word, &unboosted,
+			rw_reader_word(tid, prio), 0, __ATOMIC_SEQ_CST,
+			__ATOMIC_RELAXED)) {
+		return;
+	}
+
+	if (rw->writer.boost->boost(tid, prio) == -1) {
+		errExit("Error setting the reader priority");
+	}
+	rw->reader_boosts++;
+	cb2_self_stats.boosts++;
+}
+
+/* The readers below us draw together against the bystanders of their cores */
+static void rw_boost_readers(cb2_rwlock_t *rw, int HP_prio, pid_t HP_pid)
+{
+	const boost_backend *boost = rw->writer.boost;
+	int i, j, cpu, tickets = 0, bystanders = 0, found;
+
+	pthread_mutex_lock(&rw->writer.meta_lock);
+
+	for (i = 0; i < rw->nshards; i++) {
+		found = 0;
+
+		for (j = 0; j < CB2_RW_SLOTS; j++) {
+			struct cb2_rw_reader r;
+			int prio;
+
+			r.word = __atomic_load_n(&rw->shards[i].slot[j].word,
+				__ATOMIC_RELAXED);
+			if (!r.tid || r.lent != BOOST_NONE ||
+			    (prio = prio_of(r.tid)) <= HP_prio) {
+				continue;
+			}
+			tickets += boost->tickets(HP_prio, prio);
+			found = 1;
+		}
+
+		/* The readers of a shard may be on any of the CPUs it covers */
+		for (cpu = i; found && cpu < rw->ncpu; cpu += rw->nshards) {
+			bystanders += tickets_on_cpu(cpu, 0);
+		}
+	}
+
+	if (!bystanders) {
+		bystanders = rw->writer.bystander_tickets_cpu;
+	}
+
+	if (tickets && cb2_lottery(bystanders, tickets, HP_pid)) {
+		for (i = 0; i < rw->nshards; i++) {
+			for (j = 0; j < CB2_RW_SLOTS; j++) {
+				struct cb2_rw_reader r;
+
+				r.word = __atomic_load_n(&rw->shards[i].slot[j].word,
+					__ATOMIC_RELAXED);
+				if (r.tid && r.lent == BOOST_NONE &&
+				    prio_of(r.tid) > HP_prio) {
+					rw_boost_reader(rw, &rw->shards[i].slot[j],
+						r.tid, HP_prio);
+				}
+			}
+		}
+	}
+
+	pthread_mutex_unlock(&rw->writer.meta_lock);
+}
+
+/* We own the writer lock and no new reader gets in, wait for the ones
+ * inside to leave */
+static void rw_drain(cb2_rwlock_t *rw)
+{
+	struct timespec timeout;
+	long long blocked_since = now_ns();
+	int i, seq, prio = prio_base_self();
+	pid_t me = self_tid();
+
+	for (i = 0; i < CB2_RW_SPIN; i++) {
+		if (!rw_readers(rw)) {
+			return;
+		}
+		cpu_relax();
+	}
+
+	for (;;) {
+		seq = __atomic_load_n(&rw->drained, __ATOMIC_ACQUIRE);
+		if (!rw_readers(rw)) {
+			return;
+		}
+
+		if (now_ns() - blocked_since >= rw->writer.boost_delay_ns) {
+			rw_boost_readers(rw, prio, me);
+		}
+
+		timeout.tv_sec = 0;
+		timeout.tv_nsec = CB2_RW_LOTTERY_PERIOD_NS;
+		futex_wait(&rw->drained, seq, &timeout);
+	}
+}
+
+void cb2_rwlock_wrlock(cb2_rwlock_t *rw)
+{
+	cb2_lock_acquire(&rw->writer);
+
+	/* Readers check this after counting themselves in */
+	__atomic_store_n(&rw->writing, 1, __ATOMIC_SEQ_CST);
+
+	if (rw_readers(rw)) {
+		rw_drain(rw);
+	}
+}
+
+void cb2_rwlock_wrunlock(cb2_rwlock_t *rw)
+{
+	__atomic_store_n(&rw->writing, 0, __ATOMIC_SEQ_CST);
+	cb2_lock_release(&rw->writer);
+}
+
+void cb2_rwlock_init(cb2_rwlock_t *rw, runtime_lock_attr *attr)
+{
+	int i, j, ncpu = get_nprocs_conf();
+
+	cb2_lock_init(&rw->writer, &CB2_lock, attr);
+
+	rw->writing = 0;
+	rw->drained = 0;
+	rw->reader_boosts = 0;
+	rw->ncpu = ncpu;
+	rw->nshards = (ncpu < CB2_RW_MAX_SHARDS) ? ncpu : CB2_RW_MAX_SHARDS;
+
+	if (!(rw->shards = aligned_alloc(CACHE_LINE_SIZE,
+			rw->nshards * sizeof(struct cb2_rw_shard)))) {
+		errExit("Could not allocate the reader shards");
+	}
+
+	for (i = 0; i < rw->nshards; i++) {
+		rw->shards[i].readers = 0;
+		for (j = 0; j < CB2_RW_SLOTS; j++) {
+			rw->shards[i].slot[j].word = 0;
+		}
+	}
+}
+
+void cb2_rwlock_destroy(cb2_rwlock_t *rw)
+{
+	assert(!rw->writing && !rw_readers(rw) && "Destroying a CB2 rwlock that is held");
+
+	cb2_lock_destroy(&rw->writer);
+	free(rw->shards);
+	rw->shards = NULL;
+}
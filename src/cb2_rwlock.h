@@ -0,0 +1,73 @@
+#ifndef __CB2_RWLOCK_H_
+#define __CB2_RWLOCK_H_
+
+#include "runtime_lock.h"
+
+/*
+	Reader-writer CB2Lock. Readers only touch the shard of the CPU they
+	run on, so they don't bounce a shared counter between cores. Writers
+	exclude each other, and hold back new readers, with a CB2 lock, and
+	then wait for the readers already inside to drain.
+
+	A writer blocked by readers of lower priority boosts them as a group:
+	the readers hold the tickets their boosts are worth, the bystanders
+	on their cores hold the rest, and a single CB2 draw decides whether
+	all of them get boosted. A reader blocked by a writer goes through the
+	writer's CB2 lock, and so boosts it like any other waiter would.
+
+	Only readers that found a free slot in their shard can be boosted,
+	the others are still counted.
+*/
+
+#define CB2_RW_MAX_SHARDS 64
+#define CB2_RW_SLOTS      7
+
+/* The reader, and the priority a writer lent it (BOOST_NONE if none). They
+ * only change together, through word. */
+struct cb2_rw_reader {
+	union {
+		unsigned long long word;
+		struct {
+			pid_t tid;
+			int lent;
+		};
+	};
+};
+
+/* One cache line per shard */
+struct cb2_rw_shard {
+	int readers;
+	int unused;
+	struct cb2_rw_reader slot[CB2_RW_SLOTS];
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+typedef struct _cb2_rwlock {
+
+	/* Taken by writers, and by readers that find a writer inside */
+	cb2_lock_t writer;
+
+	/* A writer is inside or waiting for the readers to drain */
+	int writing;
+
+	/* Bumped by readers leaving while a writer waits, to wake it up */
+	int drained;
+
+	/* Shard i covers CPUs i, i + nshards, ... below ncpu */
+	int nshards, ncpu;
+	struct cb2_rw_shard *shards;
+
+	unsigned long reader_boosts;
+
+} cb2_rwlock_t;
+
+/* attr is the one of the CB2 lock writers use */
+void cb2_rwlock_init(cb2_rwlock_t *rw, runtime_lock_attr *attr);
+void cb2_rwlock_destroy(cb2_rwlock_t *rw);
+
+void cb2_rwlock_rdlock(cb2_rwlock_t *rw);
+void cb2_rwlock_rdunlock(cb2_rwlock_t *rw);
+
+void cb2_rwlock_wrlock(cb2_rwlock_t *rw);
+void cb2_rwlock_wrunlock(cb2_rwlock_t *rw);
+
+#endif
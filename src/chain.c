@@ -0,0 +1,108 @@
+#include "chain.h"
+#include "util.h"
+#include "prio.h"
+
+/* Last lock we reported a deadlock on, so we don't repeat ourselves */
+static __thread cb2_lock_t *reported = NULL;
+
+/* Threads following a chain right now, see chain_quiesce() */
+static int walkers = 0;
+
+pid_t chain_owner(cb2_lock_t *l)
+{
+	return l->ops->owner ? l->ops->owner(l) : 0;
+}
+
+/* Is every link of the cycle still there? */
+static int chain_confirm(cb2_lock_t **locks, pid_t *owners, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (chain_owner(locks[i]) != owners[i] ||
+		    (i + 1 < n && prio_blocked_of(owners[i]) != locks[i + 1])) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static void chain_report(cb2_lock_t **locks, pid_t *owners, int n, int from)
+{
+	int i;
+
+	if (reported == locks[0]) {
+		return;
+	}
+	reported = locks[0];
+
+	fprintf(stderr, "Deadlock: %d", owners[from]);
+	for (i = from + 1; i < n; i++) {
+		fprintf(stderr, " -> %d", owners[i]);
+	}
+	fprintf(stderr, " -> %d\n", owners[from]);
+}
+
+cb2_lock_t *chain_end(cb2_lock_t *l, pid_t me)
+{
+	cb2_lock_t *locks[CHAIN_MAX_DEPTH + 1], *next;
+	pid_t owners[CHAIN_MAX_DEPTH + 1];
+	int n = 0, i;
+
+	locks[0] = l;
+
+	while (n <= CHAIN_MAX_DEPTH) {
+		if (!(owners[n] = chain_owner(locks[n]))) {
+			return NULL;
+		}
+
+		/* Back to somebody we have seen, us included */
+		for (i = 0; i < n; i++) {
+			if (owners[i] == owners[n]) {
+				break;
+			}
+		}
+		if (i < n || owners[n] == me) {
+			if (chain_confirm(locks, owners, n + 1)) {
+				chain_report(locks, owners, (i < n) ? n : n + 1,
+					(i < n) ? i : 0);
+			}
+			return NULL;
+		}
+
+		if (!(next = prio_blocked_of(owners[n]))) {
+			return n ? locks[n] : NULL;
+		}
+
+		locks[++n] = next;
+	}
+
+	return NULL;
+}
+
+int chain_boost(cb2_lock_t *l, int prio, pid_t me)
+{
+	cb2_lock_t *end;
+
+	/* Counted before we read any blocked_on, see chain_quiesce() */
+	__atomic_add_fetch(&walkers, 1, __ATOMIC_SEQ_CST);
+
+	if ((end = chain_end(l, me)) && end->ops->boost_owner) {
+		end->ops->boost_owner(end, prio, me);
+	}
+
+	__atomic_sub_fetch(&walkers, 1, __ATOMIC_SEQ_CST);
+
+	return end != NULL;
+}
+
+void chain_quiesce(void)
+{
+	/* Nobody is blocked on the lock anymore, so a walker that comes
+	 * after this cannot find it. The ones before are a few loads away
+	 * from done. */
+	while (__atomic_load_n(&walkers, __ATOMIC_SEQ_CST)) {
+		sched_yield();
+	}
+}
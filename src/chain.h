@@ -0,0 +1,46 @@
+#ifndef __CHAIN_H_
+#define __CHAIN_H_
+
+#include "runtime_lock.h"
+
+/*
+	Transitive boosting. A thread that sleeps on a lock publishes it in
+	the priority registry (prio_blocked_on()). A waiter whose owner is
+	itself blocked follows the chain, lock -> owner -> lock the owner is
+	blocked on -> ..., up to the first owner that can run, and boosts it
+	through the protocol of the last lock. Boosting anybody in between
+	is useless while they sleep.
+
+	The chain is read without any lock, so it may be stale: the worst
+	that can happen is a boost that was not needed. A cycle that is still
+	there when read a second time is a deadlock and gets reported.
+	Only the protocols that say who their owner is (CB2 and inherit) can
+	be part of a chain.
+
+	The locks of a chain were published by other threads, and may be
+	destroyed while we follow it. A protocol that can be part of a chain
+	calls chain_quiesce() when its lock is destroyed, once nobody is
+	blocked on it, and the memory of the lock may only be freed or
+	reused after that.
+*/
+
+#define CHAIN_MAX_DEPTH 8
+
+/* Owner of l, 0 if it's free or the protocol does not say */
+pid_t chain_owner(cb2_lock_t *l);
+
+/* Last lock of the chain that starts at l, the one whose owner is not
+ * blocked. NULL if the owner of l itself is not blocked, if the chain is
+ * longer than CHAIN_MAX_DEPTH or if it's a cycle. Only safe from
+ * chain_boost(), which keeps the locks it walks alive. */
+cb2_lock_t *chain_end(cb2_lock_t *l, pid_t me);
+
+/* Boost the end of the chain that starts at l. Returns 1 if there was a
+ * chain to follow. */
+int chain_boost(cb2_lock_t *l, int prio, pid_t me);
+
+/* Wait for the threads following a chain, which may still see a lock that
+ * is being destroyed */
+void chain_quiesce(void);
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef __FUTEX_H_
+#define __FUTEX_H_
+
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <time.h>
+
+/* Lock word layout shared by the futex based locks: the TID of the owner in
+ * the low bits, plus a bit telling the owner that somebody may be sleeping
+ * on the word. This is the same layout the kernel uses for PI futexes. */
+#define LOCK_WORD_FREE     0
+#define LOCK_WORD_WAITERS  FUTEX_WAITERS
+#define LOCK_WORD_TID_MASK FUTEX_TID_MASK
+
+static inline long futex_wait(int *uaddr, int val,
+		const struct timespec *timeout)
+{
+	return syscall(SYS_futex, uaddr, FUTEX_WAIT_PRIVATE, val, timeout,
+			NULL, 0);
+}
+
+static inline long futex_wake(int *uaddr, int nr)
+{
+	return syscall(SYS_futex, uaddr, FUTEX_WAKE_PRIVATE, nr, NULL, NULL, 0);
+}
+
+/* Wake nobody, but move up to nr waiters of uaddr (if it still holds val) to
+ * sleep on uaddr2 instead */
+static inline long futex_requeue(int *uaddr, int val, int nr, int *uaddr2)
+{
+	return syscall(SYS_futex, uaddr, FUTEX_CMP_REQUEUE_PRIVATE, 0,
+			(void *)(long)nr, uaddr2, val);
+}
+
+#endif
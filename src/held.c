@@ -0,0 +1,111 @@
+#include "held.h"
+#include "util.h"
+#include "prio.h"
+
+struct held_lock {
+	const void *key;
+	const int *lent;
+	const boost_backend *boost;
+};
+
+static __thread struct {
+	/* Priority before the first lock was taken */
+	int base;
+	int n;
+	struct held_lock locks[HELD_MAX];
+	/* Nested beyond HELD_MAX */
+	int untracked;
+} held;
+
+void held_lend(const void *key, const int *lent, const boost_backend *boost)
+{
+	if (held.n + held.untracked == 0) {
+		held.base = prio_base_self();
+	}
+
+	if (held.n < HELD_MAX) {
+		held.locks[held.n].key = key;
+		held.locks[held.n].lent = lent;
+		held.locks[held.n++].boost = boost;
+	} else {
+		held.untracked++;
+	}
+}
+
+void held_push(cb2_lock_t *l)
+{
+	held_lend(l, &l->boosted_to, l->boost);
+}
+
+/* The lock still held that lends us the best priority, if any is better than
+ * our own */
+static struct held_lock *held_lender(int *prio)
+{
+	struct held_lock *lender = NULL;
+	int i, lent;
+
+	*prio = held.base;
+
+	for (i = 0; i < held.n; i++) {
+		lent = __atomic_load_n(held.locks[i].lent, __ATOMIC_SEQ_CST);
+		if (lent < *prio) {
+			*prio = lent;
+			lender = &held.locks[i];
+		}
+	}
+
+	return lender;
+}
+
+int held_lent(void)
+{
+	int i, lent, best = BOOST_NONE;
+
+	for (i = 0; i < held.n; i++) {
+		lent = __atomic_load_n(held.locks[i].lent, __ATOMIC_SEQ_CST);
+		best = (lent < best) ? lent : best;
+	}
+
+	return best;
+}
+
+int held_release(const void *l, const boost_backend *boost,
+		long long delay_ns)
+{
+	struct held_lock *lender;
+	int i, prio, applied, rc;
+
+	/* Most of the time it's the last one we took */
+	for (i = held.n - 1; i >= 0 && held.locks[i].key != l; i--) {
+		;
+	}
+
+	if (i >= 0) {
+		held.locks[i] = held.locks[--held.n];
+	} else if (held.untracked) {
+		held.untracked--;
+	}
+
+	if (!boost) {
+		return 0;
+	}
+
+	lender = held_lender(&prio);
+	rc = lender ? lender->boost->boost(self_tid(), prio) :
+		boost->restore(prio, delay_ns);
+
+	/* A waiter of a lock we still hold may be boosting us right now.
+	 * Waiters publish boosted_to before their syscall, so if we don't
+	 * see it here their boost lands after what we just did. */
+	while (rc != -1) {
+		applied = prio;
+		lender = held_lender(&prio);
+
+		if (!lender || prio >= applied) {
+			break;
+		}
+		rc = lender->boost->boost(self_tid(), prio);
+	}
+
+	return rc;
+}
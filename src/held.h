@@ -0,0 +1,53 @@
+#ifndef __HELD_H_
+#define __HELD_H_
+
+#include "runtime_lock.h"
+#include "boost.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+	Locks held by the calling thread. A thread can hold several locks,
+	each of which may be lending it a better priority (a boost from a
+	waiter, or a ceiling) through its boosted_to field. Giving back one
+	lock must not give back what the others still lend, so on release the
+	thread goes to the best of what is left, or to the priority it had
+	before it took its first lock.
+
+	Locks are pushed when acquired and may be released in any order.
+	Past HELD_MAX nested locks the extra ones are not tracked, and only
+	count for the priority they lent while they were held.
+
+	Anything else that may lend the thread a priority while it's inside,
+	like the read side of a CB2 rwlock, is pushed with held_lend() and a
+	key of its own, and released the same way.
+*/
+
+#define HELD_MAX 16
+
+/* The calling thread got l */
+void held_push(cb2_lock_t *l);
+
+/* The calling thread got something that may lend it a priority through
+ * *lent, set with boost. key is what it's released with. */
+void held_lend(const void *key, const int *lent, const boost_backend *boost);
+
+/* Best priority the locks held by the calling thread lend it, BOOST_NONE
+ * if none does */
+int held_lent(void);
+
+/* The calling thread gave l back. If l changed its priority (boost is the
+ * backend that did it), it's recomputed from the locks still held, and a
+ * deferred restore may wait for delay_ns (see prio_restore()). Pass a NULL
+ * boost if l did not touch the priority. Returns -1 if setting the priority
+ * failed. */
+int held_release(const void *l, const boost_backend *boost,
+		long long delay_ns);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
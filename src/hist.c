@@ -0,0 +1,62 @@
+#include <math.h>
+#include <string.h>
+
+#include "hist.h"
+
+void hist_init(struct hist *h)
+{
+	memset(h, 0, sizeof(*h));
+}
+
+void hist_merge(struct hist *into, const struct hist *from)
+{
+	int i;
+
+	if (!from->count) {
+		return;
+	}
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		into->buckets[i] += from->buckets[i];
+	}
+
+	into->min = (!into->count || from->min < into->min) ? from->min : into->min;
+	into->max = (from->max > into->max) ? from->max : into->max;
+	into->sum += from->sum;
+	into->count += from->count;
+}
+
+/* Highest value that falls in bucket i */
+static unsigned long long bucket_top(int i)
+{
+	int shift = i / HIST_SUB - 1;
+
+	if (i < HIST_SUB) {
+		return i;
+	}
+
+	return ((unsigned long long)(i - shift * HIST_SUB + 1) << shift) - 1;
+}
+
+unsigned long long hist_percentile(const struct hist *h, double p)
+{
+	unsigned long rank, seen = 0;
+	int i;
+
+	if (!h->count) {
+		return 0;
+	}
+
+	/* The smallest value with at least p% of them at or below it */
+	rank = (unsigned long)ceil(h->count * p / 100);
+	rank = rank ? rank : 1;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= rank) {
+			return (bucket_top(i) < h->max) ? bucket_top(i) : h->max;
+		}
+	}
+
+	return h->max;
+}
@@ -0,0 +1,52 @@
+#ifndef __HIST_H_
+#define __HIST_H_
+
+/*
+	Latency histograms in the style of HdrHistogram, for the waits of
+	test_prios. Values (nanoseconds) below HIST_SUB are counted exactly,
+	and every power of two above is split into HIST_SUB buckets, so a
+	percentile is off by less than 1 / HIST_SUB (about 3%) of its value
+	whatever the range. Recording is a shift and an add, and histograms of
+	many threads or runs add up with hist_merge().
+*/
+
+#define HIST_SUB_BITS 5
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS  ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct hist {
+	unsigned long count;
+	unsigned long long min, max, sum;
+	unsigned long buckets[HIST_BUCKETS];
+};
+
+static inline int hist_bucket(unsigned long long v)
+{
+	int shift;
+
+	if (v < HIST_SUB) {
+		return v;
+	}
+
+	/* The top HIST_SUB_BITS + 1 bits of v, and how far down they were */
+	shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+	return shift * HIST_SUB + (int)(v >> shift);
+}
+
+static inline void hist_record(struct hist *h, unsigned long long v)
+{
+	h->buckets[hist_bucket(v)]++;
+	h->sum += v;
+	h->min = (!h->count || v < h->min) ? v : h->min;
+	h->max = (v > h->max) ? v : h->max;
+	h->count++;
+}
+
+void hist_init(struct hist *h);
+void hist_merge(struct hist *into, const struct hist *from);
+
+/* p-th percentile (0 to 100): the highest value of the bucket it falls in,
+ * but never above the max. 0 if the histogram is empty. */
+unsigned long long hist_percentile(const struct hist *h, double p);
+
+#endif
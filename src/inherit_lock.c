@@ -1,5 +1,9 @@
 #include "runtime_lock.h"
 #include "util.h"
+#include "prio.h"
+#include "boost.h"
+#include "chain.h"
+#include "held.h"
 
 /* To implement priority inheritance, we used two locks. One represents the lock
  * for the critical section, while the other locks metadata for setting and
@@ -10,118 +14,178 @@
  * safely handle getting/setting priority levels of threads makes the unlock
  * method no longer wait-free. */
 
-static pthread_mutex_t lock;
-static pthread_mutex_t meta_lock;
-static __thread int original_priority = 0;
+/* Called with meta_lock held, right after getting the CS lock */
+static void set_owner(cb2_lock_t *l, pid_t me)
+{
+	l->owner_tid = me;
+	held_push(l);
 
-static volatile pid_t owner_tid = -1;
+	if (cb2_lock_demotes(l, sched_getcpu())) {
+		if (prio_set(me, 19) == -1) {
+			errExit("Error setting the thread priority");
+		}
+	}
+}
 
-static void _lock(void)
+/* Called with meta_lock held and an owner recorded */
+static void boost_owner_locked(cb2_lock_t *l, int prio)
 {
-	pid_t me = gettid();
-	int rc, owner_priority;
+	int owner_priority = prio_of(l->owner_tid);
 
-	original_priority = getpriority(PRIO_PROCESS, me);
+	if (l->boosted_to < owner_priority) {
+		owner_priority = l->boosted_to;
+	}
 
-	if (original_priority == -1) {
-		errExit("Error getting the thread priority");
+	/* If the priority of the owner is already high enough, then we
+	 * can just sleep on the main lock */
+	if (owner_priority > prio) {
+		/* Raise owner priority, see held_release() for the order */
+		__atomic_store_n(&l->boosted_to, prio, __ATOMIC_SEQ_CST);
+		if (l->boost->boost(l->owner_tid, prio) == -1) {
+			errExit("Error setting the owner priority");
+		}
+		cb2_self_stats.boosts++;
 	}
+}
 
-	/* Acquire the metadata lock then the other mutex */
-	pthread_mutex_lock(&meta_lock);
+static pid_t _owner(cb2_lock_t *l)
+{
+	pid_t owner = l->owner_tid;
 
-	rc = pthread_mutex_trylock(&lock);
+	return (owner == -1) ? 0 : owner;
+}
 
-	if (rc == 0) {
-		/* We acquired the lock. Set metadata and continue into CS */
-		owner_tid = me;
+/* For a waiter at the other end of a chain of blocked owners */
+static int _boost_owner(cb2_lock_t *l, int prio,
+		__attribute__((unused)) pid_t waiter)
+{
+	pthread_mutex_lock(&l->meta_lock);
+	if (l->owner_tid != -1) {
+		boost_owner_locked(l, prio);
+	}
+	pthread_mutex_unlock(&l->meta_lock);
 
-		if (sched_getcpu() == 0) {
-			if (setpriority(PRIO_PROCESS, me, 19) == -1) {
-				errExit("Error setting the thread priority");
-			}
+	return 1;
+}
+
+static void _lock(cb2_lock_t *l)
+{
+	pid_t me = self_tid();
+	int rc, chained = 0, original_priority = prio_base_self();
+	struct timespec deadline;
+
+	/* Most critical sections are short, so first wait a bit without
+	 * touching anybody's priority */
+	if (l->boost_delay_ns) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += (deadline.tv_nsec + l->boost_delay_ns) / 1000000000LL;
+		deadline.tv_nsec = (deadline.tv_nsec + l->boost_delay_ns) % 1000000000LL;
+
+		if (pthread_mutex_clocklock(&l->lock, CLOCK_MONOTONIC, &deadline) == 0) {
+			pthread_mutex_lock(&l->meta_lock);
+			set_owner(l, me);
+			pthread_mutex_unlock(&l->meta_lock);
+			return;
 		}
+	}
+
+	/* Acquire the metadata lock then the other mutex */
+	pthread_mutex_lock(&l->meta_lock);
 
-		pthread_mutex_unlock(&meta_lock);
+	rc = pthread_mutex_trylock(&l->lock);
+
+	if (rc == 0) {
+		/* We acquired the lock. Set metadata and continue into CS */
+		set_owner(l, me);
+		pthread_mutex_unlock(&l->meta_lock);
 	} 
 	else if (rc == EBUSY) {
 		/* We did not acquire the lock. Update owner priority to speed things up
-		 * a bit. */
-		LOG_DEBUG("Owner is %d\n", owner_tid);
-		assert(owner_tid != -1);
-		owner_priority = getpriority(PRIO_PROCESS, owner_tid);
-
-		if (owner_priority == -1) {
-			errExit("Error getting the owner priority");
-		}
-
-		/* If the priority of the owner is already high enough, then we can
-		 * just sleep on the main lock */
-		if (owner_priority > original_priority) {
-			/* Raise owner priority */
-			if (setpriority(PRIO_PROCESS, owner_tid, original_priority) == -1) {
-				errExit("Error setting the owner priority");
+		 * a bit. The owner may not have recorded itself yet if it took the
+		 * lock while sleeping on it, then there is nobody to boost. */
+		LOG_DEBUG("Owner is %d\n", l->owner_tid);
+		if (l->owner_tid != -1) {
+			/* If the owner sleeps itself, whoever it waits for is
+			 * the one to boost */
+			if (prio_blocked_of(l->owner_tid)) {
+				chained = 1;
+			} else {
+				boost_owner_locked(l, original_priority);
 			}
 		}
 
 		/* Now, we can wait for the main lock */
-		pthread_mutex_unlock(&meta_lock);
-		pthread_mutex_lock(&lock);
+		pthread_mutex_unlock(&l->meta_lock);
 
-		/* Reacquire the metadata lock, fix metadata, then enter CS */
-		pthread_mutex_lock(&meta_lock);
-		owner_tid = me;
-
-		if (sched_getcpu() == 0) {
-			if (setpriority(PRIO_PROCESS, me, 19) == -1) {
-				errExit("Error setting the thread priority");
-			}
+		prio_blocked_on(l);
+		if (chained) {
+			chain_boost(l, original_priority, me);
 		}
-		pthread_mutex_unlock(&meta_lock);
+		pthread_mutex_lock(&l->lock);
+		prio_blocked_on(NULL);
+
+		/* Reacquire the metadata lock, fix metadata, then enter CS */
+		pthread_mutex_lock(&l->meta_lock);
+		set_owner(l, me);
+		pthread_mutex_unlock(&l->meta_lock);
 	} 
 	else {
 		errExit("something went terribly wrong when we tried to get a lock...");
 	}
 }
 
-static void _unlock(void)
+static void _unlock(cb2_lock_t *l)
 {
-	pid_t me = gettid();
+	int boosted;
 
-	pthread_mutex_lock(&meta_lock);
+	pthread_mutex_lock(&l->meta_lock);
 
 	/* Release the CS lock now */
-	pthread_mutex_unlock(&lock);
+	pthread_mutex_unlock(&l->lock);
 
 	/* reset priority and metadata */
-	owner_tid = -1;
-	pthread_mutex_unlock(&meta_lock);
-
-	if (setpriority(PRIO_PROCESS, me, original_priority) == -1) {
-		errExit("Error setting the thread priority");
+	l->owner_tid = -1;
+	boosted = (l->boosted_to != BOOST_NONE);
+	__atomic_store_n(&l->boosted_to, BOOST_NONE, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&l->meta_lock);
+
+	/* An unboost may be deferred, in case we get boosted again soon. We
+	 * go back to what the locks we still hold lend us, if anything. */
+	if (held_release(l, boosted ? l->boost : &nice_boost,
+			l->unboost_delay_ns) == -1) {
+		errExit("Error restoring the thread priority");
 	}
 }
 
-static void _init(__attribute__((unused)) runtime_lock_attr *attr)
+static void _init(cb2_lock_t *l, runtime_lock_attr *attr)
 {
 	int rc = 0;
-	rc |= pthread_mutex_init(&lock, NULL);
-	rc |= pthread_mutex_init(&meta_lock, NULL);
+	rc |= pthread_mutex_init(&l->lock, NULL);
+	rc |= pthread_mutex_init(&l->meta_lock, NULL);
 
 	if (rc != 0) {
 		errExit("failed to init inherit lock");
 	}
+
+	l->owner_tid = -1;
+	l->demote_cpus = attr->demote_cpus;
+	l->boost = attr->boost ? attr->boost : &nice_boost;
+	l->boosted_to = BOOST_NONE;
+	l->boost_delay_ns = attr->boost_delay_ns;
+	l->unboost_delay_ns = attr->unboost_delay_ns;
 }
 
-static void _destroy(void) 
+static void _destroy(cb2_lock_t *l) 
 {
 	int rc = 0;
-	rc |= pthread_mutex_destroy(&lock);
-	rc |= pthread_mutex_destroy(&meta_lock);
+	rc |= pthread_mutex_destroy(&l->lock);
+	rc |= pthread_mutex_destroy(&l->meta_lock);
 
 	if (rc != 0) {
 		errExit("failed to destroy inherit lock");
 	}
+
+	chain_quiesce();
 }
 
 runtime_lock inherit_lock = {
@@ -130,5 +194,7 @@ runtime_lock inherit_lock = {
 	.lock         = _lock,
 	.unlock       = _unlock,
 	.init         = _init,
-	.destroy      = _destroy
+	.destroy      = _destroy,
+	.owner        = _owner,
+	.boost_owner  = _boost_owner
 };
@@ -0,0 +1,343 @@
+/*
+###############################################################################
+# Microbenchmark of the lock overhead of every protocol: uncontended         #
+# lock/unlock latency, contended throughput from 1 to N threads, how long   #
+# the lock takes to go from one owner to the next, and how many syscalls    #
+# and context switches each acquisition costs.                              #
+###############################################################################
+*/
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+
+#include "util.h"
+#include "runtime_lock.h"
+
+#define HIGHEST_PRIO (-20)
+
+#define MAX_THREADS 256
+
+/* Protocols run by default, see -p */
+#define DEFAULT_PROTOCOLS "0,1,2,3,6"
+
+static const runtime_lock *protocols[] = {
+	&mutex_lock, &inherit_lock, &protect_lock, &CB2_lock,
+	&pi_inherit_lock, &pi_protect_lock, &CB2_queue_lock
+};
+
+/* Everything below the lock is only touched with the lock held */
+static struct {
+	cb2_lock_t lock;
+
+	pid_t last_owner;
+	long long released_at;
+
+	long long handoffs;
+	long long handoff_ns;
+	long long handoff_max;
+} bench;
+
+static volatile int stop;
+static pthread_barrier_t barrier;
+
+/* Busy loop rounds per microsecond, see calibrate() */
+static double loops_per_us;
+static long cs_loops, ncs_loops;
+
+struct worker {
+	pthread_t thread;
+	unsigned long acquired;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static struct worker workers[MAX_THREADS];
+
+static inline void burn(long loops)
+{
+	for (long i = 0; i < loops; i++) {
+		asm volatile("" ::: "memory");
+	}
+}
+
+static void calibrate(void)
+{
+	long long start = now_ns();
+
+	burn(50000000);
+	loops_per_us = 50000000.0 * 1000 / (now_ns() - start);
+}
+
+/* Tracepoint of every syscall entry, -1 if perf cannot count it here */
+static int syscall_counter(void)
+{
+	static const char *paths[] = {
+		"/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+		"/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id"
+	};
+	struct perf_event_attr attr;
+	unsigned long long id = 0;
+	unsigned int i;
+	FILE *f;
+
+	for (i = 0; i < sizeof(paths) / sizeof(*paths) && !id; i++) {
+		if ((f = fopen(paths[i], "r"))) {
+			if (fscanf(f, "%llu", &id) != 1) {
+				id = 0;
+			}
+			fclose(f);
+		}
+	}
+
+	if (!id) {
+		return -1;
+	}
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_TRACEPOINT;
+	attr.config = id;
+	attr.disabled = 1;
+	/* Threads created afterwards are counted too, once they exit */
+	attr.inherit = 1;
+
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static long context_switches(void)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru) == -1) {
+		errExit("getrusage");
+	}
+
+	return ru.ru_nvcsw + ru.ru_nivcsw;
+}
+
+static void init_lock(const runtime_lock *ops)
+{
+	runtime_lock_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	if (ops->type == RT_PROTECT || ops->type == RT_PI_PROTECT) {
+		attr.ceiling = HIGHEST_PRIO;
+	}
+
+	memset(&bench, 0, sizeof(bench));
+	cb2_lock_init(&bench.lock, ops, &attr);
+}
+
+static void uncontended(const runtime_lock *ops, long iters)
+{
+	long long start;
+	long i;
+
+	init_lock(ops);
+
+	/* Warm up the caches and the per-thread state of the protocol */
+	for (i = 0; i < iters / 10; i++) {
+		cb2_lock_acquire(&bench.lock);
+		cb2_lock_release(&bench.lock);
+	}
+
+	start = now_ns();
+	for (i = 0; i < iters; i++) {
+		cb2_lock_acquire(&bench.lock);
+		cb2_lock_release(&bench.lock);
+	}
+
+	printf("%-32s uncontended lock+unlock: %.1f ns\n", ops->description,
+		(double)(now_ns() - start) / iters);
+
+	cb2_lock_destroy(&bench.lock);
+}
+
+static void *worker(void *arg)
+{
+	struct worker *w = arg;
+	pid_t me = self_tid();
+	long long now, d;
+
+	pthread_barrier_wait(&barrier);
+
+	while (!stop) {
+		cb2_lock_acquire(&bench.lock);
+
+		/* Only a change of owner is a handoff */
+		if (bench.last_owner && bench.last_owner != me) {
+			now = now_ns();
+			d = now - bench.released_at;
+			bench.handoffs++;
+			bench.handoff_ns += d;
+			if (d > bench.handoff_max) {
+				bench.handoff_max = d;
+			}
+		}
+
+		burn(cs_loops);
+
+		bench.last_owner = me;
+		bench.released_at = now_ns();
+		cb2_lock_release(&bench.lock);
+
+		w->acquired++;
+		burn(ncs_loops);
+	}
+
+	return NULL;
+}
+
+static void contended(const runtime_lock *ops, int nthreads, int ms)
+{
+	struct timespec duration = { ms / 1000, (ms % 1000) * 1000000L };
+	unsigned long acquired = 0;
+	long long start, elapsed, syscalls = -1;
+	long csw;
+	int i, fd;
+
+	init_lock(ops);
+	stop = 0;
+
+	if (pthread_barrier_init(&barrier, NULL, nthreads + 1) != 0) {
+		errExit("Barrier init");
+	}
+
+	if ((fd = syscall_counter()) >= 0) {
+		ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		workers[i].acquired = 0;
+		if (pthread_create(&workers[i].thread, NULL, worker, &workers[i]) != 0) {
+			errExit("Could not create thread");
+		}
+	}
+
+	csw = context_switches();
+	if (fd >= 0) {
+		ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+
+	pthread_barrier_wait(&barrier);
+	start = now_ns();
+	nanosleep(&duration, NULL);
+	stop = 1;
+
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_join(workers[i].thread, NULL) != 0) {
+			errExit("Could not join thread");
+		}
+		acquired += workers[i].acquired;
+	}
+	elapsed = now_ns() - start;
+
+	csw = context_switches() - csw;
+	if (fd >= 0) {
+		ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(fd, &syscalls, sizeof(syscalls)) != sizeof(syscalls)) {
+			syscalls = -1;
+		}
+		close(fd);
+	}
+
+	printf("%-32s %3d %10.3f %10.1f %10lld ", ops->description,
+		nthreads, acquired * 1000.0 / elapsed,
+		bench.handoffs ? (double)bench.handoff_ns / bench.handoffs : 0.0,
+		bench.handoff_max);
+
+	/* The barrier and the joins are counted too, they are noise next to
+	 * a run of any length */
+	if (syscalls >= 0) {
+		printf("%10.3f ", acquired ? (double)syscalls / acquired : 0.0);
+	} else {
+		printf("%10s ", "n/a");
+	}
+	printf("%10.3f\n", acquired ? (double)csw / acquired : 0.0);
+
+	pthread_barrier_destroy(&barrier);
+	cb2_lock_destroy(&bench.lock);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *list = DEFAULT_PROTOCOLS;
+	int opt, nthreads = get_nprocs(), ms = 1000, cs_ns = 100, ncs_ns = 100;
+	int proto, n, header = 0;
+	long iters = 10000000;
+	char *next;
+
+	while ((opt = getopt(argc, argv, "hp:n:d:c:w:i:")) != -1) {
+		switch (opt) {
+			case 'h':
+				printf("Usage: %s [-p protocols] [-n nthreads] [-d ms] "
+					"[-c ns] [-w ns] [-i iters]\n", argv[0]);
+				printf("\n");
+				printf("-p: comma separated protocols (default %s), 0 none,\n",
+					DEFAULT_PROTOCOLS);
+				printf("    1 inherit, 2 protect, 3 CB2, 4 kernel PI futex,\n");
+				printf("    5 kernel ceiling (real-time threads), 6 CB2 queue\n");
+				printf("-n: contended runs from 1 up to this many threads\n");
+				printf("-d: length of each contended run\n");
+				printf("-c: work inside the critical section\n");
+				printf("-w: work between two critical sections\n");
+				printf("-i: uncontended lock/unlock pairs\n");
+				exit(EXIT_SUCCESS);
+			case 'p':
+				list = optarg;
+				break;
+			case 'n':
+				nthreads = atoi(optarg);
+				break;
+			case 'd':
+				ms = atoi(optarg);
+				break;
+			case 'c':
+				cs_ns = atoi(optarg);
+				break;
+			case 'w':
+				ncs_ns = atoi(optarg);
+				break;
+			case 'i':
+				iters = atol(optarg);
+				break;
+			default:
+				exit(EXIT_FAILURE);
+		}
+	}
+
+	if (nthreads < 1 || nthreads > MAX_THREADS) {
+		fprintf(stderr, "-n must be between 1 and %d\n", MAX_THREADS);
+		exit(EXIT_FAILURE);
+	}
+
+	calibrate();
+	cs_loops = cs_ns * loops_per_us / 1000;
+	ncs_loops = ncs_ns * loops_per_us / 1000;
+
+	printf("Critical section %d ns, outside %d ns, %d ms per run\n\n",
+		cs_ns, ncs_ns, ms);
+
+	for (next = (char *)list; *next; next += (*next == ',')) {
+		proto = strtol(next, &next, 10);
+		if (proto < 0 || proto >= (int)(sizeof(protocols) / sizeof(*protocols))) {
+			fprintf(stderr, "Not a valid mutex protocol: %d\n", proto);
+			exit(EXIT_FAILURE);
+		}
+
+		uncontended(protocols[proto], iters);
+	}
+
+	printf("\n%-32s %3s %10s %10s %10s %10s %10s\n", "protocol", "n",
+		"Mops/s", "handoff", "max", "sys/acq", "csw/acq");
+
+	for (next = (char *)list; *next; next += (*next == ',')) {
+		proto = strtol(next, &next, 10);
+
+		if (header++) {
+			printf("\n");
+		}
+		for (n = 1; n <= nthreads; n++) {
+			contended(protocols[proto], n, ms);
+		}
+	}
+
+	return 0;
+}
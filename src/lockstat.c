@@ -0,0 +1,312 @@
+#include "lockstat.h"
+
+#ifndef __NO_LOCKSTAT__
+
+__thread int lockstat_self = 0;
+
+/* Bit i is set while slot i belongs to a live thread. The last slot is the
+ * shared one, and never handed out. */
+static unsigned long long slots_taken = 0;
+
+static pthread_key_t slot_key;
+static pthread_once_t slot_key_once = PTHREAD_ONCE_INIT;
+
+/* Live locks. Only init, destroy and the dumps walk it, so a spin lock is
+ * enough, and it keeps us away from pthread mutexes (see preload.c). */
+static struct lockstat *registry = NULL;
+static int registry_lock = 0;
+
+/* TSC and clock when we started, to convert ticks into nanoseconds */
+static unsigned long start_ticks;
+static long long start_ns;
+
+__attribute__((constructor)) static void lockstat_start(void)
+{
+	start_ticks = lockstat_now();
+	start_ns = now_ns();
+}
+
+static void release_slot(__attribute__((unused)) void *unused)
+{
+	int i = lockstat_self - 1;
+
+	/* Any lock we still take on the way out goes to the shared slot */
+	lockstat_self = LOCKSTAT_SLOTS;
+	__atomic_and_fetch(&slots_taken, ~(1ULL << i), __ATOMIC_RELEASE);
+}
+
+static void make_slot_key(void)
+{
+	if (pthread_key_create(&slot_key, release_slot) != 0) {
+		errExit("failed to create the lockstat key");
+	}
+}
+
+int lockstat_assign_slot(void)
+{
+	unsigned long long taken = __atomic_load_n(&slots_taken, __ATOMIC_RELAXED);
+	int i;
+
+	pthread_once(&slot_key_once, make_slot_key);
+
+	do {
+		i = __builtin_ctzll(~taken);
+		if (i >= LOCKSTAT_SLOTS - 1) {
+			lockstat_self = LOCKSTAT_SLOTS;
+			return lockstat_self;
+		}
+	} while (!__atomic_compare_exchange_n(&slots_taken, &taken,
+			taken | (1ULL << i), 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+	lockstat_self = i + 1;
+	pthread_setspecific(slot_key, &lockstat_self);
+	return lockstat_self;
+}
+
+/* The slots of the threads that are gone are free again, and any of them
+ * may have held the registry */
+void lockstat_forked(void)
+{
+	slots_taken = (lockstat_self && lockstat_self < LOCKSTAT_SLOTS) ?
+		1ULL << (lockstat_self - 1) : 0;
+	registry_lock = 0;
+}
+
+static inline void registry_acquire(void)
+{
+	while (__atomic_exchange_n(&registry_lock, 1, __ATOMIC_ACQUIRE)) {
+		sched_yield();
+	}
+}
+
+static inline void registry_release(void)
+{
+	__atomic_store_n(&registry_lock, 0, __ATOMIC_RELEASE);
+}
+
+static double ns_per_tick(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	struct timespec settle = { 0, 10000000 };
+
+	/* Too little time to go on right after start up */
+	if (now_ns() - start_ns < 10000000) {
+		nanosleep(&settle, NULL);
+	}
+
+	return (double)(now_ns() - start_ns) / (lockstat_now() - start_ticks);
+#else
+	return 1;
+#endif
+}
+
+void lockstat_init(cb2_lock_t *l)
+{
+	struct lockstat *st;
+
+	if (!(st = aligned_alloc(CACHE_LINE_SIZE, sizeof(*st)))) {
+		errExit("Could not allocate the lock stats");
+	}
+	memset(st, 0, sizeof(*st));
+	st->lock = l;
+	l->stat = st;
+
+	registry_acquire();
+	st->next = registry;
+	if (registry) {
+		registry->prev = st;
+	}
+	registry = st;
+	registry_release();
+}
+
+struct lockstat_slot *lockstat_slot_other(struct lockstat *st, int i)
+{
+	struct lockstat_slot *slot, *none_yet = NULL;
+	int none = 0;
+
+	if (__atomic_compare_exchange_n(&st->solo_owner, &none, i, 0,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		return &st->solo;
+	}
+
+	slot = __atomic_load_n(&st->slot, __ATOMIC_ACQUIRE);
+	if (!slot) {
+		if (!(slot = aligned_alloc(CACHE_LINE_SIZE,
+				LOCKSTAT_SLOTS * sizeof(*slot)))) {
+			errExit("Could not allocate the lock stats");
+		}
+		memset(slot, 0, LOCKSTAT_SLOTS * sizeof(*slot));
+
+		/* Somebody else may have been quicker */
+		if (!__atomic_compare_exchange_n(&st->slot, &none_yet, slot,
+				0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			free(slot);
+			slot = none_yet;
+		}
+	}
+
+	return &slot[i - 1];
+}
+
+void lockstat_destroy(cb2_lock_t *l)
+{
+	struct lockstat *st = l->stat;
+
+	registry_acquire();
+	if (st->prev) {
+		st->prev->next = st->next;
+	} else {
+		registry = st->next;
+	}
+	if (st->next) {
+		st->next->prev = st->prev;
+	}
+	registry_release();
+
+	l->stat = NULL;
+	free(st->slot);
+	free(st);
+}
+
+static void collect(struct lockstat *st, struct cb2_lock_stats *s,
+		double scale)
+{
+	struct lockstat_slot *slots = __atomic_load_n(&st->slot, __ATOMIC_ACQUIRE);
+	unsigned long hold = 0, samples = 0, wait = 0;
+	struct lockstat_slot *slot;
+	int i;
+
+	memset(s, 0, sizeof(*s));
+
+	/* The solo slot first, then the others if there are any */
+	for (i = -1; i < (slots ? LOCKSTAT_SLOTS : 0); i++) {
+		slot = i < 0 ? &st->solo : &slots[i];
+
+		s->acquisitions += __atomic_load_n(&slot->acquisitions, __ATOMIC_RELAXED);
+		s->contended += __atomic_load_n(&slot->contended, __ATOMIC_RELAXED);
+		s->try_again += __atomic_load_n(&slot->try_again, __ATOMIC_RELAXED);
+		s->spin_acquired += __atomic_load_n(&slot->spin_acquired, __ATOMIC_RELAXED);
+		s->futex_waits += __atomic_load_n(&slot->futex_waits, __ATOMIC_RELAXED);
+		s->lottery_won += __atomic_load_n(&slot->lottery_won, __ATOMIC_RELAXED);
+		s->lottery_lost += __atomic_load_n(&slot->lottery_lost, __ATOMIC_RELAXED);
+		s->boosts += __atomic_load_n(&slot->boosts, __ATOMIC_RELAXED);
+		s->prio_syscalls += __atomic_load_n(&slot->prio_syscalls, __ATOMIC_RELAXED);
+		hold += __atomic_load_n(&slot->hold_ticks, __ATOMIC_RELAXED);
+		samples += __atomic_load_n(&slot->hold_samples, __ATOMIC_RELAXED);
+		wait += __atomic_load_n(&slot->wait_ticks, __ATOMIC_RELAXED);
+	}
+
+	/* Only some holds were timed */
+	s->hold_ns = samples ? hold * scale * s->acquisitions / samples : 0;
+	s->wait_ns = wait * scale;
+}
+
+int lockstat_collect(cb2_lock_t *l, struct cb2_lock_stats *s)
+{
+	collect(l->stat, s, ns_per_tick());
+	return 0;
+}
+
+void lockstat_dump(FILE *f)
+{
+	double scale = ns_per_tick();
+	struct cb2_lock_stats s;
+	struct lockstat *st;
+
+	registry_acquire();
+
+	for (st = registry; st; st = st->next) {
+		collect(st, &s, scale);
+		if (!s.acquisitions) {
+			continue;
+		}
+
+		fprintf(f, "lockstat %p (%s): %lu acquired, %lu contended (%lu "
+			"spinning), %lu retries (%lu futex waits), lottery %lu won "
+			"%lu lost, %lu boosts, %lu prio syscalls, hold %.0f ns, wait "
+			"%.0f ns\n", (void *)st->lock,
+			st->lock->ops ? st->lock->ops->description : "?",
+			s.acquisitions, s.contended, s.spin_acquired, s.try_again,
+			s.futex_waits, s.lottery_won,
+			s.lottery_lost, s.boosts, s.prio_syscalls,
+			(double)s.hold_ns / s.acquisitions,
+			s.contended ? (double)s.wait_ns / s.contended : 0.0);
+	}
+
+	registry_release();
+	fflush(f);
+}
+
+struct dumper {
+	struct timespec period;
+	FILE *f;
+};
+
+static void *dumper(void *arg)
+{
+	struct dumper *d = arg;
+
+	while (1) {
+		nanosleep(&d->period, NULL);
+		lockstat_dump(d->f);
+	}
+
+	return NULL;
+}
+
+int lockstat_dump_every(int period_ms, FILE *f)
+{
+	struct dumper *d;
+	pthread_t thread;
+
+	if (period_ms <= 0 || !(d = malloc(sizeof(*d)))) {
+		return -1;
+	}
+
+	d->period.tv_sec = period_ms / 1000;
+	d->period.tv_nsec = (period_ms % 1000) * 1000000L;
+	d->f = f;
+
+	if (pthread_create(&thread, NULL, dumper, d) != 0) {
+		free(d);
+		return -1;
+	}
+	pthread_detach(thread);
+
+	return 0;
+}
+
+#else
+
+void lockstat_init(cb2_lock_t *l)
+{
+	l->stat = NULL;
+}
+
+void lockstat_destroy(__attribute__((unused)) cb2_lock_t *l)
+{
+}
+
+int lockstat_collect(__attribute__((unused)) cb2_lock_t *l,
+		struct cb2_lock_stats *s)
+{
+	memset(s, 0, sizeof(*s));
+	return -1;
+}
+
+void lockstat_dump(__attribute__((unused)) FILE *f)
+{
+}
+
+void lockstat_forked(void)
+{
+}
+
+int lockstat_dump_every(__attribute__((unused)) int period_ms,
+		__attribute__((unused)) FILE *f)
+{
+	return -1;
+}
+
+#endif
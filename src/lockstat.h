@@ -0,0 +1,216 @@
+#ifndef __LOCKSTAT_H_
+#define __LOCKSTAT_H_
+
+#include <stdio.h>
+
+#include "runtime_lock.h"
+#include "util.h"
+#include "prio.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/*
+	Contention statistics of the CB2 protocols. Every lock has a slot per
+	thread, cache line aligned, which only that thread writes: counting is
+	a plain add to a line no other CPU touches, and nothing here shares a
+	line with the lock word. The stats entry of the protocols adds the
+	slots up (lockstat_collect()), which may lag behind the writers a bit
+	but never tears a counter.
+
+	A thread gives its slot back when it exits. While all but the last
+	slot are taken, the threads that come next share the last one: they
+	add atomically, and don't time their holds.
+
+	Times are read from the TSC where there is one, and converted to
+	nanoseconds when the slots are added up. Reading the clock is most of
+	the cost, so only the waits (which are slow anyway) are all timed: the
+	hold time is measured every LOCKSTAT_HOLD_SAMPLE acquisitions of each
+	thread and scaled up.
+
+	Most locks are only ever taken by one thread, so a lock starts with a
+	single slot, for the first thread that counts on it. The array of all
+	the slots is only allocated when a second thread comes along.
+
+	Build with -D__NO_LOCKSTAT__ to take all of it out: the hooks below
+	turn into nothing, and the stats entry returns -1.
+*/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The slots are a bit each of a 64-bit mask */
+#define LOCKSTAT_SLOTS 64
+#define LOCKSTAT_HOLD_SAMPLE 16
+
+struct lockstat_slot {
+	unsigned long acquisitions;
+	unsigned long contended;
+	unsigned long try_again;
+	unsigned long spin_acquired;
+	unsigned long futex_waits;
+	unsigned long lottery_won;
+	unsigned long lottery_lost;
+	unsigned long boosts;
+	unsigned long prio_syscalls;
+	unsigned long hold_ticks;
+	unsigned long hold_samples;
+	unsigned long wait_ticks;
+
+	/* When this thread took the lock, if this hold is timed */
+	unsigned long acquired_at;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct lockstat {
+	cb2_lock_t *lock;
+
+	/* Every live lock is on a list, for lockstat_dump() */
+	struct lockstat *prev, *next;
+
+	/* The slot number (as in lockstat_self) of the thread that got solo,
+	 * 0 while nobody did */
+	int solo_owner;
+	struct lockstat_slot solo;
+
+	/* LOCKSTAT_SLOTS of them, NULL until a thread other than solo_owner
+	 * counts on the lock */
+	struct lockstat_slot *slot;
+};
+
+/* From the init and destroy of the protocol */
+void lockstat_init(cb2_lock_t *l);
+void lockstat_destroy(cb2_lock_t *l);
+
+/* The stats entry of the CB2 protocols: 0, or -1 if compiled out */
+int lockstat_collect(cb2_lock_t *l, struct cb2_lock_stats *s);
+
+/* A line with the stats of every live lock */
+void lockstat_dump(FILE *f);
+
+/* In the child of a fork(), before it takes any lock */
+void lockstat_forked(void);
+
+/* lockstat_dump() every period_ms, from a thread of its own. Returns -1 if
+ * the thread could not be started. */
+int lockstat_dump_every(int period_ms, FILE *f);
+
+#ifndef __NO_LOCKSTAT__
+
+/* 1 + the calling thread's slot number, 0 until it touches a lock. The
+ * shared slot is LOCKSTAT_SLOTS. */
+extern __thread int lockstat_self;
+int lockstat_assign_slot(void);
+struct lockstat_slot *lockstat_slot_other(struct lockstat *st, int i);
+
+static inline unsigned long lockstat_now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return now_ns();
+#endif
+}
+
+static inline struct lockstat_slot *lockstat_slot(cb2_lock_t *l)
+{
+	int i = lockstat_self;
+
+	if (__builtin_expect(!i, 0)) {
+		i = lockstat_assign_slot();
+	}
+
+	if (__builtin_expect(l->stat->solo_owner == i, 1)) {
+		return &l->stat->solo;
+	}
+
+	return lockstat_slot_other(l->stat, i);
+}
+
+static inline void lockstat_add(unsigned long *counter, unsigned long v)
+{
+	/* Nobody else writes our own slot */
+	if (__builtin_expect(lockstat_self < LOCKSTAT_SLOTS, 1)) {
+		__atomic_store_n(counter, *counter + v, __ATOMIC_RELAXED);
+	} else {
+		__atomic_add_fetch(counter, v, __ATOMIC_RELAXED);
+	}
+}
+
+#define lockstat_count(l, counter) \
+	lockstat_add(&lockstat_slot(l)->counter, 1)
+
+/* The priority syscalls we made for l since prio_syscalls_self was since */
+static inline void lockstat_syscalls(cb2_lock_t *l, unsigned long since)
+{
+	if (prio_syscalls_self != since) {
+		lockstat_add(&lockstat_slot(l)->prio_syscalls,
+			prio_syscalls_self - since);
+	}
+}
+
+static inline void lockstat_acquired(cb2_lock_t *l)
+{
+	struct lockstat_slot *s = lockstat_slot(l);
+	unsigned long n = s->acquisitions;
+
+	lockstat_add(&s->acquisitions, 1);
+	if (__builtin_expect(lockstat_self < LOCKSTAT_SLOTS, 1)) {
+		s->acquired_at = (n % LOCKSTAT_HOLD_SAMPLE) ? 0 : lockstat_now();
+	}
+}
+
+static inline void lockstat_released(cb2_lock_t *l)
+{
+	struct lockstat_slot *s = lockstat_slot(l);
+
+	if (s->acquired_at) {
+		lockstat_add(&s->hold_ticks, lockstat_now() - s->acquired_at);
+		lockstat_add(&s->hold_samples, 1);
+	}
+}
+
+/* We got l after waiting since `since` (a lockstat_now()) */
+static inline void lockstat_waited(cb2_lock_t *l, unsigned long since)
+{
+	struct lockstat_slot *s = lockstat_slot(l);
+
+	lockstat_add(&s->contended, 1);
+	lockstat_add(&s->wait_ticks, lockstat_now() - since);
+}
+
+#else
+
+static inline unsigned long lockstat_now(void)
+{
+	return 0;
+}
+
+#define lockstat_count(l, counter) do {} while (0)
+
+static inline void lockstat_syscalls(__attribute__((unused)) cb2_lock_t *l,
+		__attribute__((unused)) unsigned long since)
+{
+}
+
+static inline void lockstat_acquired(__attribute__((unused)) cb2_lock_t *l)
+{
+}
+
+static inline void lockstat_released(__attribute__((unused)) cb2_lock_t *l)
+{
+}
+
+static inline void lockstat_waited(__attribute__((unused)) cb2_lock_t *l,
+		__attribute__((unused)) unsigned long since)
+{
+}
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
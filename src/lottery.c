@@ -0,0 +1,215 @@
+#include <assert.h>
+
+#include "util.h"
+#include "lottery.h"
+
+static const lottery_engine *engine = &xorshift_engine;
+static uint64_t base_seed = 0;
+
+/* Bumped on every lottery_init(), so threads know to reseed */
+static unsigned int generation = 1;
+static unsigned int next_stream = 0;
+
+static __thread uint64_t state[2];
+static __thread unsigned int my_generation = 0;
+static __thread uint64_t my_stream;
+static __thread int my_stream_set = 0;
+
+static uint64_t splitmix64(uint64_t *x)
+{
+	uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+/* xorshift64*, returns the high half which has the better bits */
+static void xorshift_seed(uint64_t *s, uint64_t seed, uint64_t stream)
+{
+	uint64_t x = seed ^ (stream * 0xd1342543de82ef95ULL);
+
+	do {
+		s[0] = splitmix64(&x);
+	} while (s[0] == 0);
+}
+
+static uint32_t xorshift_next(uint64_t *s)
+{
+	uint64_t x = s[0];
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	s[0] = x;
+	return (x * 0x2545f4914f6cdd1dULL) >> 32;
+}
+
+/* PCG32 (XSH RR), the stream selects the increment */
+static uint32_t pcg32_next(uint64_t *s)
+{
+	uint64_t old = s[0];
+	uint32_t xorshifted, rot;
+
+	s[0] = old * 6364136223846793005ULL + s[1];
+	xorshifted = ((old >> 18) ^ old) >> 27;
+	rot = old >> 59;
+	return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+}
+
+static void pcg32_seed(uint64_t *s, uint64_t seed, uint64_t stream)
+{
+	s[0] = 0;
+	s[1] = (stream << 1) | 1;
+	pcg32_next(s);
+	s[0] += seed;
+	pcg32_next(s);
+}
+
+lottery_engine xorshift_engine = {
+	.description = "xorshift64*",
+	.seed        = xorshift_seed,
+	.next        = xorshift_next
+};
+
+lottery_engine pcg32_engine = {
+	.description = "pcg32",
+	.seed        = pcg32_seed,
+	.next        = pcg32_next
+};
+
+void lottery_init(const lottery_engine *e, uint64_t seed)
+{
+	struct timespec now;
+
+	if (seed == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		seed = ((uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec) | 1;
+	}
+
+	engine = e ? e : &xorshift_engine;
+	__atomic_store_n(&base_seed, seed, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&generation, 1, __ATOMIC_RELEASE);
+}
+
+uint64_t lottery_get_seed(void)
+{
+	return __atomic_load_n(&base_seed, __ATOMIC_RELAXED);
+}
+
+void lottery_thread_stream(uint64_t stream)
+{
+	my_stream = stream;
+	my_stream_set = 1;
+	my_generation = 0;
+}
+
+static inline uint32_t next32(void)
+{
+	unsigned int gen = __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+
+	if (__builtin_expect(my_generation != gen, 0)) {
+		/* Nobody called lottery_init(), seed from the clock once */
+		if (!lottery_get_seed()) {
+			uint64_t zero = 0;
+			struct timespec now;
+
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			__atomic_compare_exchange_n(&base_seed, &zero,
+				((uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec) | 1,
+				0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+		}
+
+		if (!my_stream_set) {
+			my_stream = __atomic_fetch_add(&next_stream, 1, __ATOMIC_RELAXED);
+			my_stream_set = 1;
+		}
+
+		engine->seed(state, lottery_get_seed(), my_stream);
+		my_generation = gen;
+	}
+
+	return engine->next(state);
+}
+
+/* Lemire's multiply-shift, rejecting only the biased low slice */
+uint32_t lottery_bounded(uint32_t range)
+{
+	uint64_t m;
+	uint32_t low, threshold;
+
+	assert(range > 0);
+
+	m = (uint64_t)next32() * range;
+	low = (uint32_t)m;
+
+	if (low < range) {
+		threshold = -range % range;
+		while (low < threshold) {
+			m = (uint64_t)next32() * range;
+			low = (uint32_t)m;
+		}
+	}
+
+	return m >> 32;
+}
+
+int lottery_pick(const uint32_t *tickets, int n)
+{
+	uint64_t total = 0;
+	uint32_t winning_ticket;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		total += tickets[i];
+	}
+
+	if (total == 0) {
+		return -1;
+	}
+
+	assert(total <= UINT32_MAX && "Too many tickets for one draw");
+	winning_ticket = lottery_bounded((uint32_t)total);
+
+	for (i = 0; i < n; i++) {
+		if (winning_ticket < tickets[i]) {
+			break;
+		}
+		winning_ticket -= tickets[i];
+	}
+
+	return i;
+}
+
+uint32_t *lottery_scratch(int n)
+{
+	static __thread uint32_t *scratch = NULL;
+	static __thread int size = 0;
+
+	/* Only grows, so a thread allocates a few times at most */
+	if (n > size) {
+		size = (n > 64) ? n * 2 : 64;
+		if (!(scratch = realloc(scratch, size * sizeof(*scratch)))) {
+			errExit("Could not grow the lottery tickets");
+		}
+	}
+
+	return scratch;
+}
+
+const lottery_engine *lottery_engine_by_name(const char *name)
+{
+	static const lottery_engine *engines[] = {
+		&xorshift_engine, &pcg32_engine
+	};
+	unsigned int i;
+
+	for (i = 0; i < sizeof(engines) / sizeof(*engines); i++) {
+		if (*name && !strncmp(name, engines[i]->description,
+				strlen(name))) {
+			return engines[i];
+		}
+	}
+
+	return NULL;
+}
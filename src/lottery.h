@@ -0,0 +1,54 @@
+#ifndef __LOTTERY_H_
+#define __LOTTERY_H_
+
+#include <stdint.h>
+
+/*
+	Lottery subsystem used by the CB2 protocols. Every thread draws from
+	its own generator, so there is no shared state (and no lock) on the
+	draw path. The generator is pluggable, and all threads derive their
+	state from one process-wide seed plus a per-thread stream number, so
+	a run can be replayed bit-for-bit by fixing both.
+*/
+
+typedef struct _lottery_engine {
+
+	char *description;
+
+	/* The state lives in thread local storage owned by lottery.c */
+	void (*seed)(uint64_t *state, uint64_t seed, uint64_t stream);
+	uint32_t (*next)(uint64_t *state);
+
+} lottery_engine;
+
+extern lottery_engine xorshift_engine;
+extern lottery_engine pcg32_engine;
+
+/* Select the generator and the seed for every thread. Threads that already
+ * drew tickets pick up the new seed on their next draw. A seed of 0 means
+ * "use the clock". Not meant to be called while locks are in use. */
+void lottery_init(const lottery_engine *engine, uint64_t seed);
+
+/* Seed actually in use, to be printed so a run can be replayed */
+uint64_t lottery_get_seed(void);
+
+/* Stream for the calling thread. Without it, threads get streams in the
+ * order they first draw, which is not reproducible. */
+void lottery_thread_stream(uint64_t stream);
+
+/* Uniform number in [0, range), without modulo bias. range > 0 */
+uint32_t lottery_bounded(uint32_t range);
+
+/* Index of the winner among n holders of tickets[] (linear, one draw).
+ * Returns -1 if nobody holds a ticket. */
+int lottery_pick(const uint32_t *tickets, int n);
+
+/* Room for the tickets of n holders, to fill and pass to lottery_pick().
+ * Per thread, and only valid until the next call. */
+uint32_t *lottery_scratch(int n);
+
+/* Engine whose name starts with name ("xorshift" or "pcg32"), NULL if
+ * there is none */
+const lottery_engine *lottery_engine_by_name(const char *name);
+
+#endif
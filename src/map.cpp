@@ -1,25 +1,196 @@
 #include "map.h"
-#include <iostream>
-#include <map>
+#include <atomic>
+#include <cstdint>
+#include <ctime>
 
-static std::map<int,int> k_map;
+/*
+	History of the K factor, one entry per high-priority TID. This is a
+	fixed-size open-addressed table: nothing is allocated, every entry is
+	one 64-bit word updated with CAS, and a key can only live in the
+	K_MAP_WINDOW slots after its hash, so a lookup touches at most two
+	cache lines and is safe from any thread without meta_lock.
 
-void insert_if_new(int key)
+	Counts decay by half every K_MAP_EPOCH_MS since they were last
+	touched. Entries that decayed to zero are reused, and if a window is
+	full the entry with the lowest count is evicted. A thread clears its
+	own entry when it exits, so a recycled TID starts from zero.
+
+	Only the thread a TID belongs to inserts it, which is what
+	compute_times_factor() does, so the same key is never inserted twice.
+*/
+
+#define K_MAP_SLOTS    1024
+#define K_MAP_WINDOW   16
+#define K_MAP_EPOCH_MS 100
+
+/* Entry layout: | tid:32 | count:12 | epoch:20 | */
+#define COUNT_BITS 12
+#define EPOCH_BITS 20
+#define COUNT_MAX  ((1u << COUNT_BITS) - 1)
+#define EPOCH_MASK ((1u << EPOCH_BITS) - 1)
+
+static std::atomic<uint64_t> k_map[K_MAP_SLOTS];
+
+static inline uint64_t pack(int key, uint32_t count, uint32_t epoch)
+{
+	return ((uint64_t)(uint32_t)key << 32) |
+		((uint64_t)count << EPOCH_BITS) | (epoch & EPOCH_MASK);
+}
+
+static inline int entry_key(uint64_t e)
+{
+	return (int)(e >> 32);
+}
+
+static inline uint32_t now_epoch(void)
+{
+	struct timespec ts;
+
+	/* The coarse clock is served by the vDSO, no syscall */
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (uint32_t)((ts.tv_sec * 1000 + ts.tv_nsec / 1000000) /
+		K_MAP_EPOCH_MS) & EPOCH_MASK;
+}
+
+static inline uint32_t entry_count(uint64_t e, uint32_t now)
+{
+	uint32_t count = (e >> EPOCH_BITS) & COUNT_MAX;
+	uint32_t age = (now - (uint32_t)e) & EPOCH_MASK;
+
+	return (age >= COUNT_BITS) ? 0 : count >> age;
+}
+
+static inline unsigned int slot_of(int key, unsigned int i)
+{
+	/* Fibonacci hashing spreads consecutive TIDs */
+	return (((uint32_t)key * 2654435769u) + i) % K_MAP_SLOTS;
+}
+
+static std::atomic<uint64_t> *find(int key)
+{
+	for (unsigned int i = 0; i < K_MAP_WINDOW; i++) {
+		std::atomic<uint64_t> *slot = &k_map[slot_of(key, i)];
+		uint64_t e = slot->load(std::memory_order_acquire);
+
+		if (e && entry_key(e) == key) {
+			return slot;
+		}
+	}
+
+	return nullptr;
+}
+
+struct forget_on_exit {
+	int key = 0;
+
+	~forget_on_exit()
+	{
+		if (key) {
+			map_forget(key);
+		}
+	}
+};
+
+static thread_local forget_on_exit exit_hook;
+
+/* Claim a slot for key: an empty or fully decayed one if there is any,
+ * otherwise the one with the lowest count in the window. */
+static std::atomic<uint64_t> *insert(int key)
 {
-	if (k_map.find(key) == k_map.end()){
-		k_map[key] = 0;
+	std::atomic<uint64_t> *slot, *victim;
+	uint32_t now = now_epoch(), lowest;
+	uint64_t e;
+
+	for (;;) {
+		if ((slot = find(key))) {
+			return slot;
+		}
+
+		victim = nullptr;
+		lowest = COUNT_MAX + 1;
+
+		for (unsigned int i = 0; i < K_MAP_WINDOW; i++) {
+			slot = &k_map[slot_of(key, i)];
+			e = slot->load(std::memory_order_relaxed);
+
+			uint32_t count = e ? entry_count(e, now) : 0;
+			if (count < lowest) {
+				lowest = count;
+				victim = slot;
+			}
+			if (count == 0) {
+				break;
+			}
+		}
+
+		e = victim->load(std::memory_order_relaxed);
+		if (e && entry_count(e, now) != lowest) {
+			continue;
+		}
+
+		if (victim->compare_exchange_strong(e, pack(key, 0, now),
+				std::memory_order_acq_rel)) {
+			if (!exit_hook.key) {
+				exit_hook.key = key;
+			}
+			return victim;
+		}
 	}
 }
 
+void insert_if_new(int key)
+{
+	insert(key);
+}
+
 int get_and_increase(int key)
 {
-	return k_map[key]++;
+	std::atomic<uint64_t> *slot = insert(key);
+	uint32_t now = now_epoch(), count;
+	uint64_t e = slot->load(std::memory_order_relaxed);
+
+	do {
+		/* Evicted under our feet, start over somewhere else */
+		if (entry_key(e) != key) {
+			slot = insert(key);
+			e = slot->load(std::memory_order_relaxed);
+		}
+		count = entry_count(e, now);
+	} while (!slot->compare_exchange_weak(e,
+			pack(key, (count < COUNT_MAX) ? count + 1 : count, now),
+			std::memory_order_acq_rel));
+
+	return count;
 }
 
 void map_decrease(int key)
 {
-	if (k_map[key]){
-		k_map[key]--;
+	std::atomic<uint64_t> *slot = find(key);
+	uint32_t now = now_epoch(), count;
+	uint64_t e;
+
+	if (!slot) {
+		return;
 	}
+
+	e = slot->load(std::memory_order_relaxed);
+	do {
+		if (entry_key(e) != key || !(count = entry_count(e, now))) {
+			return;
+		}
+	} while (!slot->compare_exchange_weak(e, pack(key, count - 1, now),
+			std::memory_order_acq_rel));
 }
 
+void map_forget(int key)
+{
+	std::atomic<uint64_t> *slot;
+
+	while ((slot = find(key))) {
+		uint64_t e = slot->load(std::memory_order_relaxed);
+
+		if (entry_key(e) == key) {
+			slot->compare_exchange_strong(e, 0, std::memory_order_acq_rel);
+		}
+	}
+}
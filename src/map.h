@@ -5,12 +5,18 @@
 extern "C" {
 #endif
 
+/* K factor history keyed by TID, see map.cpp. Lock-free and allocation
+ * free, so it can be used outside meta_lock. */
 void insert_if_new(int key);
 
+/* Returns the (decayed) count before the increase, inserting if needed */
 int get_and_increase(int key);
 
 void map_decrease(int key);
 
+/* Drop the entry of a TID that is going away */
+void map_forget(int key);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,144 @@
+/*
+	make check runs this: it takes every protocol that can stand in for a
+	mutex through the standard lock guards, from several threads, and
+	exits with an error if any of them lets two threads in at once or
+	gets a timed lock wrong.
+*/
+#include <cassert>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "cb2_mutex.hpp"
+
+#define THREADS 4
+#define ROUNDS 5000
+
+/* Whether M has try_lock_for() */
+template <class M, class = void>
+struct timed_lockable : std::false_type {};
+
+template <class M>
+struct timed_lockable<M, std::void_t<decltype(std::declval<M &>().try_lock_for(
+	std::chrono::milliseconds(1)))>> : std::true_type {};
+
+static_assert(timed_lockable<cb2::mutex>::value, "cb2::mutex is timed");
+static_assert(!timed_lockable<cb2::queue_mutex>::value,
+	"A queued waiter cannot time out");
+
+/* Every thread takes both mutexes, in the opposite order of the previous
+ * one, and bumps counters only the holder may touch */
+template <class Mutex>
+static void exclusion()
+{
+	std::vector<std::thread> threads;
+	Mutex m, n;
+	long in = 0, count = 0;
+	int i;
+
+	for (i = 0; i < THREADS; i++) {
+		threads.emplace_back([&, i] {
+			int j;
+
+			for (j = 0; j < ROUNDS; j++) {
+				if (i % 2) {
+					std::scoped_lock guard(m, n);
+					in++;
+					assert(in == 1);
+					count++;
+					in--;
+				} else {
+					std::scoped_lock guard(n, m);
+					in++;
+					assert(in == 1);
+					count++;
+					in--;
+				}
+				std::lock_guard<Mutex> guard(m);
+				count++;
+			}
+		});
+	}
+
+	for (auto &t : threads) {
+		t.join();
+	}
+
+	assert(count == 2L * THREADS * ROUNDS);
+}
+
+/* try_lock() fails while another thread holds the mutex */
+template <class Mutex>
+static void busy(Mutex &m)
+{
+	std::thread([&m] {
+		assert(!m.try_lock());
+	}).join();
+}
+
+template <class Mutex>
+static void untimed()
+{
+	Mutex m;
+
+	exclusion<Mutex>();
+
+	{
+		std::unique_lock<Mutex> guard(m, std::try_to_lock);
+
+		assert(guard.owns_lock());
+		busy(m);
+	}
+	assert(m.try_lock());
+	m.unlock();
+}
+
+template <class Mutex>
+static void timed()
+{
+	Mutex m;
+
+	untimed<Mutex>();
+
+	{
+		std::lock_guard<Mutex> guard(m);
+
+		std::thread([&m] {
+			auto start = std::chrono::steady_clock::now();
+
+			assert(!m.try_lock_for(std::chrono::milliseconds(10)));
+			assert(std::chrono::steady_clock::now() - start >=
+				std::chrono::milliseconds(10));
+			assert(!m.try_lock_until(std::chrono::system_clock::now()));
+		}).join();
+	}
+
+	{
+		std::unique_lock<Mutex> guard(m, std::defer_lock);
+
+		assert(guard.try_lock_for(std::chrono::milliseconds(10)));
+	}
+}
+
+int main()
+{
+	cb2_lock_stats s;
+	cb2::mutex m;
+
+	timed<cb2::mutex>();
+	untimed<cb2::queue_mutex>();
+	timed<cb2::basic_mutex<cb2::cb2_protocol, cb2::boost_fifo,
+		cb2::fixed_tickets<20>>>();
+	timed<cb2::basic_mutex<cb2::vtable_protocol<mutex_lock>>>();
+
+	{
+		std::lock_guard<cb2::mutex> guard(m);
+	}
+	if (m.stats(s)) {
+		assert(s.acquisitions == 1);
+	}
+
+	printf("mutex_check: all passed\n");
+	return 0;
+}
@@ -1,32 +1,58 @@
 #include "runtime_lock.h"
 #include "util.h"
+#include "prio.h"
 
 #include <pthread.h>
 
-static pthread_mutex_t lock;
+static void _lock(cb2_lock_t *l)
+{
+	pthread_mutex_lock(&l->lock);
+
+	if (cb2_lock_demotes(l, sched_getcpu())) {
+		if (prio_set(self_tid(), 19) == -1) {
+			errExit("Error setting the thread priority");
+		}
+	}
+}
 
-static void _lock(void)
+static int _trylock(cb2_lock_t *l)
 {
-	pthread_mutex_lock(&lock);
+	int rc = pthread_mutex_trylock(&l->lock);
 
-	if (sched_getcpu() == 0) {
-		if (setpriority(PRIO_PROCESS, gettid(), 19) == -1) {
+	if (rc == 0 && cb2_lock_demotes(l, sched_getcpu())) {
+		if (prio_set(self_tid(), 19) == -1) {
 			errExit("Error setting the thread priority");
 		}
 	}
+
+	return rc;
+}
+
+static int _timedlock(cb2_lock_t *l, const struct timespec *abstime)
+{
+	int rc = pthread_mutex_clocklock(&l->lock, CLOCK_MONOTONIC, abstime);
+
+	if (rc == 0 && cb2_lock_demotes(l, sched_getcpu())) {
+		if (prio_set(self_tid(), 19) == -1) {
+			errExit("Error setting the thread priority");
+		}
+	}
+
+	return rc;
 }
 
-static void _unlock(void)
+static void _unlock(cb2_lock_t *l)
 {
-	pthread_mutex_unlock(&lock);
+	pthread_mutex_unlock(&l->lock);
 }
 
-static void _init(__attribute__((unused)) runtime_lock_attr *attr) {
-	pthread_mutex_init(&lock, NULL);
+static void _init(cb2_lock_t *l, runtime_lock_attr *attr) {
+	pthread_mutex_init(&l->lock, NULL);
+	l->demote_cpus = attr ? attr->demote_cpus : NULL;
 }
 
-static void _destroy(void) {
-	pthread_mutex_destroy(&lock);
+static void _destroy(cb2_lock_t *l) {
+	pthread_mutex_destroy(&l->lock);
 }
 
 runtime_lock mutex_lock = {
@@ -35,5 +61,7 @@ runtime_lock mutex_lock = {
 	.lock        = _lock,
 	.unlock      = _unlock,
 	.init        = _init,
-	.destroy     = _destroy
+	.destroy     = _destroy,
+	.trylock     = _trylock,
+	.timedlock   = _timedlock
 };
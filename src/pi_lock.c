@@ -0,0 +1,120 @@
+#include "runtime_lock.h"
+#include "util.h"
+#include "futex.h"
+#include "boost.h"
+
+/* The kernel's own priority inheritance and ceiling protocols, to compare
+ * against the user space ones. The inherit lock drives a PI futex directly:
+ * uncontended it's a CAS on the lock word, and when contended the kernel
+ * boosts the owner (see pi-futex.txt) with no extra syscalls from us. The
+ * ceiling one is a PTHREAD_PRIO_PROTECT mutex.
+ *
+ * The kernel only boosts real-time priorities: a SCHED_OTHER waiter does not
+ * change the CPU share of a SCHED_OTHER owner. These protocols are meant to
+ * be used by SCHED_FIFO/SCHED_RR threads. */
+
+static void pi_lock(cb2_lock_t *l)
+{
+	int expected = LOCK_WORD_FREE;
+
+	if (__atomic_compare_exchange_n(&l->word, &expected, self_tid(), 0,
+			__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		return;
+	}
+
+	/* The kernel queues us by priority and boosts the owner */
+	while (syscall(SYS_futex, &l->word, FUTEX_LOCK_PI_PRIVATE, 0, NULL,
+			NULL, 0) == -1) {
+		if (errno != EINTR && errno != EAGAIN) {
+			errExit("something went terribly wrong when we tried to get a lock...");
+		}
+	}
+}
+
+static void pi_unlock(cb2_lock_t *l)
+{
+	int expected = self_tid();
+
+	if (__atomic_compare_exchange_n(&l->word, &expected, LOCK_WORD_FREE, 0,
+			__ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+		return;
+	}
+
+	/* There are waiters, the kernel hands the lock to the best one */
+	if (syscall(SYS_futex, &l->word, FUTEX_UNLOCK_PI_PRIVATE, 0, NULL,
+			NULL, 0) == -1) {
+		errExit("Error releasing the PI futex");
+	}
+}
+
+static void pi_init(cb2_lock_t *l, __attribute__((unused)) runtime_lock_attr *attr)
+{
+	l->word = LOCK_WORD_FREE;
+}
+
+static void pi_destroy(cb2_lock_t *l)
+{
+	assert(l->word == LOCK_WORD_FREE && "Destroying a PI lock that is held");
+}
+
+static void protect_lock_fn(cb2_lock_t *l)
+{
+	int rc = pthread_mutex_lock(&l->lock);
+
+	/* EINVAL means we have a better priority than the ceiling */
+	if (rc != 0) {
+		errno = rc;
+		errExit("something went terribly wrong when we tried to get a lock...");
+	}
+}
+
+static void protect_unlock_fn(cb2_lock_t *l)
+{
+	pthread_mutex_unlock(&l->lock);
+}
+
+static void protect_init(cb2_lock_t *l, runtime_lock_attr *attr)
+{
+	pthread_mutexattr_t mattr;
+	int rc = 0;
+
+	if (!attr) {
+		errExit("PI protect lock needs attr");
+	}
+
+	/* The ceiling is given as a nice value like for the other protocols */
+	rc |= pthread_mutexattr_init(&mattr);
+	rc |= pthread_mutexattr_setprotocol(&mattr, PTHREAD_PRIO_PROTECT);
+	rc |= pthread_mutexattr_setprioceiling(&mattr, rt_priority(attr->ceiling));
+	rc |= pthread_mutex_init(&l->lock, &mattr);
+	rc |= pthread_mutexattr_destroy(&mattr);
+
+	if (rc != 0) {
+		errExit("failed to init PI protect lock");
+	}
+
+	l->ceiling = attr->ceiling;
+}
+
+static void protect_destroy(cb2_lock_t *l)
+{
+	pthread_mutex_destroy(&l->lock);
+}
+
+runtime_lock pi_inherit_lock = {
+	.type         = RT_PI_INHERIT,
+	.description  = "kernel PI futex",
+	.lock         = pi_lock,
+	.unlock       = pi_unlock,
+	.init         = pi_init,
+	.destroy      = pi_destroy
+};
+
+runtime_lock pi_protect_lock = {
+	.type         = RT_PI_PROTECT,
+	.description  = "kernel PTHREAD_PRIO_PROTECT",
+	.lock         = protect_lock_fn,
+	.unlock       = protect_unlock_fn,
+	.init         = protect_init,
+	.destroy      = protect_destroy
+};
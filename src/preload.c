@@ -0,0 +1,769 @@
+/*
+	LD_PRELOAD interposer that puts the locks of this directory under the
+	pthread mutexes (and condition variables) of an unmodified binary:
+
+		LD_PRELOAD=./libcb2preload.so CB2_PROTOCOL=3 ./server
+
+	Every application mutex is mapped, by address, onto a cb2_lock_t of
+	its own the first time it is used. The map is a fixed-size open
+	addressed table, and a lookup is a few loads that never take a lock.
+	Adding a key, and removing it when the mutex is destroyed, take a spin
+	lock of the table. Mutexes that do not fit in the table (reported
+	once), or that are not plain ones (recursive, error checking, robust,
+	shared between processes, PI or ceiling), stay with glibc.
+
+	Environment:
+
+	- CB2_PROTOCOL: protocol number as in test_prios -p (default 3, CB2).
+	  Only protocols that can try a lock (see runtime_lock.h) can stand
+	  in for a pthread mutex: 0, 3 and 6.
+	- CB2_BOOST: boost backend as in test_prios -B (default 0, nice).
+	- CB2_TICKETS: where the bystander tickets come from. "sample" (the
+	  default) or "sample:ms" charges every thread of the process to the
+	  CPU it last ran on every ms milliseconds (100 by default, see
+	  tickets_sample()). A number is used as a fixed amount per CPU.
+	- CB2_MUTEXES: which mutexes to take over, "all" (the default) or a
+	  comma separated list of addresses and ranges, such as
+	  "0x4c2a40,0x7f3a10000000-0x7f3a1fffffff".
+	- CB2_LOCKSTAT: print the statistics of every lock to stderr every
+	  this many milliseconds (see lockstat.h).
+	- CB2_LOTTERY: generator of the lottery draws and seed, as in
+	  "pcg32:1234" (see lottery.h). Either part can go, by default the
+	  draws use xorshift64* seeded from the clock.
+	- CB2_TRACE: record the events of every lock into this file, for
+	  trace_analyze (see trace.h). "file:n" makes room for n threads.
+
+	The locks in here use pthread mutexes themselves. While a thread runs
+	our code it gets the glibc functions, so they never come back to us.
+	The child of a fork() forgets every thread but the one that forked,
+	and starts its own ticket sampler.
+*/
+#include <dlfcn.h>
+#include <stdint.h>
+
+#include "runtime_lock.h"
+#include "util.h"
+#include "tickets.h"
+#include "lottery.h"
+#include "boost.h"
+#include "cb2_cond.h"
+#include "lockstat.h"
+#include "trace.h"
+#include "prio.h"
+
+#define PRELOAD_SLOTS  65536
+#define PRELOAD_WINDOW 64
+
+#define PRELOAD_MAX_RANGES 64
+
+/* How often a timed lock of a protocol without timedlock tries again */
+#define PRELOAD_POLL_NS 50000
+
+#define PRELOAD_SAMPLE_MS 100
+
+/* Key of a slot whose mutex was destroyed, lookups go past it */
+#define PRELOAD_TOMBSTONE ((void *)1)
+
+struct preload_slot {
+	void *key;
+	void *inst;
+};
+
+struct preload_table {
+	const char *what;
+	/* Taken to add and remove keys */
+	int lock;
+	int full;
+	struct preload_slot slots[PRELOAD_SLOTS];
+};
+
+struct preload_cond {
+	cb2_cond_t cond;
+	/* Clock of the application's deadlines */
+	clockid_t clock;
+};
+
+static struct preload_table mutexes = { .what = "mutex" };
+static struct preload_table conds = { .what = "condition variable" };
+
+static const runtime_lock *protocols[] = {
+	&mutex_lock, &inherit_lock, &protect_lock, &CB2_lock,
+	&pi_inherit_lock, &pi_protect_lock, &CB2_queue_lock
+};
+static boost_backend *boost_backends[] = {
+	&nice_boost, &fifo_boost, &rr_boost, &uclamp_boost
+};
+
+static const runtime_lock *ops;
+static runtime_lock_attr lock_attr;
+static int sample_ms;
+
+static struct {
+	uintptr_t from, to;
+} ranges[PRELOAD_MAX_RANGES];
+static int nranges = -1;
+
+static pthread_once_t setup_once = PTHREAD_ONCE_INIT;
+
+/* Set while the thread is in here: its own pthread calls go to glibc */
+static __thread int inside;
+
+static int (*real_mutex_lock)(pthread_mutex_t *);
+static int (*real_mutex_trylock)(pthread_mutex_t *);
+static int (*real_mutex_timedlock)(pthread_mutex_t *, const struct timespec *);
+static int (*real_mutex_clocklock)(pthread_mutex_t *, clockid_t,
+		const struct timespec *);
+static int (*real_mutex_unlock)(pthread_mutex_t *);
+static int (*real_mutex_destroy)(pthread_mutex_t *);
+static int (*real_cond_init)(pthread_cond_t *, const pthread_condattr_t *);
+static int (*real_cond_wait)(pthread_cond_t *, pthread_mutex_t *);
+static int (*real_cond_timedwait)(pthread_cond_t *, pthread_mutex_t *,
+		const struct timespec *);
+static int (*real_cond_clockwait)(pthread_cond_t *, pthread_mutex_t *,
+		clockid_t, const struct timespec *);
+static int (*real_cond_signal)(pthread_cond_t *);
+static int (*real_cond_broadcast)(pthread_cond_t *);
+static int (*real_cond_destroy)(pthread_cond_t *);
+
+/* glibc keeps the pre-2.3.2 condition variables around under the same
+ * names, the default version is the one programs link against */
+static void *real_cond(const char *name)
+{
+	void *fn = dlvsym(RTLD_NEXT, name, "GLIBC_2.3.2");
+
+	return fn ? fn : dlsym(RTLD_NEXT, name);
+}
+
+static void *sampler(__attribute__((unused)) void *arg)
+{
+	struct timespec period = {
+		.tv_sec = sample_ms / 1000,
+		.tv_nsec = (sample_ms % 1000) * 1000000L
+	};
+
+	inside = 1;
+
+	for (;;) {
+		tickets_sample();
+		nanosleep(&period, NULL);
+	}
+
+	return NULL;
+}
+
+static void start_sampler(void)
+{
+	pthread_t thread;
+
+	if (pthread_create(&thread, NULL, sampler, NULL) != 0) {
+		errExit("Could not create the ticket sampler");
+	}
+	pthread_detach(thread);
+}
+
+/* The child of a fork() is left with only the thread that forked, the state
+ * of the others has to go before it takes any of our locks */
+static void preload_forked(void)
+{
+	cached_tid = 0;
+	prio_forked();
+	tickets_forked();
+	lockstat_forked();
+
+	if (sample_ms) {
+		start_sampler();
+	}
+}
+
+static void parse_mutexes(const char *list)
+{
+	char *end;
+
+	if (!list || !strcmp(list, "all")) {
+		return;
+	}
+
+	nranges = 0;
+	while (*list && nranges < PRELOAD_MAX_RANGES) {
+		ranges[nranges].from = strtoull(list, &end, 0);
+		ranges[nranges].to = ranges[nranges].from;
+		if (*end == '-') {
+			ranges[nranges].to = strtoull(end + 1, &end, 0);
+		}
+		if (end == list) {
+			fprintf(stderr, "CB2_MUTEXES: cannot parse \"%s\"\n", list);
+			break;
+		}
+		nranges++;
+		list = (*end == ',') ? end + 1 : end;
+	}
+}
+
+/* engine, engine:seed or :seed */
+static void parse_lottery(const char *env)
+{
+	const lottery_engine *engine = &xorshift_engine;
+	const char *colon = strchr(env, ':');
+	char name[32];
+
+	if (colon != env) {
+		snprintf(name, sizeof(name), "%.*s", colon ? (int)(colon - env) :
+			(int)strlen(env), env);
+		if (!(engine = lottery_engine_by_name(name))) {
+			fprintf(stderr, "CB2_LOTTERY: no generator %s, using %s\n",
+				name, xorshift_engine.description);
+			engine = &xorshift_engine;
+		}
+	}
+
+	lottery_init(engine, colon ? strtoull(colon + 1, NULL, 0) : 0);
+}
+
+static void preload_setup(void)
+{
+	const char *env;
+	int proto = RT_CB2, backend = 0;
+
+	inside++;
+
+	real_mutex_lock = dlsym(RTLD_NEXT, "pthread_mutex_lock");
+	real_mutex_trylock = dlsym(RTLD_NEXT, "pthread_mutex_trylock");
+	real_mutex_timedlock = dlsym(RTLD_NEXT, "pthread_mutex_timedlock");
+	real_mutex_clocklock = dlsym(RTLD_NEXT, "pthread_mutex_clocklock");
+	real_mutex_unlock = dlsym(RTLD_NEXT, "pthread_mutex_unlock");
+	real_mutex_destroy = dlsym(RTLD_NEXT, "pthread_mutex_destroy");
+	real_cond_init = real_cond("pthread_cond_init");
+	real_cond_wait = real_cond("pthread_cond_wait");
+	real_cond_timedwait = real_cond("pthread_cond_timedwait");
+	real_cond_clockwait = real_cond("pthread_cond_clockwait");
+	real_cond_signal = real_cond("pthread_cond_signal");
+	real_cond_broadcast = real_cond("pthread_cond_broadcast");
+	real_cond_destroy = real_cond("pthread_cond_destroy");
+
+	if ((env = getenv("CB2_PROTOCOL"))) {
+		proto = atoi(env);
+	}
+	if ((env = getenv("CB2_BOOST"))) {
+		backend = atoi(env);
+	}
+
+	if (proto < 0 || proto >= (int)(sizeof(protocols) / sizeof(*protocols)) ||
+	    !protocols[proto]->trylock) {
+		fprintf(stderr, "CB2_PROTOCOL: %d cannot stand in for a pthread "
+			"mutex, leaving them alone\n", proto);
+		inside--;
+		return;
+	}
+	if (backend < 0 || backend >= (int)(sizeof(boost_backends) /
+			sizeof(*boost_backends))) {
+		fprintf(stderr, "CB2_BOOST: no backend %d, using nice\n", backend);
+		backend = 0;
+	}
+
+	lock_attr.boost = boost_backends[backend];
+
+	env = getenv("CB2_TICKETS");
+	if (!env || !strncmp(env, "sample", 6)) {
+		sample_ms = (env && env[6] == ':') ? atoi(env + 7) : PRELOAD_SAMPLE_MS;
+		sample_ms = (sample_ms > 0) ? sample_ms : PRELOAD_SAMPLE_MS;
+		start_sampler();
+	} else {
+		lock_attr.by_tickets_cpu = atoi(env);
+	}
+
+	parse_mutexes(getenv("CB2_MUTEXES"));
+
+	if ((env = getenv("CB2_LOCKSTAT")) &&
+	    lockstat_dump_every(atoi(env), stderr) == -1) {
+		fprintf(stderr, "CB2_LOCKSTAT: no statistics to print\n");
+	}
+	if ((env = getenv("CB2_LOTTERY"))) {
+		parse_lottery(env);
+	}
+	if ((env = getenv("CB2_TRACE")) && trace_open_spec(env) == -1) {
+		perror("CB2_TRACE");
+	}
+
+	if (pthread_atfork(NULL, NULL, preload_forked) != 0) {
+		errExit("Could not register the fork handler");
+	}
+
+	/* Last, anybody who sees it set sees the rest too */
+	__atomic_store_n(&ops, protocols[proto], __ATOMIC_RELEASE);
+	inside--;
+}
+
+__attribute__((constructor)) static void preload_init(void)
+{
+	pthread_once(&setup_once, preload_setup);
+}
+
+static inline struct preload_slot *slot_of(struct preload_table *t,
+		void *key, unsigned int i)
+{
+	/* Fibonacci hashing, mutexes are at least 8 bytes apart */
+	return &t->slots[((uint32_t)((uintptr_t)key >> 3) * 2654435769u + i) %
+		PRELOAD_SLOTS];
+}
+
+static inline void table_lock(struct preload_table *t)
+{
+	while (__atomic_exchange_n(&t->lock, 1, __ATOMIC_ACQUIRE)) {
+		sched_yield();
+	}
+}
+
+static inline void table_unlock(struct preload_table *t)
+{
+	__atomic_store_n(&t->lock, 0, __ATOMIC_RELEASE);
+}
+
+/* Slot of key, NULL if it has none */
+static struct preload_slot *slot_lookup(struct preload_table *t, void *key)
+{
+	struct preload_slot *s;
+	void *cur;
+	unsigned int i;
+
+	for (i = 0; i < PRELOAD_WINDOW; i++) {
+		s = slot_of(t, key, i);
+		cur = __atomic_load_n(&s->key, __ATOMIC_ACQUIRE);
+
+		if (cur == key) {
+			return s;
+		}
+		if (cur == NULL) {
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/* Under the table lock: a free slot of key's window, reported once if
+ * there is none */
+static struct preload_slot *slot_claim(struct preload_table *t, void *key)
+{
+	struct preload_slot *s;
+	unsigned int i;
+
+	for (i = 0; i < PRELOAD_WINDOW; i++) {
+		s = slot_of(t, key, i);
+
+		if (s->key == NULL || s->key == PRELOAD_TOMBSTONE) {
+			/* Anybody who sees the key sees no stale instance */
+			__atomic_store_n(&s->inst, NULL, __ATOMIC_RELAXED);
+			__atomic_store_n(&s->key, key, __ATOMIC_RELEASE);
+			return s;
+		}
+	}
+
+	if (!t->full) {
+		t->full = 1;
+		fprintf(stderr, "CB2: no room for %s %p, it and others like it "
+			"are left to glibc\n", t->what, key);
+	}
+
+	return NULL;
+}
+
+/* Instance that stands for key, made by make() if key is new and make is
+ * not NULL. NULL if key has none and the window of key is full. */
+static void *slot_find(struct preload_table *t, void *key,
+		void *(*make)(void))
+{
+	struct preload_slot *s;
+	void *inst;
+
+	if (!(s = slot_lookup(t, key))) {
+		if (!make) {
+			return NULL;
+		}
+
+		table_lock(t);
+		if (!(s = slot_lookup(t, key)) && (s = slot_claim(t, key))) {
+			inst = make();
+			__atomic_store_n(&s->inst, inst, __ATOMIC_RELEASE);
+			table_unlock(t);
+			return inst;
+		}
+		table_unlock(t);
+
+		if (!s) {
+			return NULL;
+		}
+	}
+
+	/* Whoever claimed it may not be done making it */
+	while (!(inst = __atomic_load_n(&s->inst, __ATOMIC_ACQUIRE))) {
+		cpu_relax();
+	}
+	return inst;
+}
+
+/* Take key out of the table. Returns its instance, NULL if it had none. */
+static void *slot_remove(struct preload_table *t, void *key)
+{
+	struct preload_slot *s;
+	void *inst = NULL;
+
+	table_lock(t);
+	if ((s = slot_lookup(t, key))) {
+		inst = s->inst;
+		__atomic_store_n(&s->key, PRELOAD_TOMBSTONE, __ATOMIC_RELEASE);
+	}
+	table_unlock(t);
+
+	return inst;
+}
+
+static void *make_lock(void)
+{
+	cb2_lock_t *l = aligned_alloc(CACHE_LINE_SIZE, sizeof(*l));
+
+	if (!l) {
+		errExit("Could not allocate a lock for a mutex");
+	}
+
+	memset(l, 0, sizeof(*l));
+	cb2_lock_init(l, ops, &lock_attr);
+	return l;
+}
+
+static void *make_cond(void)
+{
+	struct preload_cond *c = malloc(sizeof(*c));
+
+	if (!c) {
+		errExit("Could not allocate a condition variable");
+	}
+
+	cb2_cond_init(&c->cond);
+	c->clock = CLOCK_REALTIME;
+	return c;
+}
+
+/* Only plain mutexes are ours. __kind is glibc's, the low byte holds the
+ * type plus the robust, PI, ceiling and process-shared bits. */
+static int mutex_wanted(pthread_mutex_t *m)
+{
+	int kind = m->__data.__kind & 0xff, i;
+
+	if (kind != PTHREAD_MUTEX_TIMED_NP && kind != PTHREAD_MUTEX_ADAPTIVE_NP) {
+		return 0;
+	}
+
+	if (nranges < 0) {
+		return 1;
+	}
+
+	for (i = 0; i < nranges; i++) {
+		if ((uintptr_t)m >= ranges[i].from && (uintptr_t)m <= ranges[i].to) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* Lock standing for m, or NULL if glibc should handle it. Only unlock passes
+ * make = 0: a mutex nobody locked through us is not ours to release. */
+static cb2_lock_t *lock_of(pthread_mutex_t *m, int make)
+{
+	if (inside) {
+		return NULL;
+	}
+
+	pthread_once(&setup_once, preload_setup);
+
+	if (!__atomic_load_n(&ops, __ATOMIC_ACQUIRE) || !mutex_wanted(m)) {
+		return NULL;
+	}
+
+	return slot_find(&mutexes, m, make ? make_lock : NULL);
+}
+
+/* CLOCK_REALTIME deadline onto CLOCK_MONOTONIC, which is what our locks use */
+static struct timespec to_monotonic(clockid_t clock,
+		const struct timespec *abstime)
+{
+	struct timespec ts = *abstime;
+	long long t;
+
+	if (clock == CLOCK_MONOTONIC) {
+		return ts;
+	}
+
+	clock_gettime(clock, &ts);
+	t = abstime->tv_sec * 1000000000LL + abstime->tv_nsec -
+		(ts.tv_sec * 1000000000LL + ts.tv_nsec) + now_ns();
+
+	/* Long gone, maybe from before we booted */
+	if (t < 0) {
+		t = 0;
+	}
+	ts.tv_sec = t / 1000000000LL;
+	ts.tv_nsec = t % 1000000000LL;
+	return ts;
+}
+
+static int timedlock(cb2_lock_t *l, clockid_t clock,
+		const struct timespec *abstime)
+{
+	struct timespec deadline, poll = { 0, PRELOAD_POLL_NS };
+	int rc;
+
+	if (abstime->tv_nsec < 0 || abstime->tv_nsec >= 1000000000L) {
+		return EINVAL;
+	}
+
+	deadline = to_monotonic(clock, abstime);
+
+	inside++;
+	if (l->ops->timedlock) {
+		rc = l->ops->timedlock(l, &deadline);
+	} else {
+		while ((rc = l->ops->trylock(l)) == EBUSY &&
+		       now_ns() < deadline.tv_sec * 1000000000LL + deadline.tv_nsec) {
+			nanosleep(&poll, NULL);
+		}
+		rc = (rc == EBUSY) ? ETIMEDOUT : rc;
+	}
+	inside--;
+
+	return rc;
+}
+
+/* ---------------------------- mutexes ----------------------------------- */
+
+int pthread_mutex_lock(pthread_mutex_t *m)
+{
+	cb2_lock_t *l = lock_of(m, 1);
+
+	if (!l) {
+		return real_mutex_lock(m);
+	}
+
+	inside++;
+	cb2_lock_acquire(l);
+	inside--;
+	return 0;
+}
+
+int pthread_mutex_trylock(pthread_mutex_t *m)
+{
+	cb2_lock_t *l = lock_of(m, 1);
+	int rc;
+
+	if (!l) {
+		return real_mutex_trylock(m);
+	}
+
+	inside++;
+	rc = l->ops->trylock(l);
+	inside--;
+	return rc;
+}
+
+int pthread_mutex_timedlock(pthread_mutex_t *m, const struct timespec *abstime)
+{
+	cb2_lock_t *l = lock_of(m, 1);
+
+	if (!l) {
+		return real_mutex_timedlock(m, abstime);
+	}
+
+	return timedlock(l, CLOCK_REALTIME, abstime);
+}
+
+int pthread_mutex_clocklock(pthread_mutex_t *m, clockid_t clock,
+		const struct timespec *abstime)
+{
+	cb2_lock_t *l = lock_of(m, 1);
+
+	if (!l) {
+		return real_mutex_clocklock(m, clock, abstime);
+	}
+
+	return timedlock(l, clock, abstime);
+}
+
+int pthread_mutex_unlock(pthread_mutex_t *m)
+{
+	cb2_lock_t *l = lock_of(m, 0);
+
+	if (!l) {
+		return real_mutex_unlock(m);
+	}
+
+	inside++;
+	cb2_lock_release(l);
+	inside--;
+	return 0;
+}
+
+int pthread_mutex_destroy(pthread_mutex_t *m)
+{
+	cb2_lock_t *l;
+
+	pthread_once(&setup_once, preload_setup);
+
+	if (inside) {
+		return real_mutex_destroy(m);
+	}
+
+	/* The lock may only go once nobody holds it */
+	if ((l = slot_find(&mutexes, m, NULL)) && l->ops->owner &&
+	    l->ops->owner(l)) {
+		return EBUSY;
+	}
+
+	if ((l = slot_remove(&mutexes, m))) {
+		inside++;
+		cb2_lock_destroy(l);
+		free(l);
+		inside--;
+	}
+
+	return real_mutex_destroy(m);
+}
+
+/* ----------------------- condition variables ---------------------------- */
+
+/* The clock is the only thing we need from the attributes */
+int pthread_cond_init(pthread_cond_t *c, const pthread_condattr_t *attr)
+{
+	struct preload_cond *pc;
+	clockid_t clock = CLOCK_REALTIME;
+	int rc;
+
+	pthread_once(&setup_once, preload_setup);
+
+	if ((rc = real_cond_init(c, attr)) != 0 || inside) {
+		return rc;
+	}
+
+	if (attr) {
+		pthread_condattr_getclock(attr, &clock);
+	}
+
+	/* Conditions on the default clock get made when first waited on */
+	inside++;
+	pc = slot_find(&conds, c, (clock != CLOCK_REALTIME) ? make_cond : NULL);
+	if (pc) {
+		pc->clock = clock;
+	}
+	inside--;
+
+	return 0;
+}
+
+static int cond_wait(pthread_cond_t *c, cb2_lock_t *l, clockid_t clock,
+		const struct timespec *abstime)
+{
+	struct preload_cond *pc;
+	struct timespec deadline;
+	int rc = 0;
+
+	inside++;
+
+	if (!(pc = slot_find(&conds, c, make_cond))) {
+		/* No room left, a spurious wakeup is the best we can do */
+		cb2_lock_release(l);
+		sched_yield();
+		cb2_lock_acquire(l);
+	} else if (!abstime) {
+		cb2_cond_wait(&pc->cond, l);
+	} else {
+		deadline = to_monotonic((clock == (clockid_t)-1) ? pc->clock :
+			clock, abstime);
+		rc = cb2_cond_timedwait(&pc->cond, l, &deadline);
+	}
+
+	inside--;
+	return rc;
+}
+
+int pthread_cond_wait(pthread_cond_t *c, pthread_mutex_t *m)
+{
+	cb2_lock_t *l = lock_of(m, 0);
+
+	if (!l) {
+		return real_cond_wait(c, m);
+	}
+
+	return cond_wait(c, l, -1, NULL);
+}
+
+int pthread_cond_timedwait(pthread_cond_t *c, pthread_mutex_t *m,
+		const struct timespec *abstime)
+{
+	cb2_lock_t *l = lock_of(m, 0);
+
+	if (!l) {
+		return real_cond_timedwait(c, m, abstime);
+	}
+
+	return cond_wait(c, l, -1, abstime);
+}
+
+int pthread_cond_clockwait(pthread_cond_t *c, pthread_mutex_t *m,
+		clockid_t clock, const struct timespec *abstime)
+{
+	cb2_lock_t *l = lock_of(m, 0);
+
+	if (!l) {
+		return real_cond_clockwait(c, m, clock, abstime);
+	}
+
+	return cond_wait(c, l, clock, abstime);
+}
+
+/* A condition is only ours once somebody waited on it with one of our
+ * mutexes. Waiters of glibc's get the signal too, which at worst is a
+ * spurious wakeup. */
+int pthread_cond_signal(pthread_cond_t *c)
+{
+	struct preload_cond *pc;
+
+	pthread_once(&setup_once, preload_setup);
+
+	if (!inside && (pc = slot_find(&conds, c, NULL))) {
+		inside++;
+		cb2_cond_signal(&pc->cond);
+		inside--;
+	}
+
+	return real_cond_signal(c);
+}
+
+int pthread_cond_broadcast(pthread_cond_t *c)
+{
+	struct preload_cond *pc;
+
+	pthread_once(&setup_once, preload_setup);
+
+	if (!inside && (pc = slot_find(&conds, c, NULL))) {
+		inside++;
+		cb2_cond_broadcast(&pc->cond);
+		inside--;
+	}
+
+	return real_cond_broadcast(c);
+}
+
+int pthread_cond_destroy(pthread_cond_t *c)
+{
+	struct preload_cond *pc;
+
+	pthread_once(&setup_once, preload_setup);
+
+	if (!inside && (pc = slot_remove(&conds, c))) {
+		inside++;
+		cb2_cond_destroy(&pc->cond);
+		free(pc);
+		inside--;
+	}
+
+	return real_cond_destroy(c);
+}
@@ -0,0 +1,411 @@
+#include "runtime_lock.h"
+#include "util.h"
+#include "prio.h"
+#include "futex.h"
+
+#define SLOT_EMPTY 0
+#define SLOT_TOMBSTONE (-1)
+
+/* Taken by a thread that is still filling it in */
+#define SLOT_CLAIMED (-2)
+
+/* One slot per thread, each on its own cache line so that a thread
+ * publishing its priority does not disturb its neighbours. */
+struct prio_slot {
+	pid_t tid;
+	int nice;
+
+	/* Serializes the syscalls that change this thread's priority, so the
+	 * cached value is always the last one the kernel got */
+	int busy;
+
+	/* Deferred prio_restore(), applied by the reaper after deadline */
+	int pending;
+	int pending_nice;
+	long long deadline;
+
+	/* Lock the thread sleeps on, see prio_blocked_on() */
+	void *blocked_on;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static struct prio_slot registry[PRIO_REGISTRY_SLOTS];
+
+/* Number of deferred restores, the reaper sleeps on it while it's 0 */
+static int pending_count = 0;
+static pthread_once_t reaper_once = PTHREAD_ONCE_INIT;
+
+__thread unsigned long prio_syscalls_self = 0;
+
+static __thread struct prio_slot *my_slot = NULL;
+static __thread int my_slot_failed = 0;
+
+static pthread_key_t slot_key;
+static pthread_once_t slot_key_once = PTHREAD_ONCE_INIT;
+
+static inline void slot_lock(struct prio_slot *slot)
+{
+	while (__atomic_exchange_n(&slot->busy, 1, __ATOMIC_ACQUIRE)) {
+		cpu_relax();
+	}
+}
+
+static inline void slot_unlock(struct prio_slot *slot)
+{
+	__atomic_store_n(&slot->busy, 0, __ATOMIC_RELEASE);
+}
+
+/* Called with the slot locked */
+static inline void cancel_pending(struct prio_slot *slot)
+{
+	if (slot->pending) {
+		slot->pending = 0;
+		__atomic_sub_fetch(&pending_count, 1, __ATOMIC_RELAXED);
+	}
+}
+
+static void release_slot(void *s)
+{
+	struct prio_slot *slot = (struct prio_slot *)s;
+
+	slot_lock(slot);
+	cancel_pending(slot);
+	slot_unlock(slot);
+
+	__atomic_store_n(&slot->tid, SLOT_TOMBSTONE, __ATOMIC_RELEASE);
+}
+
+static void make_slot_key(void)
+{
+	if (pthread_key_create(&slot_key, release_slot) != 0) {
+		errExit("failed to create the priority registry key");
+	}
+}
+
+static int read_nice(pid_t tid)
+{
+	int nice;
+
+	errno = 0;
+	nice = getpriority(PRIO_PROCESS, tid);
+
+	if (nice == -1 && errno) {
+		errExit("Error getting the thread priority");
+	}
+
+	return nice;
+}
+
+/* Only the thread itself inserts its TID, and it does it once, so lookups
+ * can stop at the first empty slot and skip over tombstones. */
+static struct prio_slot *lookup(pid_t tid)
+{
+	unsigned int i, h = (unsigned int)tid % PRIO_REGISTRY_SLOTS;
+	pid_t cur;
+
+	for (i = 0; i < PRIO_REGISTRY_SLOTS; i++) {
+		struct prio_slot *slot = &registry[(h + i) % PRIO_REGISTRY_SLOTS];
+
+		cur = __atomic_load_n(&slot->tid, __ATOMIC_ACQUIRE);
+		if (cur == tid) {
+			return slot;
+		}
+		if (cur == SLOT_EMPTY) {
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+static struct prio_slot *register_self(void)
+{
+	pid_t me = self_tid();
+	unsigned int i, h = (unsigned int)me % PRIO_REGISTRY_SLOTS;
+
+	pthread_once(&slot_key_once, make_slot_key);
+
+	for (i = 0; i < PRIO_REGISTRY_SLOTS; i++) {
+		struct prio_slot *slot = &registry[(h + i) % PRIO_REGISTRY_SLOTS];
+		pid_t cur = __atomic_load_n(&slot->tid, __ATOMIC_RELAXED);
+
+		if (cur != SLOT_EMPTY && cur != SLOT_TOMBSTONE) {
+			continue;
+		}
+
+		/* Claim the slot before touching it, losers leave it alone */
+		if (!__atomic_compare_exchange_n(&slot->tid, &cur, SLOT_CLAIMED, 0,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			continue;
+		}
+
+		/* Whoever still holds the old thread's slot lets go first */
+		slot_lock(slot);
+		cancel_pending(slot);
+		slot->nice = read_nice(me);
+		slot->blocked_on = NULL;
+		slot_unlock(slot);
+
+		/* The values are there before the TID makes the slot visible */
+		__atomic_store_n(&slot->tid, me, __ATOMIC_RELEASE);
+		pthread_setspecific(slot_key, slot);
+		return slot;
+	}
+
+	LOG_DEBUG("priority registry full, %d uses syscalls\n", me);
+	my_slot_failed = 1;
+	return NULL;
+}
+
+static inline struct prio_slot *self_slot(void)
+{
+	if (__builtin_expect(!my_slot && !my_slot_failed, 0)) {
+		my_slot = register_self();
+	}
+	return my_slot;
+}
+
+int prio_self(void)
+{
+	struct prio_slot *slot = self_slot();
+
+	if (!slot) {
+		return read_nice(self_tid());
+	}
+
+	return __atomic_load_n(&slot->nice, __ATOMIC_RELAXED);
+}
+
+int prio_of(pid_t tid)
+{
+	struct prio_slot *slot;
+
+	if (tid == self_tid()) {
+		return prio_self();
+	}
+
+	if (!(slot = lookup(tid))) {
+		return read_nice(tid);
+	}
+
+	return __atomic_load_n(&slot->nice, __ATOMIC_RELAXED);
+}
+
+int prio_base_self(void)
+{
+	struct prio_slot *slot = self_slot();
+	int nice;
+
+	if (!slot) {
+		return read_nice(self_tid());
+	}
+
+	slot_lock(slot);
+	nice = slot->pending ? slot->pending_nice : slot->nice;
+	slot_unlock(slot);
+
+	return nice;
+}
+
+int prio_base_of(pid_t tid)
+{
+	struct prio_slot *slot;
+	int nice;
+
+	if (tid == self_tid()) {
+		return prio_base_self();
+	}
+
+	if (!(slot = lookup(tid))) {
+		return read_nice(tid);
+	}
+
+	slot_lock(slot);
+	nice = slot->pending ? slot->pending_nice : slot->nice;
+	slot_unlock(slot);
+
+	return nice;
+}
+
+int prio_set(pid_t tid, int nice)
+{
+	struct prio_slot *slot = (tid == self_tid()) ? self_slot() : lookup(tid);
+	int rc = 0;
+
+	/* Same clamping the kernel does, so the cache never lies */
+	nice = (nice < -20) ? -20 : (nice > 19) ? 19 : nice;
+
+	if (!slot) {
+		goto uncached;
+	}
+
+	if (!__atomic_load_n(&slot->pending, __ATOMIC_RELAXED) &&
+	    __atomic_load_n(&slot->nice, __ATOMIC_RELAXED) == nice &&
+	    __atomic_load_n(&slot->tid, __ATOMIC_RELAXED) == tid) {
+		return 0;
+	}
+
+	slot_lock(slot);
+
+	/* tid may have exited, and its slot gone to another thread, since we
+	 * looked it up */
+	if (slot->tid != tid) {
+		slot_unlock(slot);
+		goto uncached;
+	}
+
+	/* An explicit value overrides any deferred restore */
+	cancel_pending(slot);
+
+	if (slot->nice != nice) {
+		prio_syscalls_self++;
+		if ((rc = setpriority(PRIO_PROCESS, tid, nice)) == 0) {
+			__atomic_store_n(&slot->nice, nice, __ATOMIC_RELAXED);
+		}
+	}
+
+	slot_unlock(slot);
+
+	return rc;
+
+uncached:
+	prio_syscalls_self++;
+	return setpriority(PRIO_PROCESS, tid, nice);
+}
+
+/* Applies the deferred restores that are due, and sleeps until the next
+ * one. Started the first time a restore is deferred. */
+static void *reaper(__attribute__((unused)) void *arg)
+{
+	long long now, next;
+	int i, count;
+
+	for (;;) {
+		count = __atomic_load_n(&pending_count, __ATOMIC_RELAXED);
+		if (count == 0) {
+			futex_wait(&pending_count, 0, NULL);
+			continue;
+		}
+
+		now = now_ns();
+		next = now + PRIO_REAPER_MAX_SLEEP_NS;
+
+		for (i = 0; i < PRIO_REGISTRY_SLOTS; i++) {
+			struct prio_slot *slot = &registry[i];
+			pid_t tid = __atomic_load_n(&slot->tid, __ATOMIC_ACQUIRE);
+
+			if (tid <= 0 || !__atomic_load_n(&slot->pending,
+					__ATOMIC_RELAXED)) {
+				continue;
+			}
+
+			slot_lock(slot);
+			if (slot->pending && slot->tid == tid) {
+				if (slot->deadline <= now) {
+					cancel_pending(slot);
+					if (slot->nice != slot->pending_nice &&
+					    setpriority(PRIO_PROCESS, tid,
+							slot->pending_nice) == 0) {
+						__atomic_store_n(&slot->nice,
+							slot->pending_nice, __ATOMIC_RELAXED);
+					}
+				}
+				else if (slot->deadline < next) {
+					next = slot->deadline;
+				}
+			}
+			slot_unlock(slot);
+		}
+
+		if (__atomic_load_n(&pending_count, __ATOMIC_RELAXED)) {
+			struct timespec ts = {
+				(next - now) / 1000000000LL, (next - now) % 1000000000LL
+			};
+			nanosleep(&ts, NULL);
+		}
+	}
+
+	return NULL;
+}
+
+static void start_reaper(void)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	if (pthread_create(&thread, &attr, reaper, NULL) != 0) {
+		errExit("Could not create the priority reaper");
+	}
+
+	pthread_attr_destroy(&attr);
+}
+
+int prio_restore(int nice, long long delay_ns)
+{
+	struct prio_slot *slot = self_slot();
+
+	nice = (nice < -20) ? -20 : (nice > 19) ? 19 : nice;
+
+	/* Only giving back a boost can wait. Anything else is done now. */
+	if (!slot || delay_ns <= 0 ||
+	    nice <= __atomic_load_n(&slot->nice, __ATOMIC_RELAXED)) {
+		return prio_set(self_tid(), nice);
+	}
+
+	pthread_once(&reaper_once, start_reaper);
+
+	slot_lock(slot);
+	slot->pending_nice = nice;
+	slot->deadline = now_ns() + delay_ns;
+	if (!slot->pending) {
+		slot->pending = 1;
+		if (__atomic_add_fetch(&pending_count, 1, __ATOMIC_RELAXED) == 1) {
+			futex_wake(&pending_count, 1);
+		}
+	}
+	slot_unlock(slot);
+
+	return 0;
+}
+
+void prio_forked(void)
+{
+	int i;
+
+	/* The other threads are gone, and may have left their slot locked */
+	for (i = 0; i < PRIO_REGISTRY_SLOTS; i++) {
+		registry[i].tid = SLOT_EMPTY;
+		registry[i].busy = 0;
+		registry[i].pending = 0;
+		registry[i].blocked_on = NULL;
+	}
+
+	/* The reaper too */
+	pending_count = 0;
+	reaper_once = (pthread_once_t)PTHREAD_ONCE_INIT;
+
+	/* We get a slot again, under our new TID, the next time we need it */
+	if (my_slot) {
+		pthread_setspecific(slot_key, NULL);
+	}
+	my_slot = NULL;
+	my_slot_failed = 0;
+}
+
+void prio_blocked_on(void *lock)
+{
+	struct prio_slot *slot = self_slot();
+
+	if (slot) {
+		__atomic_store_n(&slot->blocked_on, lock, __ATOMIC_RELEASE);
+	}
+}
+
+void *prio_blocked_of(pid_t tid)
+{
+	struct prio_slot *slot = lookup(tid);
+
+	return slot ? __atomic_load_n(&slot->blocked_on, __ATOMIC_ACQUIRE) : NULL;
+}
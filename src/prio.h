@@ -0,0 +1,72 @@
+#ifndef __PRIO_H_
+#define __PRIO_H_
+
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+	Per-thread priority registry. Every thread that goes through a lock
+	publishes its nice value in a slot of a table shared by the process,
+	so owners and waiters can read each other's priority with a load
+	instead of a getpriority() syscall. Setting a priority only reaches
+	the kernel when the value actually changes.
+
+	A thread's slot is created the first time it asks for its own
+	priority and released when the thread exits. Threads without a slot
+	(or when the table is full) fall back to the syscalls.
+
+	The registry only knows about changes that go through prio_set(), so
+	code that uses locks from this directory should not call
+	setpriority() directly.
+*/
+
+#define PRIO_REGISTRY_SLOTS 1024
+
+/* Longest the reaper of deferred restores sleeps between scans */
+#define PRIO_REAPER_MAX_SLEEP_NS 10000000LL
+
+/* Priority syscalls (setpriority(), sched_setscheduler(), sched_setattr())
+ * the calling thread made so far, here and in boost.c. Calls the cache
+ * saved are not counted. */
+extern __thread unsigned long prio_syscalls_self;
+
+/* Nice value of the calling thread */
+int prio_self(void);
+
+/* Nice value of any thread of this process */
+int prio_of(pid_t tid);
+
+/* Nice value the thread goes back to once its deferred restore (if any)
+ * is applied. This is what a lock should save as "original" priority. */
+int prio_base_self(void);
+int prio_base_of(pid_t tid);
+
+/* Set the nice value of tid, skipping the syscall if it's already there.
+ * Cancels a deferred restore of tid. Returns -1 and sets errno like
+ * setpriority() on failure. */
+int prio_set(pid_t tid, int nice);
+
+/* Give back a boost of the calling thread, but only after delay_ns: if the
+ * thread gets boosted again before that, both syscalls are saved. A
+ * background reaper applies the restore when it's due. Restores that are
+ * not an unboost, or with no delay, are applied right away. */
+int prio_restore(int nice, long long delay_ns);
+
+/* In the child of a fork(), before it takes any lock: forget every thread
+ * but the caller, which shows up again under its new TID */
+void prio_forked(void);
+
+/* The registry also tells which lock a thread is blocked on, so a waiter
+ * can follow a chain of blocked owners (see chain.h). NULL once it got the
+ * lock, and for threads without a slot. */
+void prio_blocked_on(void *lock);
+void *prio_blocked_of(pid_t tid);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,52 +1,51 @@
 #include "runtime_lock.h"
 #include "util.h"
+#include "prio.h"
+#include "boost.h"
+#include "held.h"
 
-static pthread_mutex_t lock;
-static volatile int ceiling = 0;
-static __thread int original_priority = 0;
-
-static void _lock(void)
+static void _lock(cb2_lock_t *l)
 {
-	pid_t me = gettid();
-
-	original_priority = getpriority(PRIO_PROCESS, me);
-	if (original_priority == -1) {
-		errExit("Error getting the thread priority");
-	}
+	pid_t me = self_tid();
 
-	pthread_mutex_lock(&lock);
+	pthread_mutex_lock(&l->lock);
+	held_push(l);
 
-	/* Raise priority to ceiling */
-	if (setpriority(PRIO_PROCESS, me, ceiling) == -1) {
+	/* Raise priority to ceiling, unless another lock we hold lends us
+	 * more already. The ceiling is what this lock lends us. */
+	if (l->ceiling < held_lent() && l->boost->boost(me, l->ceiling) == -1) {
 		errExit("Error setting the thread priority");
 	}
+	l->boosted_to = l->ceiling;
 }
 
-static void _unlock(void)
+static void _unlock(cb2_lock_t *l)
 {
-	pid_t me = gettid();
-
-	pthread_mutex_unlock(&lock);
+	l->boosted_to = BOOST_NONE;
+	pthread_mutex_unlock(&l->lock);
 
-	/* Return to original priority */
-	if (setpriority(PRIO_PROCESS, me, original_priority) == -1) {
+	/* Back to the best of what the other locks we hold lend us, or to
+	 * our original priority */
+	if (held_release(l, l->boost, 0) == -1) {
 		errExit("Error setting the thread priority");
 	}
 }
 
-static void _init(runtime_lock_attr *attr)
+static void _init(cb2_lock_t *l, runtime_lock_attr *attr)
  {
-	pthread_mutex_init(&lock, NULL);
+	pthread_mutex_init(&l->lock, NULL);
 
 	if (!attr) {
 		errExit("protect lock needs attr");
 	}
 
-	ceiling = attr->ceiling;
+	l->ceiling = attr->ceiling;
+	l->boost = attr->boost ? attr->boost : &nice_boost;
+	l->boosted_to = BOOST_NONE;
 }
 
-static void _destroy(void) {
-	pthread_mutex_destroy(&lock);
+static void _destroy(cb2_lock_t *l) {
+	pthread_mutex_destroy(&l->lock);
 }
 
 runtime_lock protect_lock = {
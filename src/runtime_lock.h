@@ -10,11 +10,25 @@
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sched.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 #define RT_NONE 0
 #define RT_INHERIT 1
 #define RT_PROTECT 2
 #define RT_CB2 3
+#define RT_PI_INHERIT 4
+#define RT_PI_PROTECT 5
+#define RT_CB2_QUEUE 6
+
+#define CACHE_LINE_SIZE 64
+
+struct _boost_backend;
+struct cb2q_node;
+struct lockstat;
 
 typedef struct _runtime_lock_attr {
 	union {
@@ -26,22 +40,149 @@ typedef struct _runtime_lock_attr {
 			int by_tickets_cpu;
 		};
 	};
+
+	/* CPUs on which a new owner drops itself to nice 19, which is how the
+	 * benchmark makes the lock holder a low-priority thread. NULL means
+	 * never. */
+	cpu_set_t *demote_cpus;
+
+	/* Boost hysteresis (CB2 and inherit). A waiter only boosts the owner
+	 * once it has been blocked for boost_delay_ns, and an owner keeps its
+	 * boost for unboost_delay_ns after unlocking. 0 means right away. */
+	long long boost_delay_ns;
+	long long unboost_delay_ns;
+
+	/* How the owner gets boosted, nice values if NULL (see boost.h) */
+	const struct _boost_backend *boost;
 } runtime_lock_attr;
 
+struct _runtime_lock;
+
+/*
+	This is the state of one lock instance. Every protocol keeps all of
+	its per-lock data in here, so a process can have as many independent
+	locks as it needs. It is aligned to a cache line so that two locks
+	never share one.
+*/
+typedef struct _cb2_lock {
+
+	const struct _runtime_lock *ops;
+
+	/* CB2: per-thread contention statistics (see lockstat.h). Read on
+	 * every acquisition, so it stays away from what waiters write. */
+	struct lockstat *stat;
+
+	pthread_mutex_t lock;
+	pthread_mutex_t meta_lock;
+
+	volatile pid_t owner_tid;
+	volatile int owner_priority;
+
+	/* CB2: owner TID | LOCK_WORD_WAITERS, or LOCK_WORD_FREE */
+	int word;
+
+	/* CB2: the owner's priority was changed and must be recomputed on
+	 * unlock (see held.h) */
+	int restore_pending;
+
+	/* CB2: CPU the owner acquired the lock on */
+	int owner_cpu;
+
+	/* CB2: waiters past the spin phase, and the adaptive spin budget */
+	int parked;
+	int spin_limit;
+
+	/* CB2: spinners by how far they are from the last owner (same LLC,
+	 * same node, remote), see cb2_spin() */
+	int cohort[3];
+
+	/* CB2 queue: waiters, and the spin lock that protects the list */
+	struct cb2q_node *queue_head;
+	struct cb2q_node *queue_tail;
+	int queue_lock;
+
+	cpu_set_t *demote_cpus;
+
+	long long boost_delay_ns;
+	long long unboost_delay_ns;
+
+	const struct _boost_backend *boost;
+	/* Priority the owner was boosted to, BOOST_NONE if it wasn't */
+	int boosted_to;
+
+	union {
+		/* protect lock */
+		int ceiling;
+
+		/* CB2 */
+		int bystander_tickets_cpu;
+	};
+
+} __attribute__((aligned(CACHE_LINE_SIZE))) cb2_lock_t;
+
+/* What a lock went through since it was set up, see the stats entry of
+ * runtime_lock. Times are in nanoseconds. */
+struct cb2_lock_stats {
+	unsigned long acquisitions;
+
+	/* Acquisitions that had to wait, and how many times the waiters went
+	 * around the slow path */
+	unsigned long contended;
+	unsigned long try_again;
+
+	/* Contended acquisitions that got the lock while spinning, the rest
+	 * slept on it this many times */
+	unsigned long spin_acquired;
+	unsigned long futex_waits;
+
+	/* Draws of cb2_lock_inversion() the owner won (and was boosted) and
+	 * lost */
+	unsigned long lottery_won;
+	unsigned long lottery_lost;
+
+	/* Owners boosted, and the priority syscalls the boosts, demotions and
+	 * restores made. Calls the priority cache saved are not counted, nor
+	 * the deferred restores the reaper applies later (see prio.h). */
+	unsigned long boosts;
+	unsigned long prio_syscalls;
+
+	unsigned long long hold_ns;
+	unsigned long long wait_ns;
+};
+
 /*
 	This is the struct with the functions that any lock we create
-	should implement.
+	should implement. All of them take the instance they work on.
 */
 typedef struct _runtime_lock {
 
 	int type;
 	char *description;
 
-	void (*lock)(void);
-	void (*unlock)(void);
+	void (*lock)(cb2_lock_t *l);
+	void (*unlock)(cb2_lock_t *l);
+
+	void (*init)(cb2_lock_t *l, runtime_lock_attr *attr);
+	void (*destroy)(cb2_lock_t *l);
+
+	/* Optional. TID of the owner, 0 if the lock is free */
+	pid_t (*owner)(cb2_lock_t *l);
+
+	/* Optional. Boost the owner of l up to prio on behalf of waiter, which
+	 * is blocked on a lock further down a chain of owners (see chain.h).
+	 * Returns 0 if the protocol decided not to, 1 otherwise. */
+	int (*boost_owner)(cb2_lock_t *l, int prio, pid_t waiter);
+
+	/* Optional. Take l only if that does not mean waiting: 0, or EBUSY */
+	int (*trylock)(cb2_lock_t *l);
 
-	void (*init)(runtime_lock_attr *attr);
-	void (*destroy)(void);
+	/* Optional. Give up waiting for l at abstime (CLOCK_MONOTONIC): 0, or
+	 * ETIMEDOUT */
+	int (*timedlock)(cb2_lock_t *l, const struct timespec *abstime);
+
+	/* Optional. Add up the statistics of l: 0, or -1 if they were compiled
+	 * out */
+	int (*stats)(cb2_lock_t *l, struct cb2_lock_stats *s);
 
 } runtime_lock;
 
@@ -49,5 +190,68 @@ extern struct _runtime_lock mutex_lock;
 extern struct _runtime_lock inherit_lock;
 extern struct _runtime_lock protect_lock;
 extern struct _runtime_lock CB2_lock;
+extern struct _runtime_lock pi_inherit_lock;
+extern struct _runtime_lock pi_protect_lock;
+extern struct _runtime_lock CB2_queue_lock;
+
+/* What the calling thread did while it waited for any lock: boosts it gave
+ * to owners, and CB2 draws it made that the owner won (and was boosted) or
+ * lost. Only the thread itself writes it, copy it out before it exits. The
+ * counts of each lock are in its stats (see lockstat.h), this is the view of
+ * one thread over all of them, the inherit protocol included. */
+struct cb2_thread_stats {
+	unsigned long boosts;
+	unsigned long lottery_won;
+	unsigned long lottery_lost;
+};
+
+extern __thread struct cb2_thread_stats cb2_self_stats;
+
+/* The CB2 draw (see cb2_lock.c), for the protocols built on top of it.
+ * Returns 1 if the low-priority side won and should be boosted. */
+int cb2_lottery(int bystander_tickets, int tickets_LP, pid_t HP_pid);
+
+/* Take a CB2 lock after sleeping on its word, see cb2_lock.c */
+void cb2_lock_woken(cb2_lock_t *l);
+
+/* A new owner on cpu drops itself to nice 19 (see demote_cpus) */
+static inline int cb2_lock_demotes(cb2_lock_t *l, int cpu)
+{
+	return l->demote_cpus && cpu >= 0 && cpu < CPU_SETSIZE &&
+		CPU_ISSET(cpu, l->demote_cpus);
+}
+
+/* Handle-based entry points. The instance remembers its protocol. */
+static inline void cb2_lock_init(cb2_lock_t *l, const runtime_lock *ops,
+		runtime_lock_attr *attr)
+{
+	ops->init(l, attr);
+	l->ops = ops;
+}
+
+static inline void cb2_lock_acquire(cb2_lock_t *l)
+{
+	l->ops->lock(l);
+}
+
+static inline void cb2_lock_release(cb2_lock_t *l)
+{
+	l->ops->unlock(l);
+}
+
+static inline void cb2_lock_destroy(cb2_lock_t *l)
+{
+	l->ops->destroy(l);
+}
+
+/* -1 if the protocol keeps no statistics */
+static inline int cb2_lock_get_stats(cb2_lock_t *l, struct cb2_lock_stats *s)
+{
+	return l->ops->stats ? l->ops->stats(l, s) : -1;
+}
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif
@@ -0,0 +1,126 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "samples.h"
+
+/* Two-sided 95% critical values of Student's t, for 1 to 30 degrees of
+ * freedom */
+static const double t_table[30] = {
+	12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+	2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+	2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+};
+
+static double t_critical(double df)
+{
+	if (df < 1) {
+		return t_table[0];
+	}
+
+	/* Welch gives fractional degrees, round them down to stay on the safe
+	 * side. Past the table, 1.96 + 2.5 / df is within 0.002. */
+	if (df <= 30) {
+		return t_table[(int)df - 1];
+	}
+	return 1.96 + 2.5 / df;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+double samples_percentile(const double *sorted, int n, double p)
+{
+	double pos = (n - 1) * p / 100;
+	int i = (int)pos;
+
+	if (n <= 0) {
+		return 0;
+	}
+	if (i + 1 >= n) {
+		return sorted[n - 1];
+	}
+
+	return sorted[i] + (pos - i) * (sorted[i + 1] - sorted[i]);
+}
+
+void samples_summarize(double *v, int n, struct samples_summary *s)
+{
+	double q1, q3, lo, hi, sum = 0, sq = 0;
+	int first = 0, last = n, i;
+
+	memset(s, 0, sizeof(*s));
+	if (n <= 0) {
+		return;
+	}
+
+	qsort(v, n, sizeof(*v), compare_doubles);
+
+	/* Sorted, so the outliers are at both ends */
+	if (n >= 4) {
+		q1 = samples_percentile(v, n, 25);
+		q3 = samples_percentile(v, n, 75);
+		lo = q1 - 1.5 * (q3 - q1);
+		hi = q3 + 1.5 * (q3 - q1);
+
+		while (v[first] < lo) {
+			first++;
+		}
+		while (v[last - 1] > hi) {
+			last--;
+		}
+	}
+
+	v += first;
+	s->n = last - first;
+	s->rejected = n - s->n;
+
+	s->median = samples_percentile(v, s->n, 50);
+	s->p5 = samples_percentile(v, s->n, 5);
+	s->p95 = samples_percentile(v, s->n, 95);
+
+	for (i = 0; i < s->n; i++) {
+		sum += v[i];
+	}
+	s->mean = sum / s->n;
+
+	for (i = 0; i < s->n; i++) {
+		sq += (v[i] - s->mean) * (v[i] - s->mean);
+	}
+	s->sd = (s->n > 1) ? sqrt(sq / (s->n - 1)) : 0;
+
+	s->ci_lo = s->ci_hi = s->mean;
+	if (s->n > 1) {
+		s->ci_lo -= t_critical(s->n - 1) * s->sd / sqrt(s->n);
+		s->ci_hi += t_critical(s->n - 1) * s->sd / sqrt(s->n);
+	}
+}
+
+int samples_differ(const struct samples_summary *a,
+		const struct samples_summary *b)
+{
+	double va, vb, se, df;
+
+	/* Nothing to tell the noise apart with */
+	if (a->n < 2 || b->n < 2) {
+		return 0;
+	}
+
+	va = a->sd * a->sd / a->n;
+	vb = b->sd * b->sd / b->n;
+	se = sqrt(va + vb);
+
+	if (se == 0) {
+		return a->mean != b->mean;
+	}
+
+	/* Welch-Satterthwaite */
+	df = (va + vb) * (va + vb) /
+		(va * va / (a->n - 1) + vb * vb / (b->n - 1));
+
+	return fabs(a->mean - b->mean) / se > t_critical(df);
+}
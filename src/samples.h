@@ -0,0 +1,37 @@
+#ifndef __SAMPLES_H_
+#define __SAMPLES_H_
+
+/*
+	Statistics over the repetitions of an experiment, for the sweeps of
+	test_prios. Outliers are dropped with Tukey's fences (beyond 1.5 times
+	the interquartile range), then the rest is summarized with the median,
+	percentiles and a 95% confidence interval of the mean. Two summaries
+	can be compared with Welch's t-test, so that a change is only called a
+	regression when it is unlikely to be noise.
+*/
+
+struct samples_summary {
+	/* Values kept, and outliers dropped */
+	int n;
+	int rejected;
+
+	double median, p5, p95;
+	double mean, sd;
+
+	/* 95% confidence interval of the mean */
+	double ci_lo, ci_hi;
+};
+
+/* Sorts v[] (n values) in place and summarizes it. Fences need at least
+ * four values, fewer are all kept. */
+void samples_summarize(double *v, int n, struct samples_summary *s);
+
+/* p-th percentile (0 to 100) of n sorted values, interpolated */
+double samples_percentile(const double *sorted, int n, double p);
+
+/* 1 if the means of a and b differ at the 95% level. Only the n, mean and
+ * sd of each are used, so either may come from a stored summary. */
+int samples_differ(const struct samples_summary *a,
+		const struct samples_summary *b);
+
+#endif
@@ -7,13 +7,21 @@
 # Authors: Christopher Blackburn, Carlos Bilbao (2020)                        #
 ###############################################################################
 */
+#include <math.h>
+
 #include "util.h"
 #include "runtime_lock.h"
+#include "prio.h"
+#include "lottery.h"
+#include "tickets.h"
+#include "boost.h"
+#include "cb2_rwlock.h"
+#include "samples.h"
+#include "hist.h"
+#include "trace.h"
 
 #define HIGHEST_PRIO  (-20)
 #define LOWEST_PRIO    (19)
-#define HIGH_PRIO_CPU  (1)
-#define LOW_PRIO_CPU   (0)
 
 #define BILLION 1000000000
 
@@ -25,6 +33,95 @@ static volatile int done = 0;
 
 /* Our lock, that will be of the type specified at runtime */
 runtime_lock *our_lock = NULL;
+static cb2_lock_t cs_lock;
+
+/* With -r the CB2 protocol runs as a reader-writer lock, and this share of
+ * the acquisitions (in percent) are reads */
+static cb2_rwlock_t cs_rwlock;
+static int read_pct = -1;
+
+/* Boost hysteresis for the protocols that boost the owner */
+static long long boost_delay_ns = 0;
+static long long unboost_delay_ns = 0;
+
+/* How the protocols boost a thread, see boost.h */
+static boost_backend *boost_backends[] = {
+	&nice_boost, &fifo_boost, &rr_boost, &uclamp_boost
+};
+static boost_backend *boost = &nice_boost;
+
+/* Generator of the lottery draws, see -g */
+static const lottery_engine *engine = &xorshift_engine;
+
+/* The kernel protocols only boost real-time threads */
+static int rt_threads = 0;
+
+/* Priorities of the high and low-priority threads. With -f everybody runs
+ * at the same one, which is the baseline Slowdown is measured against. */
+static int flat = 0;
+static int high_prio = HIGHEST_PRIO;
+static int low_prio = LOWEST_PRIO;
+
+/* How the results are printed, see -o */
+#define OUT_TEXT 0
+#define OUT_JSON 1
+#define OUT_CSV  2
+static int out_format = OUT_TEXT;
+
+/* What the threads are, for the Slowdown and Unfairness of each of them */
+#define ROLE_LP         0
+#define ROLE_HP         1
+#define ROLE_BYSTANDERS 2
+#define ROLES           3
+static const char *role_names[ROLES] = { "LP", "HP", "bystander" };
+
+/* CPU shares of the -S baseline */
+static const char *baseline = NULL;
+static double base_share[ROLES];
+
+/* What a sweep looks at on every run (see -P and friends). Times are in
+ * ms, the CPU shares in percent. */
+#define M_WALL       0
+#define M_HP_WAIT    1
+#define M_LP_WAIT    2
+#define M_HP_PCT     3
+#define M_BYS_PCT    4
+#define M_UNFAIRNESS 5
+#define M_HP_WAIT_P99    6
+#define M_HP_HANDOFF_P99 7
+#define METRICS      8
+static const struct {
+	const char *name;
+	/* A significant increase is a regression. The others only change. */
+	int lower_better;
+} metrics[METRICS] = {
+	{ "wall_ms", 1 }, { "hp_wait_ms", 1 }, { "lp_wait_ms", 1 },
+	{ "hp_cpu_pct", 0 }, { "bystander_cpu_pct", 0 }, { "unfairness", 1 },
+	{ "hp_wait_p99_us", 1 }, { "hp_handoff_p99_us", 1 }
+};
+
+/* When the lock was last released, for the unlock-to-acquire handoff */
+static volatile long long released_at = 0;
+
+/* Wait and handoff latencies of a role, over every run of a sweep point */
+struct role_tails {
+	struct hist wait;
+	struct hist handoff;
+};
+
+/* CPUs the threads run on: the ones we may use, or the first -c of them */
+static int cpus[CPU_SETSIZE];
+static int ncpu;
+
+/* Contenders of each class, see -L and -H. The LP ones take the even CPUs
+ * of cpus[] and the HP ones the odd CPUs, so the demotion of the owners on
+ * the LP CPUs never hits an HP thread. Threads 0 to n_lp - 1 are the LP
+ * contenders, the next n_hp the HP ones, and the rest bystanders. */
+static int n_lp = 1;
+static int n_hp = 1;
+
+/* Bystanders dealt round robin, as many on every CPU, instead of at random */
+static int spread = 0;
 
 /* Encapsulates per-thread test data */
 struct test_run {
@@ -38,6 +135,20 @@ struct test_run {
 	/* How many times to acquire the lock */
 	int iter;
 
+	/* Lottery tickets a bystander holds on its core */
+	int tickets;
+
+	/* Time spent waiting for the lock */
+	long long wait_ns;
+
+	/* Every wait, and the time from the release of the lock to us getting
+	 * it when it was released while we waited */
+	struct hist wait_hist;
+	struct hist handoff_hist;
+
+	/* Boosts and draws of this thread as a waiter */
+	struct cb2_thread_stats stats;
+
 	pid_t tid;
 };
 
@@ -65,11 +176,71 @@ void timeval_accumulate(struct timespec *total, struct timespec *toadd)
 	}
 }
 
-int compute_percentage(struct test_run *tr, long long int total)
+double compute_percentage(struct test_run *tr, long long int total)
 {
 	long long int part;
 	part = (tr->tp.tv_sec * BILLION) + tr->tp.tv_nsec;
-	return ((double)part / total) * 100;
+	return total ? ((double)part / total) * 100 : 0;
+}
+
+static int role_of(int id)
+{
+	return (id < n_lp) ? ROLE_LP : (id < n_lp + n_hp) ? ROLE_HP :
+		ROLE_BYSTANDERS;
+}
+
+/* CPU of the k-th contender of role, round robin over the CPUs of its class */
+static int contender_cpu(int role, int k)
+{
+	if (role == ROLE_LP) {
+		return cpus[2 * (k % ((ncpu + 1) / 2))];
+	}
+	return cpus[2 * (k % (ncpu / 2)) + 1];
+}
+
+/* Average CPU share of each role over the runs of a CSV written with -o csv,
+ * the bystanders added up. Returns the number of runs. */
+static int read_baseline(const char *path, double share[ROLES])
+{
+	char line[512], role[16];
+	double pct;
+	int runs = 0, thread, r;
+	FILE *f;
+
+	if (!(f = fopen(path, "r"))) {
+		errExit("Could not open the baseline");
+	}
+
+	memset(share, 0, ROLES * sizeof(*share));
+
+	while (fgets(line, sizeof(line), f)) {
+		/* protocol,boost,seed,thread,role,prio,cpu,cpu_ns,cpu_pct,... */
+		if (sscanf(line, "%*[^,],%*[^,],%*[^,],%d,%15[^,],%*[^,],"
+				"%*[^,],%*[^,],%lf", &thread, role, &pct) != 3) {
+			continue;
+		}
+
+		/* A run has one thread 0, but may have many LP contenders */
+		runs += (thread == 0);
+
+		for (r = 0; r < ROLES; r++) {
+			if (!strcmp(role, role_names[r])) {
+				share[r] += pct;
+			}
+		}
+	}
+
+	fclose(f);
+
+	if (!runs) {
+		errExit("No runs in the baseline");
+	}
+
+	for (r = 0; r < ROLES; r++) {
+		share[r] /= runs;
+	}
+
+	return runs;
 }
 
 void __security_check(void)
@@ -82,7 +253,22 @@ void __security_check(void)
 
 int init_lock(int lock_proto, int sum_bys)
 {
+	static cpu_set_t low_prio_cpus;
 	runtime_lock_attr attr;
+	int i;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.boost_delay_ns = boost_delay_ns;
+	attr.unboost_delay_ns = unboost_delay_ns;
+	attr.boost = boost;
+
+	/* The lock holder on the low priority CPUs drops to nice 19, unless
+	 * everybody has the same priority */
+	CPU_ZERO(&low_prio_cpus);
+	for (i = 0; i < n_lp; i++) {
+		CPU_SET(contender_cpu(ROLE_LP, i), &low_prio_cpus);
+	}
+	attr.demote_cpus = flat ? NULL : &low_prio_cpus;
 
 	switch (lock_proto) {
 	case RT_NONE:
@@ -95,10 +281,21 @@ int init_lock(int lock_proto, int sum_bys)
 		our_lock = &protect_lock;
 		attr.ceiling = HIGHEST_PRIO;
 		break;
+	case RT_PI_INHERIT:
+		our_lock = &pi_inherit_lock;
+		break;
+	case RT_PI_PROTECT:
+		our_lock = &pi_protect_lock;
+		attr.ceiling = HIGHEST_PRIO;
+		break;
 	case RT_CB2:
 		our_lock = &CB2_lock;
 		attr.by_tickets_cpu = sum_bys;
 		break;
+	case RT_CB2_QUEUE:
+		our_lock = &CB2_queue_lock;
+		attr.by_tickets_cpu = sum_bys;
+		break;
 	default:
 		/* unknown protocol */
 		return -1;
@@ -107,13 +304,54 @@ int init_lock(int lock_proto, int sum_bys)
 	/* Make sure we don't step into null pointers in the future ... */
 	__security_check();
 
-	our_lock->init(&attr);
+	if (read_pct >= 0) {
+		cb2_rwlock_init(&cs_rwlock, &attr);
+	} else {
+		cb2_lock_init(&cs_lock, our_lock, &attr);
+	}
 	
 	return 0;
 }
 
 /********************* the real code *******************/
 
+static void cs_acquire(int reading)
+{
+	if (read_pct < 0) {
+		cb2_lock_acquire(&cs_lock);
+	} else if (reading) {
+		cb2_rwlock_rdlock(&cs_rwlock);
+	} else {
+		cb2_rwlock_wrlock(&cs_rwlock);
+	}
+}
+
+static void cs_release(int reading)
+{
+	if (read_pct < 0) {
+		cb2_lock_release(&cs_lock);
+	} else if (reading) {
+		cb2_rwlock_rdunlock(&cs_rwlock);
+	} else {
+		cb2_rwlock_wrunlock(&cs_rwlock);
+	}
+}
+
+/* Priority of the calling thread. With real-time threads the nice value is
+ * mapped onto SCHED_FIFO, through pthread so that glibc's bookkeeping for
+ * PTHREAD_PRIO_PROTECT knows about it. */
+static int set_priority(int nice)
+{
+	struct sched_param param = { .sched_priority = rt_priority(nice) };
+
+	if (!rt_threads) {
+		return prio_set(self_tid(), nice);
+	}
+
+	errno = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+	return errno ? -1 : 0;
+}
+
 void bystander_stuff(struct test_run *tr, struct timespec *aux_time,
 		struct timespec *start, struct timespec *end)
 {
@@ -126,6 +364,7 @@ void bystander_stuff(struct test_run *tr, struct timespec *aux_time,
 		for (s = 0; s < 1000; s++) {
 			asm("");
 		}
+		tickets_migrated();
 
 		/* if the lowest has the lock, measure time and iterations. 
 		 * Otherwise, we stop counting */
@@ -147,17 +386,27 @@ void *thread_func(void *vargp)
 {
 	struct test_run *tr = (struct test_run*)vargp;
 	struct timespec start, end, aux_time;
-	int rc, s, m = 0, i;
+	int rc, s, m = 0, i, reading, role = role_of(tr->id);
+	long long wait_start, acquired, released;
 
 	/* Sanity init */
 	tr->tp.tv_sec = 0;
 	tr->tp.tv_nsec = 0;
+	tr->wait_ns = 0;
+	hist_init(&tr->wait_hist);
+	hist_init(&tr->handoff_hist);
 	tr->tid = gettid();
+	lottery_thread_stream(tr->id);
 
-	if (setpriority(PRIO_PROCESS, tr->tid, tr->priority) == -1 ){
+	if (set_priority(tr->priority) == -1 ){
 		errExit("Error setting the thread priority");
 	}
 
+	/* Bystanders make their share of the core known to the CB2 lottery */
+	if (tr->tickets && tickets_register(tr->tickets) == -1) {
+		errExit("Could not register the bystander tickets");
+	}
+
 	/* Wait for all threads before beginning next iteration */
 	rc = pthread_barrier_wait(&barrier);
 	
@@ -166,7 +415,7 @@ void *thread_func(void *vargp)
 	}
 
 	/* If this is a bystander thread... */
-	if (tr->id != HIGH_PRIO_CPU && tr->id != LOW_PRIO_CPU) {
+	if (role == ROLE_BYSTANDERS) {
 		LOG_DEBUG("Hi it's thread %d\n",tr->id);
 		bystander_stuff(tr, &aux_time, &start, &end);
 		goto out;
@@ -178,16 +427,36 @@ void *thread_func(void *vargp)
 
 		/* Measure how long this thread has the lock */
 		LOG_DEBUG("Trying to get lock, I am %d\n", tr->id);
-		our_lock->lock();
+		reading = read_pct > 0 && (int)lottery_bounded(100) < read_pct;
+		wait_start = now_ns();
+		cs_acquire(reading);
+		acquired = now_ns();
+		tr->wait_ns += acquired - wait_start;
+
+		hist_record(&tr->wait_hist, acquired - wait_start);
+
+		/* Readers share the lock, and release it while others hold it,
+		 * so only a writer's wait ends in a handoff */
+		released = released_at;
+		if (!reading && released > wait_start && acquired >= released) {
+			hist_record(&tr->handoff_hist, acquired - released);
+		}
 
 		LOG_DEBUG("I (%d) have acquired the lock\n", tr->id);
 
-		if (tr->id == 0 && done) {
-			our_lock->unlock();
+		/* The kernel locks and readers don't demote the owner themselves */
+		if ((rt_threads || reading) && role == ROLE_LP) {
+			if (set_priority(low_prio) == -1) {
+				errExit("Error setting the thread priority");
+			}
+		}
+
+		if (role == ROLE_LP && done) {
+			cs_release(reading);
 			break;
 		}
 
-		if (tr->id == LOW_PRIO_CPU) {
+		if (role == ROLE_LP) {
 			lowest_acquired = 1;
 		} else {
 			highest_acquired = 1;
@@ -204,8 +473,8 @@ void *thread_func(void *vargp)
 
 		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
 		
-		if (tr->id == LOW_PRIO_CPU) {
-			if (setpriority(PRIO_PROCESS, tr->tid, HIGHEST_PRIO) == -1) {
+		if (role == ROLE_LP && !reading) {
+			if (set_priority(high_prio) == -1) {
 				errExit("Error setting the thread priority");
 			}
 		}
@@ -214,10 +483,18 @@ void *thread_func(void *vargp)
 			done = 1;
 		}
 
-		our_lock->unlock();
+		released_at = now_ns();
+		cs_release(reading);
+
+		/* A boosted reader goes back to its priority on the way out */
+		if (role == ROLE_LP && reading) {
+			if (set_priority(high_prio) == -1) {
+				errExit("Error setting the thread priority");
+			}
+		}
 
 		/* Enforce ordering */
-		if (tr->id) {
+		if (role != ROLE_LP) {
 			lowest_acquired = 0;
 		} else {
 			highest_acquired = 0;
@@ -232,19 +509,214 @@ void *thread_func(void *vargp)
 	}
 
 out:
+	tr->stats = cb2_self_stats;
 	return (void*)tr;
 }
 
+/* Percentiles of the wait and handoff histograms, in every format */
+static void print_tail(const char *name, const struct hist *h)
+{
+	unsigned long long p50 = hist_percentile(h, 50);
+	unsigned long long p99 = hist_percentile(h, 99);
+	unsigned long long p999 = hist_percentile(h, 99.9);
+
+	if (out_format == OUT_JSON) {
+		printf(", \"%s_p50_ns\": %llu, \"%s_p99_ns\": %llu, "
+			"\"%s_p999_ns\": %llu, \"%s_max_ns\": %llu", name, p50, name,
+			p99, name, p999, name, h->max);
+	} else if (out_format == OUT_CSV) {
+		printf(",%llu,%llu,%llu,%llu", p50, p99, p999, h->max);
+	} else {
+		printf("  %-18s %8lu %10.1f %10.1f %10.1f %10.1f\n", name,
+			h->count, p50 / 1e3, p99 / 1e3, p999 / 1e3, h->max / 1e3);
+	}
+}
+
+/* What the threads pinned to one CPU did in a run */
+struct core_result {
+	int cpu;
+	int threads[ROLES];
+	double cpu_pct[ROLES];
+	long long wait_ns[ROLES];
+
+	/* Of the contenders here, as waiters */
+	unsigned long boosts, lottery_won, lottery_lost;
+};
+
+/* The threads of the run added up by CPU, one entry per CPU of cpus[] */
+static void per_core(struct test_run **trs, int thread_count, long long total,
+		struct core_result *cores)
+{
+	int i, c, r;
+
+	memset(cores, 0, ncpu * sizeof(*cores));
+	for (c = 0; c < ncpu; c++) {
+		cores[c].cpu = cpus[c];
+	}
+
+	for (i = 0; i < thread_count; i++) {
+		for (c = 0; c < ncpu - 1 && cpus[c] != trs[i]->pinning; c++);
+		r = role_of(i);
+
+		cores[c].threads[r]++;
+		cores[c].cpu_pct[r] += compute_percentage(trs[i], total);
+		cores[c].wait_ns[r] += trs[i]->wait_ns;
+		cores[c].boosts += trs[i]->stats.boosts;
+		cores[c].lottery_won += trs[i]->stats.lottery_won;
+		cores[c].lottery_lost += trs[i]->stats.lottery_lost;
+	}
+}
+
+/* A line per CPU with threads on it, or a JSON object for print_json() */
+static void print_cores(struct core_result *cores)
+{
+	struct core_result *c;
+	int i, last = 0;
+
+	for (i = 0; i < ncpu; i++) {
+		last = (cores[i].threads[ROLE_LP] || cores[i].threads[ROLE_HP] ||
+			cores[i].threads[ROLE_BYSTANDERS]) ? i : last;
+	}
+
+	if (out_format == OUT_TEXT) {
+		printf("CPU   LP  HP  bys  LP cpu%%  HP cpu%%  bys cpu%%  LP wait ms  "
+			"HP wait ms  boosts  lottery won/lost\n");
+	}
+
+	for (i = 0; i <= last; i++) {
+		c = &cores[i];
+		if (!c->threads[ROLE_LP] && !c->threads[ROLE_HP] &&
+		    !c->threads[ROLE_BYSTANDERS]) {
+			continue;
+		}
+
+		if (out_format == OUT_JSON) {
+			printf("  {\"cpu\": %d, \"lp\": %d, \"hp\": %d, "
+				"\"bystanders\": %d, \"lp_cpu_pct\": %.6f, "
+				"\"hp_cpu_pct\": %.6f, \"bystander_cpu_pct\": %.6f, "
+				"\"lp_wait_ns\": %lld, \"hp_wait_ns\": %lld, "
+				"\"boosts\": %lu, \"lottery_won\": %lu, "
+				"\"lottery_lost\": %lu}%s\n", c->cpu, c->threads[ROLE_LP],
+				c->threads[ROLE_HP], c->threads[ROLE_BYSTANDERS],
+				c->cpu_pct[ROLE_LP], c->cpu_pct[ROLE_HP],
+				c->cpu_pct[ROLE_BYSTANDERS], c->wait_ns[ROLE_LP],
+				c->wait_ns[ROLE_HP], c->boosts, c->lottery_won,
+				c->lottery_lost, (i < last) ? "," : "");
+		} else {
+			printf("%-4d %3d %3d %4d %8.2f %8.2f %9.2f %11.3f %11.3f %7lu "
+				"%7lu/%lu\n", c->cpu, c->threads[ROLE_LP],
+				c->threads[ROLE_HP], c->threads[ROLE_BYSTANDERS],
+				c->cpu_pct[ROLE_LP], c->cpu_pct[ROLE_HP],
+				c->cpu_pct[ROLE_BYSTANDERS], c->wait_ns[ROLE_LP] / 1e6,
+				c->wait_ns[ROLE_HP] / 1e6, c->boosts, c->lottery_won,
+				c->lottery_lost);
+		}
+	}
+}
+
+/* One object per run, with a record per thread */
+static void print_json(const char *lock_name, unsigned long long seed,
+		struct test_run **trs, int thread_count, long long total,
+		struct core_result *cores, double *slowdown, double unfairness)
+{
+	struct test_run *tr;
+	int i;
+
+	printf("{\"protocol\": \"%s\", \"boost\": \"%s\", \"seed\": %llu, "
+		"\"threads\": %d, \"iterations\": %d, \"threads_cpu_ns\": %lld,\n",
+		lock_name, boost->description, seed, thread_count,
+		trs[0]->iter, total);
+	printf(" \"records\": [\n");
+
+	for (i = 0; i < thread_count; i++) {
+		tr = trs[i];
+		printf("  {\"thread\": %d, \"role\": \"%s\", \"prio\": %d, "
+			"\"cpu\": %d, \"cpu_ns\": %lld, \"cpu_pct\": %.6f, "
+			"\"wait_ns\": %lld, \"iters\": %d, \"boosts\": %lu, "
+			"\"lottery_won\": %lu, \"lottery_lost\": %lu", i,
+			role_names[role_of(i)], (role_of(i) == ROLE_LP) ? low_prio : tr->priority,
+			tr->pinning, (long long)tr->tp.tv_sec * BILLION + tr->tp.tv_nsec,
+			compute_percentage(tr, total), tr->wait_ns, tr->iter,
+			tr->stats.boosts, tr->stats.lottery_won, tr->stats.lottery_lost);
+		print_tail("wait", &tr->wait_hist);
+		print_tail("handoff", &tr->handoff_hist);
+		printf("}%s\n", (i + 1 < thread_count) ? "," : "");
+	}
+
+	printf(" ],\n \"cores\": [\n");
+	print_cores(cores);
+	printf(" ]");
+	if (slowdown) {
+		printf(",\n \"slowdown\": {\"LP\": %.6f, \"HP\": %.6f, "
+			"\"bystander\": %.6f},\n \"unfairness\": ",
+			slowdown[ROLE_LP], slowdown[ROLE_HP],
+			slowdown[ROLE_BYSTANDERS]);
+		if (unfairness < 0) {
+			printf("null");
+		} else {
+			printf("%.6f", unfairness);
+		}
+	}
+	printf("}\n");
+}
+
+/* A row per thread, with the run in every row so that the output of many
+ * runs can be concatenated. Slowdown is the one of the thread's role. */
+static void print_csv(const char *lock_name, unsigned long long seed,
+		struct test_run **trs, int thread_count, long long total,
+		double *slowdown, double unfairness)
+{
+	struct test_run *tr;
+	int i;
+
+	printf("protocol,boost,seed,thread,role,prio,cpu,cpu_ns,cpu_pct,wait_ns,"
+		"iters,boosts,lottery_won,lottery_lost,slowdown,unfairness,"
+		"wait_p50_ns,wait_p99_ns,wait_p999_ns,wait_max_ns,handoff_p50_ns,"
+		"handoff_p99_ns,handoff_p999_ns,handoff_max_ns\n");
+
+	for (i = 0; i < thread_count; i++) {
+		tr = trs[i];
+		printf("%s,%s,%llu,%d,%s,%d,%d,%lld,%.6f,%lld,%d,%lu,%lu,%lu,",
+			lock_name, boost->description, seed, i, role_names[role_of(i)],
+			(role_of(i) == ROLE_LP) ? low_prio : tr->priority, tr->pinning,
+			(long long)tr->tp.tv_sec * BILLION + tr->tp.tv_nsec,
+			compute_percentage(tr, total), tr->wait_ns, tr->iter,
+			tr->stats.boosts, tr->stats.lottery_won, tr->stats.lottery_lost);
+
+		if (slowdown) {
+			printf("%.6f,", slowdown[role_of(i)]);
+			if (unfairness >= 0) {
+				printf("%.6f", unfairness);
+			}
+		} else {
+			printf(",");
+		}
+		print_tail("wait", &tr->wait_hist);
+		print_tail("handoff", &tr->handoff_hist);
+		printf("\n");
+	}
+}
+
 void clean_l1_l2(void);
 
-int main(int argc, char *argv[])
+/* The name the results of each protocol go by */
+static const char *protocol_name(int proto)
 {
-	/* Create a new mapping in the virtual address space for this process */
-	void *addr = mmap(NULL,sysconf(_SC_PAGE_SIZE), PROT_READ | PROT_WRITE, 
-		MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
+	static const runtime_lock *protocols[] = {
+		&mutex_lock, &inherit_lock, &protect_lock, &CB2_lock,
+		&pi_inherit_lock, &pi_protect_lock, &CB2_queue_lock
+	};
 
-	int opt, ncpu = get_nprocs(), thread_count = 3, flags = 0, is_cb2 = 0,
-		iter = 1;
+	return (proto == RT_CB2) ? "CB2Lock" : protocols[proto]->description;
+}
+
+/* One experiment, with the results printed if report is set. If metric is
+ * not NULL, it gets what a sweep looks at (see METRICS), and the latencies
+ * of every role are added to tails. */
+static void run_experiment(int proto, int thread_count, int iter,
+		unsigned long long seed, int report, double *metric,
+		struct role_tails *tails)
+{
 	pthread_t *threads;
 	pthread_attr_t thread_attr;
 	struct test_run *tr, **collection_tr;
@@ -252,62 +724,27 @@ int main(int argc, char *argv[])
 	 * of per-thread CPU time. */
 	struct timespec start_bench, end_bench, total_time, bench_time;
 	cpu_set_t cpuset;
-	long long int total;
-	time_t t;
+	long long int total, wall_start;
 	register int i;
-	int sum_bys = 0;
+	int sum_bys = 0, is_cb2 = (proto == RT_CB2 || proto == RT_CB2_QUEUE);
+	double share[ROLES], slowdown[ROLES], wait[ROLES];
+	double max_slowdown = 0, min_slowdown = 1e300, unfairness = -1;
+	const char *lock_name = protocol_name(proto);
+	static struct role_tails run_tails[ROLES];
+	struct core_result *cores;
 
-	if (ncpu < 2) {
-		errExit("This benchmark requires at least 2 cores to run\n");
-	}
-	
-	while ((opt = getopt(argc, argv, "hn:p:i:")) != -1) {
-		switch (opt) {
-			case 'h':
-				printf("Usage: %s [-n nthreads]\n",argv[0]);
-				printf("\n");
-				printf("If -f flag is supplied, then all threads will have same priority\n");
-				exit(EXIT_SUCCESS);
-			case 'n':
-				thread_count = atoi(optarg);
-				if (thread_count < 3){
-					fprintf(stderr, "This benchmark requires at least 3 threads (%d)!\n",thread_count);
-					exit(EXIT_FAILURE);
-				}
-				break;
-			case 'p':
-				if (atoi(optarg) != RT_CB2){ 
-					if (init_lock(atoi(optarg),0) < 0) {
-					    errExit("Not a valid mutex protocol");
-					}
-				}
-				else {
-					is_cb2 = 1;
-				}
-				break;
-			case 'i':
-				iter = atoi(optarg);
-				if (iter < 1){
-					errExit("You need at least one iteration...");
-				}
-				break;
-			default:
-				fprintf(stderr, "Usage: %s [-n nthreads]\n", argv[0]);
-				exit(EXIT_FAILURE);
-		}
-	}
-
-	/* We will need to be root for nice values lower than 0 */
-	if (geteuid() != 0){
-  		fprintf(stderr,"We need root to change priorities!\n");
-		exit(EXIT_FAILURE);
-	}
+	rt_threads = (proto == RT_PI_INHERIT || proto == RT_PI_PROTECT);
+	lowest_acquired = highest_acquired = done = 0;
 
 	/* Allocate memory for the array of threads */
 	if (!(threads = calloc(thread_count, sizeof(pthread_t)))){
 		errExit("Could not calloc threads");
 	}
 
+	if (!(cores = calloc(ncpu, sizeof(*cores)))) {
+		errExit("Could not calloc the per-core results");
+	}
+
 	/* Initialize default attributes for a thread */
 	if (pthread_attr_init(&thread_attr) != 0){
 		errExit("Default thread attributes init");
@@ -317,9 +754,9 @@ int main(int argc, char *argv[])
 		errExit("Could not set explicit schedule");
 	}
 
-	/* Init lock */
-	if (!is_cb2 && !our_lock) {
-		init_lock(RT_NONE,0);
+	/* Init lock. CB2 waits until it knows the bystander tickets. */
+	if (!is_cb2 && init_lock(proto, 0) < 0) {
+		errExit("Not a valid mutex protocol");
 	}
 
 	/* Set the CFS scheduler (Most likely it already was) */
@@ -340,19 +777,37 @@ int main(int argc, char *argv[])
 	/* #### Create the threads and assign their priorities. ################# */
 
 	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start_bench);
+	wall_start = now_ns();
 
-	printf("\nExperiment with lock %s\n%d threads and %d iterations,", 
-		(is_cb2) ? "CB2Lock" : our_lock->description, thread_count, iter);
-	
-	if (flags){
-		printf(" all threads with same priority.\n");
-	}
-	else {
-		printf(" thread zero has the lowest priority.\n");
-	}
+	/* Intialize random number generators, with the same seed for both the
+	 * setup of the experiment and the lottery so that it can be replayed */
+	lottery_init(engine, seed);
+	seed = lottery_get_seed();
+	srand((unsigned) seed);
 
-	/* Intialize random number generator */
-   	srand((unsigned) time(&t));
+	/* Only the results go to the machine-readable formats */
+	if (report && out_format == OUT_TEXT) {
+		printf("\nExperiment with lock %s (boost: %s)\n%d threads and %d iterations,", 
+			lock_name, boost->description, thread_count, iter);
+
+		if (read_pct >= 0) {
+			printf(" Reader-writer, %d%% reads,", read_pct);
+		}
+		
+		if (flat){
+			printf(" all threads with same priority.\n");
+		}
+		else {
+			printf(" thread zero has the lowest priority.\n");
+		}
+
+		if (n_lp > 1 || n_hp > 1 || spread) {
+			printf("%d LP and %d HP contenders on %d CPUs, bystanders %s\n",
+				n_lp, n_hp, ncpu, spread ? "spread evenly" : "at random");
+		}
+
+		printf("Seed: %llu (%s)\n", seed, engine->description);
+	}
 
 	for (i = 0; i < thread_count; i++){
 		/* Make a results struct for this thread */
@@ -362,20 +817,30 @@ int main(int argc, char *argv[])
 
 		/* Set priorities and CPU affinity based on thread number */
 		tr->id = i;
-		tr->pinning = LOW_PRIO_CPU;
 		tr->iter = iter;
+		tr->tickets = 0;
 
-		if (i == LOW_PRIO_CPU) {
+		if (role_of(i) == ROLE_LP) {
 			/* In order to allow the test to make progress accross iterations,
 			 * we set the low priority thread to highest priority until it grabs
 			 * the lock and allows the actual high priority thread to continue.
 			 * */
-			tr->priority = HIGHEST_PRIO;
+			tr->priority = high_prio;
+			tr->pinning = contender_cpu(ROLE_LP, i);
 		} 
-		else if (i == HIGH_PRIO_CPU) {
-			tr->priority = HIGHEST_PRIO;
-			tr->pinning = HIGH_PRIO_CPU;
+		else if (role_of(i) == ROLE_HP) {
+			tr->priority = high_prio;
+			tr->pinning = contender_cpu(ROLE_HP, i - n_lp);
 		} 
+		else if (flat) {
+			/* Same priority as everybody else, anywhere */
+			tr->priority = 0;
+			tr->tickets = is_cb2 ? 20 : 0;
+			sum_bys += tr->tickets;
+
+			tr->pinning = spread ? cpus[(i - n_lp - n_hp) % ncpu] :
+				cpus[rand() % ncpu];
+		}
 		else {
 			/* This thread is a bystander, and his location and priority level
 			 * will be random, but in between the high and the low priority
@@ -384,14 +849,16 @@ int main(int argc, char *argv[])
 			
 			/* Get values between -1 and -19 */ 
 			if (tr->priority > 18){
-			        sum_bys += tr->priority;
+			        tr->tickets = tr->priority;
 				tr->priority = 0 - tr->priority + 18 ;
 			}
 			else if (is_cb2){
-				sum_bys += tr->priority;
+				tr->tickets = tr->priority;
 			}
+			sum_bys += tr->tickets;
 
-			tr->pinning = rand() % 1;
+			tr->pinning = spread ? cpus[(i - n_lp - n_hp) % ncpu] :
+				cpus[rand() % ncpu];
 		}
 
 		CPU_ZERO(&cpuset);
@@ -403,7 +870,7 @@ int main(int argc, char *argv[])
 
 		/* init the lock before the threads go off and party */
 		if (is_cb2 && i == thread_count - 1) {
-			init_lock(RT_CB2, sum_bys);
+			init_lock(proto, sum_bys);
 		}
 
 		if (pthread_create(&threads[i], &thread_attr, thread_func, tr) != 0) {
@@ -428,37 +895,667 @@ int main(int argc, char *argv[])
 	}
 
 	total = total_time.tv_sec * BILLION + total_time.tv_nsec; 
-	
-	for (i = 0; i < thread_count; ++i){
-
-		tr = collection_tr[i];
-
-		printf("Thread: %d\tPrio: %3d\tCPU#: %d\tCPU time: %ld:%09ld\tCPU%: %3d\tIters: %d\n",
-				i, (i == 0) ? LOWEST_PRIO : tr->priority, tr->pinning,
-				tr->tp.tv_sec, tr->tp.tv_nsec, compute_percentage(tr,total),
-				tr->iter);
-	
-		free(tr);
-		collection_tr[i] = NULL;
-	}
 
 	/* Compute total execution time */
 	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &end_bench);
 	
 	timeval_substract(&bench_time, &end_bench, &start_bench);
 
-	printf("Total benchmark time: %lld:%09ld\n",
-		(long long)bench_time.tv_sec,bench_time.tv_nsec);
+	/* Slowdown of each role against the same-priority baseline, and the
+	 * Unfairness of the run: the worst Slowdown over the best one */
+	memset(share, 0, sizeof(share));
+	for (i = 0; i < thread_count; ++i) {
+		share[role_of(i)] += compute_percentage(collection_tr[i], total);
+	}
+
+	if (baseline) {
+		for (i = 0; i < ROLES; i++) {
+			slowdown[i] = base_share[i] ? share[i] / base_share[i] : 0;
+			max_slowdown = (slowdown[i] > max_slowdown) ? slowdown[i] : max_slowdown;
+			min_slowdown = (slowdown[i] < min_slowdown) ? slowdown[i] : min_slowdown;
+		}
+		unfairness = min_slowdown ? max_slowdown / min_slowdown : -1;
+	}
+
+	/* Waits of every role, the contenders of each class added up */
+	memset(run_tails, 0, sizeof(run_tails));
+	memset(wait, 0, sizeof(wait));
+	for (i = 0; i < thread_count; ++i) {
+		hist_merge(&run_tails[role_of(i)].wait, &collection_tr[i]->wait_hist);
+		hist_merge(&run_tails[role_of(i)].handoff,
+			&collection_tr[i]->handoff_hist);
+		wait[role_of(i)] += collection_tr[i]->wait_ns;
+	}
+
+	if (metric) {
+		metric[M_WALL] = (now_ns() - wall_start) / 1e6;
+		metric[M_HP_WAIT] = wait[ROLE_HP] / n_hp / 1e6;
+		metric[M_LP_WAIT] = wait[ROLE_LP] / n_lp / 1e6;
+		metric[M_HP_PCT] = share[ROLE_HP];
+		metric[M_BYS_PCT] = share[ROLE_BYSTANDERS];
+		metric[M_UNFAIRNESS] = (unfairness < 0) ? NAN : unfairness;
+		metric[M_HP_WAIT_P99] = hist_percentile(&run_tails[ROLE_HP].wait,
+			99) / 1e3;
+		metric[M_HP_HANDOFF_P99] = hist_percentile(
+			&run_tails[ROLE_HP].handoff, 99) / 1e3;
+	}
+
+	for (i = 0; tails && i < ROLES; ++i) {
+		hist_merge(&tails[i].wait, &run_tails[i].wait);
+		hist_merge(&tails[i].handoff, &run_tails[i].handoff);
+	}
+
+	per_core(collection_tr, thread_count, total, cores);
+
+	if (!report) {
+		/* Only the sweep looks at this run */
+	} else if (out_format == OUT_JSON) {
+		print_json(lock_name, seed, collection_tr, thread_count, total,
+			cores, baseline ? slowdown : NULL, unfairness);
+	} else if (out_format == OUT_CSV) {
+		print_csv(lock_name, seed, collection_tr, thread_count, total,
+			baseline ? slowdown : NULL, unfairness);
+	} else {
+		for (i = 0; i < thread_count; ++i){
+
+			tr = collection_tr[i];
+
+			printf("Thread: %d\tPrio: %3d\tCPU#: %d\tCPU time: %ld:%09ld\tCPU%%: %6.2f\tIters: %d\n",
+					i, (role_of(i) == ROLE_LP) ? low_prio : tr->priority, tr->pinning,
+					tr->tp.tv_sec, tr->tp.tv_nsec, compute_percentage(tr,total),
+					tr->iter);
+		}
+
+		print_cores(cores);
+
+		printf("Latency (us)         %8s %10s %10s %10s %10s\n", "n",
+			"p50", "p99", "p99.9", "max");
+		for (i = 0; i < thread_count; ++i) {
+			char name[32];
+
+			tr = collection_tr[i];
+			if (!tr->wait_hist.count) {
+				continue;
+			}
+
+			snprintf(name, sizeof(name), "%s %d wait",
+				role_names[role_of(i)], i);
+			print_tail(name, &tr->wait_hist);
+			snprintf(name, sizeof(name), "%s %d handoff",
+				role_names[role_of(i)], i);
+			print_tail(name, &tr->handoff_hist);
+		}
 
-	printf("Total threads CPU time: %lld:%09ld\n",
-		(long long)total_time.tv_sec,total_time.tv_nsec);
+		printf("Total benchmark time: %lld:%09ld\n",
+			(long long)bench_time.tv_sec,bench_time.tv_nsec);
+
+		printf("Total threads CPU time: %lld:%09ld\n",
+			(long long)total_time.tv_sec,total_time.tv_nsec);
+
+		if (is_cb2) {
+			cb2_lock_t *l = (read_pct >= 0) ? &cs_rwlock.writer : &cs_lock;
+			struct cb2_lock_stats lstats;
+
+			if (cb2_lock_get_stats(l, &lstats) == 0) {
+				printf("Contended: %lu acquired spinning, %lu parked (%lu futex "
+					"waits, %lu lottery rounds)\n", lstats.spin_acquired,
+					lstats.contended - lstats.spin_acquired,
+					lstats.futex_waits,
+					lstats.lottery_won + lstats.lottery_lost);
+				printf("Lock stats: %lu acquisitions, %lu contended, %lu retries, "
+					"lottery %lu won %lu lost, %lu boosts, %lu priority syscalls\n",
+					lstats.acquisitions, lstats.contended, lstats.try_again,
+					lstats.lottery_won, lstats.lottery_lost, lstats.boosts,
+					lstats.prio_syscalls);
+				printf("Held %llu ns, waited %llu ns\n", lstats.hold_ns,
+					lstats.wait_ns);
+			}
+		}
+
+		if (read_pct >= 0) {
+			printf("Readers boosted by writers: %lu\n", cs_rwlock.reader_boosts);
+		}
+
+		if (baseline) {
+			printf("Slowdown: LP %.4f, HP %.4f, bystanders %.4f\n",
+				slowdown[ROLE_LP], slowdown[ROLE_HP],
+				slowdown[ROLE_BYSTANDERS]);
+			printf("Unfairness: %.4f\n", unfairness);
+		}
+	}
+
+	for (i = 0; i < thread_count; ++i) {
+		free(collection_tr[i]);
+		collection_tr[i] = NULL;
+	}
 	
 	/* Cleanup */
-	our_lock->destroy();
+	if (read_pct >= 0) {
+		cb2_rwlock_destroy(&cs_rwlock);
+	} else {
+		cb2_lock_destroy(&cs_lock);
+	}
 	pthread_barrier_destroy(&barrier);
 	free(threads);
+	free(cores);
 	pthread_attr_destroy(&thread_attr);
 	free(collection_tr);
+}
+
+/* ############################ Sweeps ################################### */
+
+/* Longest list of values -P, -N or -I take */
+#define MAX_LIST 64
+
+/* Summaries of a previous sweep, see -C */
+struct stored_summary {
+	int proto, threads, iters;
+	char metric[32];
+	struct samples_summary s;
+};
+static struct stored_summary *stored = NULL;
+static int nstored = 0;
+
+/* Values like 1,3-5. Returns how many. */
+static int parse_list(const char *arg, int *list, int min)
+{
+	char *next = (char *)arg, *start;
+	int n = 0, a, b;
+
+	while (*next) {
+		start = next;
+		a = b = strtol(next, &next, 10);
+		if (*next == '-') {
+			b = strtol(next + 1, &next, 10);
+		}
+
+		if (next == start || a < min || b < a || n + b - a >= MAX_LIST ||
+				(*next && *next != ',')) {
+			fprintf(stderr, "Not a valid list: %s\n", arg);
+			exit(EXIT_FAILURE);
+		}
+
+		while (a <= b) {
+			list[n++] = a++;
+		}
+		next += (*next == ',');
+	}
+
+	return n;
+}
+
+/* Loads a sweep written with -o csv */
+static void read_stored(const char *path)
+{
+	struct stored_summary *e;
+	char line[512];
+	FILE *f;
+
+	if (!(f = fopen(path, "r"))) {
+		errExit("Could not open the stored sweep");
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		if (!(nstored % 64) && !(stored = realloc(stored,
+				(nstored + 64) * sizeof(*stored)))) {
+			errExit("Could not realloc the stored sweep");
+		}
+		e = &stored[nstored];
+
+		/* protocol_id,protocol,threads,iterations,metric,n,rejected,
+		 * median,p5,p95,mean,sd,ci_lo,ci_hi,... (the header is skipped) */
+		if (sscanf(line, "%d,%*[^,],%d,%d,%31[^,],%d,%d,%lf,%lf,%lf,"
+				"%lf,%lf,%lf,%lf", &e->proto, &e->threads, &e->iters,
+				e->metric, &e->s.n, &e->s.rejected, &e->s.median,
+				&e->s.p5, &e->s.p95, &e->s.mean, &e->s.sd, &e->s.ci_lo,
+				&e->s.ci_hi) == 13) {
+			nstored++;
+		}
+	}
+
+	fclose(f);
+
+	if (!nstored) {
+		errExit("Nothing in the stored sweep");
+	}
+}
+
+static struct samples_summary *find_stored(int proto, int threads, int iters,
+		int m)
+{
+	int i;
+
+	for (i = 0; i < nstored; i++) {
+		if (stored[i].proto == proto && stored[i].threads == threads &&
+				stored[i].iters == iters &&
+				!strcmp(stored[i].metric, metrics[m].name)) {
+			return &stored[i].s;
+		}
+	}
+
+	return NULL;
+}
+
+/* One metric of one point of the sweep. Returns 1 if it is a regression
+ * against the stored sweep. */
+static int report_summary(int proto, int threads, int iters, int m,
+		struct samples_summary *s)
+{
+	struct samples_summary *base = NULL;
+	const char *verdict = "";
+	double change = 0;
+
+	if (nstored && (base = find_stored(proto, threads, iters, m))) {
+		change = base->mean ? (s->mean / base->mean - 1) * 100 : 0;
+
+		if (!samples_differ(s, base)) {
+			verdict = "same";
+		} else if (!metrics[m].lower_better) {
+			verdict = "changed";
+		} else {
+			verdict = (s->mean > base->mean) ? "REGRESSION" : "improved";
+		}
+	} else if (nstored) {
+		verdict = "new";
+	}
+
+	if (out_format == OUT_CSV) {
+		printf("%d,%s,%d,%d,%s,%d,%d,%.6f,%.6f,%.6f,%.6f,%.6f,%.6f,%.6f",
+			proto, protocol_name(proto), threads, iters, metrics[m].name,
+			s->n, s->rejected, s->median, s->p5, s->p95, s->mean, s->sd,
+			s->ci_lo, s->ci_hi);
+		if (nstored) {
+			printf(",%.6f,%.4f,%s", base ? base->mean : 0, change, verdict);
+		}
+		printf("\n");
+	} else if (out_format == OUT_JSON) {
+		printf("{\"protocol_id\": %d, \"protocol\": \"%s\", \"threads\": %d, "
+			"\"iterations\": %d, \"metric\": \"%s\", \"n\": %d, "
+			"\"rejected\": %d, \"median\": %.6f, \"p5\": %.6f, "
+			"\"p95\": %.6f, \"mean\": %.6f, \"sd\": %.6f, \"ci_lo\": %.6f, "
+			"\"ci_hi\": %.6f", proto, protocol_name(proto), threads, iters,
+			metrics[m].name, s->n, s->rejected, s->median, s->p5, s->p95,
+			s->mean, s->sd, s->ci_lo, s->ci_hi);
+		if (nstored) {
+			printf(", \"base_mean\": %.6f, \"change_pct\": %.4f, "
+				"\"verdict\": \"%s\"", base ? base->mean : 0, change,
+				verdict);
+		}
+		printf("}\n");
+	} else {
+		printf("  %-18s %3d %3d %10.3f %10.3f %10.3f %10.3f [%.3f, %.3f]",
+			metrics[m].name, s->n, s->rejected, s->median, s->p5, s->p95,
+			s->mean, s->ci_lo, s->ci_hi);
+		if (base) {
+			printf(" %+.2f%% %s", change, verdict);
+		} else if (nstored) {
+			printf(" (not in the stored sweep)");
+		}
+		printf("\n");
+	}
+
+	return base && !strcmp(verdict, "REGRESSION");
+}
+
+/* Latencies of the HP and LP threads over every run of one point of the
+ * sweep. The CSV has the p99 of each run as a metric instead. */
+static void report_tails(int proto, int threads, int iters,
+		struct role_tails *tails)
+{
+	static const char *kinds[2] = { "wait", "handoff" };
+	static const int roles[2] = { ROLE_HP, ROLE_LP };
+	const struct hist *h;
+	char name[32];
+	int r, k;
+
+	if (out_format == OUT_CSV) {
+		return;
+	}
+
+	if (out_format == OUT_TEXT) {
+		printf("  %-18s %8s %10s %10s %10s %10s\n", "latency (us)", "n",
+			"p50", "p99", "p99.9", "max");
+	}
+
+	for (r = 0; r < 2; r++) {
+		for (k = 0; k < 2; k++) {
+			h = k ? &tails[roles[r]].handoff : &tails[roles[r]].wait;
+
+			if (out_format == OUT_JSON) {
+				printf("{\"protocol_id\": %d, \"protocol\": \"%s\", "
+					"\"threads\": %d, \"iterations\": %d, \"role\": "
+					"\"%s\", \"n\": %lu", proto, protocol_name(proto),
+					threads, iters, role_names[roles[r]], h->count);
+				print_tail(kinds[k], h);
+				printf("}\n");
+			} else {
+				snprintf(name, sizeof(name), "%s %s",
+					role_names[roles[r]], kinds[k]);
+				print_tail(name, h);
+			}
+		}
+	}
+}
+
+/* Every protocol with every thread count and number of iterations, reps
+ * times after warmups discarded runs. Repetition r of each point runs with
+ * seed + r, or from the clock if there is no seed. Returns how many
+ * regressions there are against the stored sweep. */
+static int run_sweep(int *protos, int nprotos, int *threads, int nthreads,
+		int *iters, int niters, int reps, int warmups,
+		unsigned long long seed)
+{
+	double *values[METRICS], metric[METRICS];
+	static struct role_tails tails[ROLES];
+	struct samples_summary s;
+	int count[METRICS], p, t, i, r, m, regressions = 0;
+
+	for (m = 0; m < METRICS; m++) {
+		if (!(values[m] = malloc(reps * sizeof(double)))) {
+			errExit("Could not malloc the sweep");
+		}
+	}
+
+	if (out_format == OUT_CSV) {
+		printf("protocol_id,protocol,threads,iterations,metric,n,rejected,"
+			"median,p5,p95,mean,sd,ci_lo,ci_hi%s\n",
+			nstored ? ",base_mean,change_pct,verdict" : "");
+	} else if (out_format == OUT_TEXT) {
+		printf("Sweep of %d runs per point after %d warmup runs (boost: %s%s)\n",
+			reps, warmups, boost->description,
+			flat ? ", all threads with same priority" : "");
+		if (seed) {
+			printf("Seeds: %llu to %llu\n", seed, seed + reps - 1);
+		}
+	}
+
+	for (p = 0; p < nprotos; p++) {
+		for (t = 0; t < nthreads; t++) {
+			for (i = 0; i < niters; i++) {
+				/* Caches, page tables and the scheduler settle down */
+				for (r = 0; r < warmups; r++) {
+					run_experiment(protos[p], threads[t], iters[i],
+						seed ? seed + reps + r : 0, 0, NULL, NULL);
+				}
+
+				memset(count, 0, sizeof(count));
+				memset(tails, 0, sizeof(tails));
+				for (r = 0; r < reps; r++) {
+					run_experiment(protos[p], threads[t], iters[i],
+						seed ? seed + r : 0, 0, metric, tails);
+
+					/* Unfairness needs -S */
+					for (m = 0; m < METRICS; m++) {
+						if (!isnan(metric[m])) {
+							values[m][count[m]++] = metric[m];
+						}
+					}
+				}
+
+				if (out_format == OUT_TEXT) {
+					printf("\n%s, %d threads and %d iterations\n",
+						protocol_name(protos[p]), threads[t], iters[i]);
+					printf("  %-18s %3s %3s %10s %10s %10s %10s %s\n",
+						"metric", "n", "out", "median", "p5", "p95",
+						"mean", "95% CI");
+				}
+
+				for (m = 0; m < METRICS; m++) {
+					if (count[m]) {
+						samples_summarize(values[m], count[m], &s);
+						regressions += report_summary(protos[p],
+							threads[t], iters[i], m, &s);
+					}
+				}
+				report_tails(protos[p], threads[t], iters[i], tails);
+				fflush(stdout);
+			}
+		}
+	}
+
+	if (nstored && out_format == OUT_TEXT) {
+		printf("\n%d significant regressions\n", regressions);
+	}
+
+	for (m = 0; m < METRICS; m++) {
+		free(values[m]);
+	}
+
+	return regressions;
+}
+
+int main(int argc, char *argv[])
+{
+	/* Create a new mapping in the virtual address space for this process */
+	void *addr = mmap(NULL,sysconf(_SC_PAGE_SIZE), PROT_READ | PROT_WRITE, 
+		MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
+
+	int opt, thread_count = 3, iter = 1, proto = RT_NONE, i;
+	int protos[MAX_LIST], threads[MAX_LIST], iters[MAX_LIST];
+	int nprotos = 0, nthreads = 0, niters = 0, sweep = 0, reps = 5, warmups = 1;
+	int status = EXIT_SUCCESS, max_cpus = 0;
+	unsigned long long seed = 0;
+	const char *compare = NULL;
+	cpu_set_t allowed;
+
+	/* The CPUs we may run on, in order */
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+		errExit("Could not get the CPUs we may run on");
+	}
+	for (i = 0; i < CPU_SETSIZE; i++) {
+		if (CPU_ISSET(i, &allowed)) {
+			cpus[ncpu++] = i;
+		}
+	}
+	
+	while ((opt = getopt(argc, argv, "hn:p:i:s:b:u:B:r:fo:S:P:N:I:R:W:C:T:H:L:c:Dg:")) != -1) {
+		switch (opt) {
+			case 'h':
+				printf("Usage: %s [-n nthreads] [-s seed] [-b usecs] [-u usecs]\n",argv[0]);
+				printf("\n");
+				printf("Pass the seed printed by a previous run to -s to replay it\n");
+				printf("-g: lottery generator, xorshift (default) or pcg32\n");
+				printf("-p: protocol, 0 none, 1 inherit, 2 protect, 3 CB2,\n");
+				printf("    4 kernel PI futex, 5 kernel ceiling (real-time threads),\n");
+				printf("    6 CB2 with a queue and lottery handoff\n");
+				printf("-r: CB2 as a reader-writer lock, with this %% of reads\n");
+				printf("-b: only boost the owner after waiting this long\n");
+				printf("-u: keep a boost this long after unlocking\n");
+				printf("-B: boost backend, 0 nice, 1 SCHED_FIFO, 2 SCHED_RR, 3 util clamp\n");
+				printf("If -f flag is supplied, then all threads will have same priority\n");
+				printf("-o: output as text, json or csv\n");
+				printf("-S: csv of -f -p 0 runs, to compute the Slowdown and Unfairness\n");
+				printf("-T: trace the locks into this file, for trace_analyze.\n");
+				printf("    file:n makes room for n threads (default %d)\n", TRACE_RINGS);
+				printf("-L, -H: low and high-priority contenders (default 1 each).\n");
+				printf("    LP ones go on the even CPUs and HP ones on the odd CPUs\n");
+				printf("-c: only use the first this many CPUs we may run on\n");
+				printf("-D: spread the bystanders evenly over the CPUs\n");
+				printf("\n");
+				printf("Any of the following runs a sweep instead of one experiment:\n");
+				printf("-P, -N, -I: protocols, thread counts and iterations to sweep,\n");
+				printf("    like 1,3-6 (default what -p, -n and -i say)\n");
+				printf("-R: runs of every point of the sweep (default %d)\n", reps);
+				printf("-W: warmup runs before them, discarded (default %d)\n", warmups);
+				printf("-C: csv of a previous sweep to compare with. Exits with 1\n");
+				printf("    if any difference is a significant regression.\n");
+				exit(EXIT_SUCCESS);
+			case 'n':
+				thread_count = atoi(optarg);
+				if (thread_count < 3){
+					fprintf(stderr, "This benchmark requires at least 3 threads (%d)!\n",thread_count);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'p':
+				proto = atoi(optarg);
+				break;
+			case 'b':
+				boost_delay_ns = atoll(optarg) * 1000;
+				break;
+			case 'u':
+				unboost_delay_ns = atoll(optarg) * 1000;
+				break;
+			case 'B':
+				if (atoi(optarg) < 0 || atoi(optarg) > 3) {
+					errExit("Not a valid boost backend");
+				}
+				boost = boost_backends[atoi(optarg)];
+				break;
+			case 'r':
+				read_pct = atoi(optarg);
+				if (read_pct < 0 || read_pct > 100) {
+					errExit("The read ratio is a percentage");
+				}
+				break;
+			case 's':
+				seed = strtoull(optarg, NULL, 0);
+				break;
+			case 'g':
+				if (!(engine = lottery_engine_by_name(optarg))) {
+					errExit("Not a valid lottery generator");
+				}
+				break;
+			case 'f':
+				flat = 1;
+				high_prio = low_prio = 0;
+				break;
+			case 'o':
+				if (!strcmp(optarg, "json")) {
+					out_format = OUT_JSON;
+				} else if (!strcmp(optarg, "csv")) {
+					out_format = OUT_CSV;
+				} else if (strcmp(optarg, "text")) {
+					errExit("Not a valid output format");
+				}
+				break;
+			case 'S':
+				baseline = optarg;
+				break;
+			case 'T':
+				if (trace_open_spec(optarg) == -1) {
+					errExit("Could not set up the trace");
+				}
+				break;
+			case 'L':
+				n_lp = atoi(optarg);
+				if (n_lp < 1) {
+					errExit("We need at least one low-priority contender");
+				}
+				break;
+			case 'H':
+				n_hp = atoi(optarg);
+				if (n_hp < 1) {
+					errExit("We need at least one high-priority contender");
+				}
+				break;
+			case 'c':
+				max_cpus = atoi(optarg);
+				break;
+			case 'D':
+				spread = 1;
+				break;
+			case 'i':
+				iter = atoi(optarg);
+				if (iter < 1){
+					errExit("You need at least one iteration...");
+				}
+				break;
+			case 'P':
+				nprotos = parse_list(optarg, protos, RT_NONE);
+				sweep = 1;
+				break;
+			case 'N':
+				/* At least the HP, the LP and a bystander */
+				nthreads = parse_list(optarg, threads, 3);
+				sweep = 1;
+				break;
+			case 'I':
+				niters = parse_list(optarg, iters, 1);
+				sweep = 1;
+				break;
+			case 'R':
+				reps = atoi(optarg);
+				if (reps < 1) {
+					errExit("A sweep needs at least one run per point");
+				}
+				sweep = 1;
+				break;
+			case 'W':
+				warmups = atoi(optarg);
+				if (warmups < 0) {
+					errExit("Not a valid number of warmup runs");
+				}
+				sweep = 1;
+				break;
+			case 'C':
+				compare = optarg;
+				sweep = 1;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-n nthreads]\n", argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
+
+	/* We will need to be root for nice values lower than 0 */
+	if (geteuid() != 0){
+  		fprintf(stderr,"We need root to change priorities!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Without a list, the sweep takes the single value */
+	if (!nprotos) {
+		protos[nprotos++] = proto;
+	}
+	if (!nthreads) {
+		threads[nthreads++] = thread_count;
+	}
+	if (!niters) {
+		iters[niters++] = iter;
+	}
+
+	if (max_cpus > 0 && max_cpus < ncpu) {
+		ncpu = max_cpus;
+	}
+	if (ncpu < 2) {
+		errExit("This benchmark requires at least 2 cores to run\n");
+	}
+
+	/* Every contender, and at least a bystander */
+	for (i = 0; i < nthreads; i++) {
+		if (threads[i] < n_lp + n_hp + 1) {
+			fprintf(stderr, "%d LP and %d HP contenders need at least %d "
+				"threads (%d)!\n", n_lp, n_hp, n_lp + n_hp + 1, threads[i]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	for (i = 0; i < nprotos; i++) {
+		if (protos[i] < RT_NONE || protos[i] > RT_CB2_QUEUE) {
+			errExit("Not a valid mutex protocol");
+		}
+		if (read_pct >= 0 && protos[i] != RT_CB2) {
+			errExit("Only CB2 has a reader-writer variant");
+		}
+	}
+
+	if (baseline) {
+		read_baseline(baseline, base_share);
+	}
+
+	if (compare) {
+		read_stored(compare);
+	}
+
+	if (sweep) {
+		if (run_sweep(protos, nprotos, threads, nthreads, iters, niters,
+				reps, warmups, seed)) {
+			status = EXIT_FAILURE;
+		}
+	} else {
+		run_experiment(proto, thread_count, iter, seed, 1, NULL, NULL);
+	}
 
 	/* Some stuff to make the experiments more reliable */
 
@@ -468,7 +1565,8 @@ int main(int argc, char *argv[])
 		errExit("we couldn't do madvise");	
 	}
 
-	exit(EXIT_SUCCESS);
+	free(stored);
+	exit(status);
 }
 
 void clean_l1_l2(void)
@@ -0,0 +1,259 @@
+#include <dirent.h>
+
+#include "runtime_lock.h"
+#include "util.h"
+#include "tickets.h"
+
+#define SLOT_EMPTY 0
+#define SLOT_TOMBSTONE (-1)
+
+/* Taken by a thread that is still filling it in */
+#define SLOT_CLAIMED (-2)
+
+struct ticket_holder {
+	pid_t tid;
+	int cpu;
+	int tickets;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct cpu_tickets {
+	/* Held by registered threads, updated incrementally */
+	int registered;
+	/* Held by unregistered threads, as of the last sample */
+	int sampled;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static struct ticket_holder holders[TICKETS_MAX_THREADS];
+static struct cpu_tickets per_cpu[TICKETS_MAX_CPUS];
+
+static __thread struct ticket_holder *me_holder = NULL;
+
+static pthread_key_t holder_key;
+static pthread_once_t holder_key_once = PTHREAD_ONCE_INIT;
+
+static void holder_exit(__attribute__((unused)) void *holder)
+{
+	tickets_unregister();
+}
+
+static void make_holder_key(void)
+{
+	if (pthread_key_create(&holder_key, holder_exit) != 0) {
+		errExit("failed to create the tickets key");
+	}
+}
+
+static inline int current_cpu(void)
+{
+	int cpu = sched_getcpu();
+
+	return (cpu < 0 || cpu >= TICKETS_MAX_CPUS) ? 0 : cpu;
+}
+
+/* Same scheme as the priority registry: only the thread inserts itself */
+static struct ticket_holder *lookup(pid_t tid)
+{
+	unsigned int i, h = (unsigned int)tid % TICKETS_MAX_THREADS;
+	pid_t cur;
+
+	for (i = 0; i < TICKETS_MAX_THREADS; i++) {
+		struct ticket_holder *t = &holders[(h + i) % TICKETS_MAX_THREADS];
+
+		cur = __atomic_load_n(&t->tid, __ATOMIC_ACQUIRE);
+		if (cur == tid) {
+			return t;
+		}
+		if (cur == SLOT_EMPTY) {
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+int tickets_register(int tickets)
+{
+	pid_t me = self_tid();
+	unsigned int i, h = (unsigned int)me % TICKETS_MAX_THREADS;
+
+	if (me_holder) {
+		__atomic_add_fetch(&per_cpu[me_holder->cpu].registered,
+			tickets - me_holder->tickets, __ATOMIC_RELAXED);
+		__atomic_store_n(&me_holder->tickets, tickets, __ATOMIC_RELAXED);
+		tickets_migrated();
+		return 0;
+	}
+
+	pthread_once(&holder_key_once, make_holder_key);
+
+	for (i = 0; i < TICKETS_MAX_THREADS; i++) {
+		struct ticket_holder *t = &holders[(h + i) % TICKETS_MAX_THREADS];
+		pid_t cur = __atomic_load_n(&t->tid, __ATOMIC_RELAXED);
+
+		if (cur != SLOT_EMPTY && cur != SLOT_TOMBSTONE) {
+			continue;
+		}
+
+		/* Claim the slot before touching it, losers leave it alone */
+		if (!__atomic_compare_exchange_n(&t->tid, &cur, SLOT_CLAIMED, 0,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			continue;
+		}
+
+		t->cpu = current_cpu();
+		t->tickets = tickets;
+
+		/* The values are there before the TID makes the slot visible */
+		__atomic_store_n(&t->tid, me, __ATOMIC_RELEASE);
+		__atomic_add_fetch(&per_cpu[t->cpu].registered, tickets,
+			__ATOMIC_RELAXED);
+		pthread_setspecific(holder_key, t);
+		me_holder = t;
+		return 0;
+	}
+
+	return -1;
+}
+
+void tickets_unregister(void)
+{
+	struct ticket_holder *t = me_holder;
+
+	if (!t) {
+		return;
+	}
+
+	__atomic_sub_fetch(&per_cpu[t->cpu].registered, t->tickets,
+		__ATOMIC_RELAXED);
+	__atomic_store_n(&t->tid, SLOT_TOMBSTONE, __ATOMIC_RELEASE);
+	pthread_setspecific(holder_key, NULL);
+	me_holder = NULL;
+}
+
+void tickets_migrated(void)
+{
+	struct ticket_holder *t = me_holder;
+	int cpu, old;
+
+	if (!t || (cpu = current_cpu()) == (old = t->cpu)) {
+		return;
+	}
+
+	/* Add before removing, so a reader never sees the tickets vanish */
+	__atomic_add_fetch(&per_cpu[cpu].registered, t->tickets, __ATOMIC_RELAXED);
+	__atomic_store_n(&t->cpu, cpu, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&per_cpu[old].registered, t->tickets, __ATOMIC_RELAXED);
+}
+
+void tickets_forked(void)
+{
+	int tickets = me_holder ? me_holder->tickets : 0;
+
+	memset(holders, 0, sizeof(holders));
+	memset(per_cpu, 0, sizeof(per_cpu));
+
+	if (me_holder) {
+		pthread_setspecific(holder_key, NULL);
+		me_holder = NULL;
+		tickets_register(tickets);
+	}
+}
+
+int tickets_on_cpu(int cpu, pid_t tid)
+{
+	struct ticket_holder *t;
+	int sum;
+
+	if (cpu < 0 || cpu >= TICKETS_MAX_CPUS) {
+		return 0;
+	}
+
+	sum = __atomic_load_n(&per_cpu[cpu].registered, __ATOMIC_RELAXED) +
+		__atomic_load_n(&per_cpu[cpu].sampled, __ATOMIC_RELAXED);
+
+	if (tid && (t = lookup(tid)) &&
+	    __atomic_load_n(&t->cpu, __ATOMIC_RELAXED) == cpu) {
+		sum -= __atomic_load_n(&t->tickets, __ATOMIC_RELAXED);
+	}
+
+	return (sum > 0) ? sum : 0;
+}
+
+/* Fields 19 (nice) and 39 (processor) of /proc/<pid>/task/<tid>/stat */
+static int read_task_stat(pid_t tid, int *nice, int *cpu)
+{
+	char path[64], buf[1024], *p;
+	int field;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/self/task/%d/stat", tid);
+	if (!(f = fopen(path, "r"))) {
+		return -1;
+	}
+
+	p = fgets(buf, sizeof(buf), f);
+	fclose(f);
+
+	/* The command name may contain spaces, skip past it */
+	if (!p || !(p = strrchr(buf, ')'))) {
+		return -1;
+	}
+
+	for (field = 2; p && field < 39; field++) {
+		p = strchr(p + 1, ' ');
+		if (p && field + 1 == 19) {
+			*nice = atoi(p + 1);
+		}
+	}
+
+	if (!p) {
+		return -1;
+	}
+
+	*cpu = atoi(p + 1);
+	return 0;
+}
+
+int tickets_cpu_of(pid_t tid)
+{
+	struct ticket_holder *t = lookup(tid);
+
+	return t ? __atomic_load_n(&t->cpu, __ATOMIC_RELAXED) : -1;
+}
+
+int tickets_sample(void)
+{
+	int sampled[TICKETS_MAX_CPUS];
+	int nice, cpu, ncpu = get_nprocs_conf(), count = 0;
+	struct dirent *d;
+	DIR *dir;
+
+	if (!(dir = opendir("/proc/self/task"))) {
+		return -1;
+	}
+
+	memset(sampled, 0, sizeof(sampled));
+
+	while ((d = readdir(dir))) {
+		pid_t tid = atoi(d->d_name);
+
+		if (tid <= 0 || lookup(tid)) {
+			continue;
+		}
+
+		if (read_task_stat(tid, &nice, &cpu) == 0 &&
+		    cpu >= 0 && cpu < TICKETS_MAX_CPUS) {
+			sampled[cpu] += 20 - nice;
+			count++;
+		}
+	}
+
+	closedir(dir);
+
+	for (cpu = 0; cpu < ncpu && cpu < TICKETS_MAX_CPUS; cpu++) {
+		__atomic_store_n(&per_cpu[cpu].sampled, sampled[cpu],
+			__ATOMIC_RELAXED);
+	}
+
+	return count;
+}
@@ -0,0 +1,57 @@
+#ifndef __TICKETS_H_
+#define __TICKETS_H_
+
+#include <sched.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+	Live per-CPU ticket accounting for the CB2 lottery. Threads that
+	compete for CPU time with lock owners register the tickets they hold
+	on the CPU they run on, and report when they may have migrated. The
+	per-CPU sums are kept up to date incrementally, so reading the tickets
+	of a CPU is a single load.
+
+	Threads that never register can be accounted for by the sampler,
+	which walks /proc/self/task/<tid>/stat and charges 20 - nice tickets
+	(1 to 40) to the CPU each of them last ran on.
+*/
+
+#define TICKETS_MAX_CPUS    CPU_SETSIZE
+#define TICKETS_MAX_THREADS 1024
+
+/* The calling thread holds `tickets` on the CPU it runs on. Registering
+ * again replaces the previous amount. Returns -1 if the table is full. */
+int tickets_register(int tickets);
+
+/* Remove the calling thread's tickets, also done when it exits */
+void tickets_unregister(void);
+
+/* Move the calling thread's tickets if it now runs on another CPU. Cheap
+ * enough to call often. */
+void tickets_migrated(void);
+
+/* In the child of a fork(): drop the tickets of every thread but the
+ * caller, which keeps its own under its new TID. The sampled ones are gone
+ * until the next tickets_sample(). */
+void tickets_forked(void);
+
+/* Tickets on cpu held by everybody except tid (pass 0 to count all) */
+int tickets_on_cpu(int cpu, pid_t tid);
+
+/* CPU tid registered on, -1 if it did not. Never reads /proc, only
+ * tickets_sample() does. */
+int tickets_cpu_of(pid_t tid);
+
+/* Recompute the share of unregistered threads. Returns the number of
+ * threads sampled, or -1 if /proc could not be read. */
+int tickets_sample(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
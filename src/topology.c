@@ -0,0 +1,170 @@
+#include "util.h"
+#include "topology.h"
+
+#define SYS_CPU  "/sys/devices/system/cpu"
+#define SYS_NODE "/sys/devices/system/node"
+
+static struct {
+	int core, llc, node;
+} cpus[TOPO_MAX_CPUS];
+
+static int ncpus = 0;
+static pthread_once_t topology_once = PTHREAD_ONCE_INIT;
+
+static int read_int(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	int val = -1;
+
+	if (f) {
+		if (fscanf(f, "%d", &val) != 1) {
+			val = -1;
+		}
+		fclose(f);
+	}
+
+	return val;
+}
+
+/* Mark the CPUs of a list like "0-3,8-11" as being on node */
+static void read_node_cpus(const char *path, int node)
+{
+	int first, last, cpu;
+	char sep;
+	FILE *f;
+
+	if (!(f = fopen(path, "r"))) {
+		return;
+	}
+
+	while (fscanf(f, "%d", &first) == 1) {
+		last = first;
+		if (fscanf(f, "%c", &sep) == 1 && sep == '-') {
+			if (fscanf(f, "%d%c", &last, &sep) < 1) {
+				break;
+			}
+		}
+
+		for (cpu = first; cpu <= last && cpu < ncpus; cpu++) {
+			cpus[cpu].node = node;
+		}
+
+		if (sep != ',') {
+			break;
+		}
+	}
+
+	fclose(f);
+}
+
+/* The LLC is the highest level cache, named after its first CPU */
+static int read_llc(int cpu)
+{
+	char path[128];
+	int index, level, best = 0, llc = -1;
+
+	for (index = 0; ; index++) {
+		snprintf(path, sizeof(path), SYS_CPU "/cpu%d/cache/index%d/level",
+			cpu, index);
+		if ((level = read_int(path)) < 0) {
+			break;
+		}
+
+		if (level >= best) {
+			best = level;
+			snprintf(path, sizeof(path),
+				SYS_CPU "/cpu%d/cache/index%d/shared_cpu_list", cpu, index);
+			/* The list starts with its first CPU */
+			llc = read_int(path);
+		}
+	}
+
+	return llc;
+}
+
+static void topology_load(void)
+{
+	char path[128];
+	int cpu, node, package, core;
+
+	ncpus = get_nprocs_conf();
+	ncpus = (ncpus < TOPO_MAX_CPUS) ? ncpus : TOPO_MAX_CPUS;
+
+	for (cpu = 0; cpu < ncpus; cpu++) {
+		snprintf(path, sizeof(path), SYS_CPU "/cpu%d/topology/physical_package_id", cpu);
+		package = read_int(path);
+		snprintf(path, sizeof(path), SYS_CPU "/cpu%d/topology/core_id", cpu);
+		core = read_int(path);
+
+		/* Core ids repeat across packages */
+		cpus[cpu].core = (core < 0) ? -1 : (package < 0 ? 0 : package) * 65536 + core;
+		cpus[cpu].llc = read_llc(cpu);
+		cpus[cpu].node = -1;
+	}
+
+	for (node = 0; node < TOPO_MAX_CPUS; node++) {
+		snprintf(path, sizeof(path), SYS_NODE "/node%d/cpulist", node);
+		if (access(path, R_OK) != 0) {
+			/* Node ids may have holes, but not that many */
+			if (node > 64) {
+				break;
+			}
+			continue;
+		}
+		read_node_cpus(path, node);
+	}
+}
+
+static inline int valid(int cpu)
+{
+	pthread_once(&topology_once, topology_load);
+	return cpu >= 0 && cpu < ncpus;
+}
+
+int topology_core(int cpu)
+{
+	return valid(cpu) ? cpus[cpu].core : -1;
+}
+
+int topology_llc(int cpu)
+{
+	return valid(cpu) ? cpus[cpu].llc : -1;
+}
+
+int topology_node(int cpu)
+{
+	return valid(cpu) ? cpus[cpu].node : -1;
+}
+
+int topology_cpus(void)
+{
+	pthread_once(&topology_once, topology_load);
+	return ncpus;
+}
+
+/* Unknown ids (-1) match anything */
+static inline int same(int a, int b)
+{
+	return a == b || a < 0 || b < 0;
+}
+
+int topology_distance(int a, int b)
+{
+	if (a == b) {
+		return TOPO_SAME_CPU;
+	}
+
+	if (!valid(a) || !valid(b)) {
+		return TOPO_SAME_NODE;
+	}
+
+	if (cpus[a].core >= 0 && cpus[a].core == cpus[b].core) {
+		return TOPO_SAME_CORE;
+	}
+
+	if (same(cpus[a].llc, cpus[b].llc) && same(cpus[a].node, cpus[b].node)) {
+		return TOPO_SAME_LLC;
+	}
+
+	return same(cpus[a].node, cpus[b].node) ? TOPO_SAME_NODE : TOPO_REMOTE;
+}
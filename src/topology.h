@@ -0,0 +1,31 @@
+#ifndef __TOPOLOGY_H_
+#define __TOPOLOGY_H_
+
+#include <sched.h>
+
+/*
+	CPU layout of the machine, read once from sysfs: which CPUs share a
+	core, a last level cache and a NUMA node. Where sysfs does not say,
+	all CPUs are taken to share it, so nothing ever looks remote.
+*/
+
+#define TOPO_MAX_CPUS CPU_SETSIZE
+
+/* How far apart two CPUs are */
+#define TOPO_SAME_CPU  0
+#define TOPO_SAME_CORE 1
+#define TOPO_SAME_LLC  2
+#define TOPO_SAME_NODE 3
+#define TOPO_REMOTE    4
+
+int topology_distance(int a, int b);
+
+/* Ids of the core, last level cache and node of cpu, -1 if unknown */
+int topology_core(int cpu);
+int topology_llc(int cpu);
+int topology_node(int cpu);
+
+/* Number of CPUs the ids cover */
+int topology_cpus(void);
+
+#endif
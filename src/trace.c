@@ -0,0 +1,217 @@
+#include <fcntl.h>
+#include <limits.h>
+
+#include "util.h"
+#include "trace.h"
+
+#ifndef __NO_TRACE__
+
+int trace_enabled = 0;
+
+static struct trace_header *header = NULL;
+static size_t mapped;
+static uint64_t mask;
+
+/* Bumped by every trace_open(), so threads claim a ring in the new file */
+static int generation = 0;
+
+static __thread struct trace_ring *my_ring;
+static __thread int my_generation = 0;
+static __thread int my_cpu = -1;
+
+/* The clock readings at the end of the file are refreshed every time a
+ * thread claims a ring, in case trace_close() never runs */
+static void stamp_end(struct trace_header *h)
+{
+	h->end_ticks = trace_now();
+	h->end_ns = now_ns();
+}
+
+int trace_open(const char *path, int rings, int ring_events)
+{
+	static int at_exit = 0;
+	struct trace_header *h;
+	int fd;
+
+	rings = (rings > 0) ? rings : TRACE_RINGS;
+	ring_events = (ring_events > 0) ? ring_events : TRACE_RING_EVENTS;
+
+	if (header || (ring_events & (ring_events - 1))) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	mapped = sizeof(*h) + rings * trace_ring_bytes(ring_events);
+
+	if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1) {
+		return -1;
+	}
+
+	/* Sparse, only the rings threads write to take room */
+	if (ftruncate(fd, mapped) == -1) {
+		close(fd);
+		return -1;
+	}
+
+	h = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (h == MAP_FAILED) {
+		return -1;
+	}
+
+	h->magic = TRACE_MAGIC;
+	h->version = TRACE_VERSION;
+	h->rings = rings;
+	h->ring_events = ring_events;
+	h->start_ticks = trace_now();
+	h->start_ns = now_ns();
+	stamp_end(h);
+
+	mask = ring_events - 1;
+	__atomic_add_fetch(&generation, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&header, h, __ATOMIC_RELEASE);
+
+	if (!at_exit++) {
+		atexit(trace_close);
+	}
+
+	__atomic_store_n(&trace_enabled, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* The mapping stays, a thread may still be in the middle of an event */
+void trace_close(void)
+{
+	struct trace_header *h = header;
+
+	if (!h) {
+		return;
+	}
+
+	__atomic_store_n(&trace_enabled, 0, __ATOMIC_RELEASE);
+	header = NULL;
+
+	stamp_end(h);
+	msync(h, mapped, MS_SYNC);
+
+	if (h->dropped_threads) {
+		fprintf(stderr, "CB2 trace: %u threads were not traced, ask for "
+			"more than %u rings\n", h->dropped_threads, h->rings);
+	}
+}
+
+int trace_open_spec(const char *spec)
+{
+	const char *colon = strrchr(spec, ':');
+	char path[PATH_MAX], *end;
+	long rings = 0;
+
+	/* Only a number after the last colon is a ring count */
+	if (colon && colon[1]) {
+		rings = strtol(colon + 1, &end, 10);
+		if (*end || rings <= 0) {
+			colon = NULL;
+			rings = 0;
+		}
+	} else {
+		colon = NULL;
+	}
+
+	snprintf(path, sizeof(path), "%.*s", colon ? (int)(colon - spec) :
+		(int)strlen(spec), spec);
+	return trace_open(path, rings, 0);
+}
+
+static struct trace_ring *claim(void)
+{
+	struct trace_header *h = __atomic_load_n(&header, __ATOMIC_ACQUIRE);
+	uint32_t i;
+
+	my_generation = __atomic_load_n(&generation, __ATOMIC_RELAXED);
+	my_ring = NULL;
+	my_cpu = -1;
+
+	if (!h) {
+		return NULL;
+	}
+
+	if ((i = __atomic_fetch_add(&h->rings_used, 1, __ATOMIC_RELAXED)) >=
+			h->rings) {
+		if (__atomic_fetch_add(&h->dropped_threads, 1,
+				__ATOMIC_RELAXED) == 0) {
+			fprintf(stderr, "CB2 trace: all %u rings taken, the threads "
+				"from now on are not traced\n", h->rings);
+		}
+		return NULL;
+	}
+
+	my_ring = trace_ring_at(h, i);
+	my_ring->tid = self_tid();
+	stamp_end(h);
+
+	return my_ring;
+}
+
+static inline void put(struct trace_ring *r, int type, const void *lock,
+		int a, int b, int c, int cpu)
+{
+	struct trace_event *e = &r->events[r->head & mask];
+
+	e->time = trace_now();
+	e->lock = (uintptr_t)lock;
+	e->type = type;
+	e->cpu = cpu;
+	e->a = a;
+	e->b = b;
+	e->c = c;
+
+	/* Only for somebody reading the file of a live process */
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+void trace_record(int type, const void *lock, int a, int b, int c)
+{
+	struct trace_ring *r = my_ring;
+	int cpu = sched_getcpu();
+
+	if (__builtin_expect(my_generation !=
+			__atomic_load_n(&generation, __ATOMIC_RELAXED), 0)) {
+		r = claim();
+	}
+
+	if (!r) {
+		return;
+	}
+
+	/* Migrations are only noticed when the thread records something */
+	if (cpu != my_cpu) {
+		if (my_cpu >= 0) {
+			put(r, TRACE_MIGRATE, lock, my_cpu, cpu, 0, cpu);
+		}
+		my_cpu = cpu;
+	}
+
+	put(r, type, lock, a, b, c, cpu);
+}
+
+#else
+
+int trace_open(__attribute__((unused)) const char *path,
+		__attribute__((unused)) int rings,
+		__attribute__((unused)) int ring_events)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+void trace_close(void)
+{
+}
+
+int trace_open_spec(__attribute__((unused)) const char *spec)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+#endif
@@ -0,0 +1,147 @@
+#ifndef __TRACE_H_
+#define __TRACE_H_
+
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/*
+	Binary event trace of the CB2 protocols, for when LOG_DEBUG is far
+	too slow. Events go to a file mapped into memory, which holds a ring
+	per thread: a thread claims one the first time it records something,
+	and it is the only writer of it, so recording is a few stores and no
+	atomic instruction. A full ring wraps and the oldest events are lost.
+	The kernel writes the pages back on its own, so the file is there even
+	if the process dies, and trace_close() makes sure of it.
+
+	Rings are not reused, so once they are all taken the threads that
+	come later are not traced: that is reported, and trace_open_spec()
+	takes a number of rings to avoid it.
+
+	trace_analyze reads the file back and rebuilds the timeline of every
+	lock, the priority inversions and the longest waits.
+
+	Tracing is off until trace_open(), and then costs a branch. Build
+	with -D__NO_TRACE__ to remove it altogether.
+*/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TRACE_MAGIC   0x4543415254324243ULL /* "CB2TRACE" */
+#define TRACE_VERSION 1
+
+/* Defaults of trace_open() */
+#define TRACE_RINGS       256
+#define TRACE_RING_EVENTS 16384
+
+/* Event types, and what a, b and c are */
+#define TRACE_ATTEMPT  1 /* Slow path: a = our nice */
+#define TRACE_ACQUIRE  2 /* a = our nice */
+#define TRACE_LOTTERY  3 /* a = bystander tickets, b = owner's, c = won */
+#define TRACE_BOOST    4 /* a = owner, b = the priority it got */
+#define TRACE_UNBOOST  5 /* Old owner back to its priority: a = 1 if it was
+                          * boosted, 0 if it was only demoted */
+#define TRACE_RELEASE  6
+#define TRACE_MIGRATE  7 /* a = old CPU, b = new CPU */
+#define TRACE_TYPES    8
+
+struct trace_event {
+	uint64_t time;
+	uint64_t lock;
+	uint16_t type;
+	uint16_t cpu;
+	int32_t a, b, c;
+};
+
+struct trace_header {
+	uint64_t magic;
+	uint32_t version;
+
+	/* Rings in the file, events in each, and rings claimed */
+	uint32_t rings;
+	uint32_t ring_events;
+	uint32_t rings_used;
+
+	/* Threads that found no ring left */
+	uint32_t dropped_threads;
+	uint32_t pad;
+
+	/* Times are ticks of the TSC (or ns without one). Two readings of
+	 * both clocks convert them. end_ns is 0 if trace_close() never ran. */
+	uint64_t start_ticks, start_ns;
+	uint64_t end_ticks, end_ns;
+} __attribute__((aligned(64)));
+
+struct trace_ring {
+	int32_t tid;
+	uint32_t pad;
+
+	/* Events written so far, the last ring_events are in events[] */
+	uint64_t head;
+
+	struct trace_event events[] __attribute__((aligned(64)));
+} __attribute__((aligned(64)));
+
+static inline uint64_t trace_ring_bytes(uint32_t ring_events)
+{
+	return sizeof(struct trace_ring) +
+		(uint64_t)ring_events * sizeof(struct trace_event);
+}
+
+static inline struct trace_ring *trace_ring_at(struct trace_header *h,
+		uint32_t i)
+{
+	return (struct trace_ring *)((char *)h + sizeof(*h) +
+		i * trace_ring_bytes(h->ring_events));
+}
+
+static inline uint64_t trace_now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+/* Trace to path, with rings rings of ring_events events (a power of two),
+ * 0 for the defaults. Returns -1 if the file could not be set up. */
+int trace_open(const char *path, int rings, int ring_events);
+
+/* trace_open() from "path" or "path:rings", as -T and CB2_TRACE take it */
+int trace_open_spec(const char *spec);
+
+/* Stop tracing and write the file back. Also done at exit. */
+void trace_close(void);
+
+#ifndef __NO_TRACE__
+
+extern int trace_enabled;
+void trace_record(int type, const void *lock, int a, int b, int c);
+
+/* A macro, so that the arguments are only worked out when tracing */
+#define trace(type, lock, a, b, c) do { \
+	if (__builtin_expect(trace_enabled, 0)) { \
+		trace_record(type, lock, a, b, c); \
+	} \
+} while (0)
+
+#else
+
+#define trace(type, lock, a, b, c) do {} while (0)
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,604 @@
+/*
+###############################################################################
+# Offline analyzer of the event traces of trace.h (test_prios -T, or        #
+# CB2_TRACE with the preload library). Rebuilds who held every lock and     #
+# when, the priority inversions (a thread waiting for a lock held by one    #
+# of lower priority) and the longest waits, with the owners that made them. #
+###############################################################################
+*/
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "util.h"
+#include "trace.h"
+
+/* Longest waits and inversions printed by default, see -n */
+#define DEFAULT_TOP 10
+
+/* Owners of the lock listed for each of the longest waits */
+#define MAX_OWNERS 16
+
+static const char *type_names[TRACE_TYPES] = {
+	"?", "attempt", "acquire", "lottery", "boost", "unboost", "release",
+	"migrate"
+};
+
+/* An event, with its thread and the time in us since the trace began */
+struct rec {
+	struct trace_event e;
+	int tid;
+	double us;
+};
+
+struct hold {
+	double start, end;
+	int tid, nice;
+};
+
+struct lock_state {
+	uint64_t addr;
+
+	/* Owner right now, 0 if none, with the priority it has now and the one
+	 * it took the lock with. since is when it got the former. */
+	int owner, owner_nice, owner_base;
+	double since;
+
+	/* Every hold that ended, in order. A boost or an unboost ends a hold
+	 * and the owner goes on with a new one at its new priority. */
+	struct hold *holds;
+	int nholds, max_holds;
+
+	unsigned long acquisitions, contended;
+	unsigned long lottery_won, lottery_lost, boosts, unboosts;
+	double wait_us, max_wait_us, hold_us, inversion_us;
+};
+
+struct thread_state {
+	int tid;
+
+	/* Lock we are waiting for since attempt, if waiting */
+	int waiting;
+	uint64_t lock;
+	double attempt;
+	int nice;
+
+	unsigned long migrations, waits;
+	double wait_us;
+};
+
+/* A wait, or a stretch of one during which the owner had a lower priority */
+struct interval {
+	struct lock_state *lock;
+	int tid, nice;
+	int owner, owner_nice;
+	double start, end;
+	double inversion_us;
+};
+
+static struct rec *recs;
+static long nrecs;
+
+static struct lock_state *locks;
+static int nlocks;
+
+static struct thread_state *threads;
+static int nthreads;
+
+static struct interval *waits, *inversions;
+static long nwaits, ninversions, max_inversions;
+
+static int compare_recs(const void *a, const void *b)
+{
+	const struct rec *x = a, *y = b;
+
+	return (x->e.time > y->e.time) - (x->e.time < y->e.time);
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static int compare_int(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+/* Longest first */
+static int compare_length(const void *a, const void *b)
+{
+	const struct interval *x = a, *y = b;
+	double dx = x->end - x->start, dy = y->end - y->start;
+
+	return (dx < dy) - (dx > dy);
+}
+
+static struct lock_state *lock_of(uint64_t addr)
+{
+	return bsearch(&addr, locks, nlocks, sizeof(*locks), compare_u64);
+}
+
+static struct thread_state *thread_of(int tid)
+{
+	return bsearch(&tid, threads, nthreads, sizeof(*threads), compare_int);
+}
+
+static void *grow(void *array, long n, long *max, size_t size)
+{
+	if (n < *max) {
+		return array;
+	}
+
+	*max = *max ? *max * 2 : 1024;
+	if (!(array = realloc(array, *max * size))) {
+		errExit("Could not grow an array");
+	}
+
+	return array;
+}
+
+/* Reads every ring, oldest event first. A ring that wrapped lost its
+ * oldest events, and the other threads' events of that time tell only half
+ * the story, so everything before the oldest event of the most recently
+ * wrapped ring goes too. Returns how many events were lost. */
+static unsigned long load(struct trace_header *h, size_t size)
+{
+	uint64_t mask = h->ring_events - 1, n, j, from = 0, start_ticks;
+	uint32_t used = (h->rings_used < h->rings) ? h->rings_used : h->rings;
+	unsigned long lost = 0;
+	struct trace_ring *r;
+	double scale = 1;
+	uint32_t i;
+	long k = 0;
+
+	if (sizeof(*h) + used * trace_ring_bytes(h->ring_events) > size) {
+		fprintf(stderr, "The trace is cut short\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (h->end_ticks > h->start_ticks) {
+		scale = (double)(h->end_ns - h->start_ns) /
+			(h->end_ticks - h->start_ticks);
+	}
+
+	for (i = 0; i < used; i++) {
+		r = trace_ring_at(h, i);
+		if (r->head > h->ring_events &&
+		    r->events[r->head & mask].time > from) {
+			from = r->events[r->head & mask].time;
+		}
+	}
+	start_ticks = from ? from : h->start_ticks;
+
+	for (i = 0; i < used; i++) {
+		r = trace_ring_at(h, i);
+		n = (r->head < h->ring_events) ? r->head : h->ring_events;
+		nrecs += n;
+	}
+
+	if (!(recs = malloc((nrecs ? nrecs : 1) * sizeof(*recs)))) {
+		errExit("Could not malloc the events");
+	}
+
+	for (i = 0; i < used; i++) {
+		r = trace_ring_at(h, i);
+		n = (r->head < h->ring_events) ? r->head : h->ring_events;
+		lost += r->head - n;
+
+		for (j = r->head - n; j < r->head; j++) {
+			if (r->events[j & mask].time < from) {
+				lost++;
+				continue;
+			}
+
+			recs[k].e = r->events[j & mask];
+			recs[k].tid = r->tid;
+			recs[k].us = (double)(recs[k].e.time - start_ticks) * scale / 1000;
+			k++;
+		}
+	}
+	nrecs = k;
+
+	if (from) {
+		printf("Rings wrapped, the trace starts %.3f ms in\n",
+			(double)(from - h->start_ticks) * scale / 1000000);
+	}
+
+	qsort(recs, nrecs, sizeof(*recs), compare_recs);
+
+	return lost;
+}
+
+/* One entry per lock and per thread, sorted for bsearch() */
+static void index_recs(void)
+{
+	uint64_t *addrs;
+	int *tids;
+	long i;
+
+	if (!(addrs = malloc((nrecs + 1) * sizeof(*addrs))) ||
+	    !(tids = malloc((nrecs + 1) * sizeof(*tids)))) {
+		errExit("Could not malloc the index");
+	}
+
+	for (i = 0; i < nrecs; i++) {
+		addrs[i] = recs[i].e.lock;
+		tids[i] = recs[i].tid;
+	}
+	qsort(addrs, nrecs, sizeof(*addrs), compare_u64);
+	qsort(tids, nrecs, sizeof(*tids), compare_int);
+
+	if (!(locks = calloc(nrecs + 1, sizeof(*locks))) ||
+	    !(threads = calloc(nrecs + 1, sizeof(*threads)))) {
+		errExit("Could not calloc the state");
+	}
+
+	for (i = 0; i < nrecs; i++) {
+		if (!nlocks || locks[nlocks - 1].addr != addrs[i]) {
+			locks[nlocks++].addr = addrs[i];
+		}
+		if (!nthreads || threads[nthreads - 1].tid != tids[i]) {
+			threads[nthreads++].tid = tids[i];
+		}
+	}
+
+	free(addrs);
+	free(tids);
+}
+
+static void print_rec(const struct rec *r)
+{
+	const struct trace_event *e = &r->e;
+
+	printf("%14.3f  tid %-7d cpu %-3d %#-14lx %-8s", r->us, r->tid, e->cpu,
+		(unsigned long)e->lock, type_names[(e->type < TRACE_TYPES) ?
+		e->type : 0]);
+
+	switch (e->type) {
+	case TRACE_ATTEMPT:
+	case TRACE_ACQUIRE:
+		printf(" nice %d", e->a);
+		break;
+	case TRACE_LOTTERY:
+		printf(" bystanders %d, owner %d tickets: %s", e->a, e->b,
+			e->c ? "owner boosted" : "owner left alone");
+		break;
+	case TRACE_BOOST:
+		printf(" tid %d to %d", e->a, e->b);
+		break;
+	case TRACE_UNBOOST:
+		printf(" %s", e->a ? "boost given back" : "demotion undone");
+		break;
+	case TRACE_MIGRATE:
+		printf(" cpu %d to %d", e->a, e->b);
+		break;
+	}
+	printf("\n");
+}
+
+/* The wait w just ended: the stretches of it during which an owner had a
+ * lower priority (a higher nice) than the waiter are inversions */
+static void find_inversions(struct interval *w)
+{
+	struct lock_state *l = w->lock;
+	struct interval *inv;
+	struct hold *h;
+	double from, to;
+	int i;
+
+	/* The holds are in order, and the last ones are the ones that count */
+	for (i = l->nholds - 1; i >= 0 && l->holds[i].end > w->start; i--) {
+		h = &l->holds[i];
+		if (h->nice <= w->nice || h->tid == w->tid) {
+			continue;
+		}
+
+		from = (h->start > w->start) ? h->start : w->start;
+		to = (h->end < w->end) ? h->end : w->end;
+		if (to <= from) {
+			continue;
+		}
+
+		inversions = grow(inversions, ninversions, &max_inversions,
+			sizeof(*inversions));
+		inv = &inversions[ninversions++];
+		*inv = *w;
+		inv->owner = h->tid;
+		inv->owner_nice = h->nice;
+		inv->start = from;
+		inv->end = to;
+
+		w->inversion_us += to - from;
+		l->inversion_us += to - from;
+	}
+}
+
+/* The owner of l stops holding it at its current priority at us */
+static void end_hold(struct lock_state *l, double us)
+{
+	long max_holds = l->max_holds;
+
+	l->holds = grow(l->holds, l->nholds, &max_holds, sizeof(*l->holds));
+	l->max_holds = max_holds;
+	l->holds[l->nholds].start = l->since;
+	l->holds[l->nholds].end = us;
+	l->holds[l->nholds].tid = l->owner;
+	l->holds[l->nholds++].nice = l->owner_nice;
+
+	l->hold_us += us - l->since;
+	l->since = us;
+}
+
+static void replay(int timeline, uint64_t only)
+{
+	struct thread_state *t;
+	struct lock_state *l;
+	struct interval *w;
+	struct rec *r;
+	long i, max_waits = 0;
+
+	for (i = 0; i < nrecs; i++) {
+		r = &recs[i];
+		l = lock_of(r->e.lock);
+		t = thread_of(r->tid);
+
+		if (timeline && (!only || only == r->e.lock)) {
+			print_rec(r);
+		}
+
+		switch (r->e.type) {
+		case TRACE_ATTEMPT:
+			t->waiting = 1;
+			t->lock = r->e.lock;
+			t->attempt = r->us;
+			t->nice = r->e.a;
+			break;
+
+		case TRACE_ACQUIRE:
+			l->acquisitions++;
+			l->owner = r->tid;
+			l->owner_nice = l->owner_base = r->e.a;
+			l->since = r->us;
+
+			if (!t->waiting || t->lock != r->e.lock) {
+				break;
+			}
+			t->waiting = 0;
+
+			waits = grow(waits, nwaits, &max_waits, sizeof(*waits));
+			w = &waits[nwaits++];
+			memset(w, 0, sizeof(*w));
+			w->lock = l;
+			w->tid = r->tid;
+			w->nice = t->nice;
+			w->start = t->attempt;
+			w->end = r->us;
+
+			l->contended++;
+			l->wait_us += w->end - w->start;
+			if (w->end - w->start > l->max_wait_us) {
+				l->max_wait_us = w->end - w->start;
+			}
+			t->waits++;
+			t->wait_us += w->end - w->start;
+
+			find_inversions(w);
+			break;
+
+		case TRACE_RELEASE:
+			if (l->owner != r->tid) {
+				/* Taken before the oldest event we have */
+				break;
+			}
+
+			end_hold(l, r->us);
+			l->owner = 0;
+			break;
+
+		case TRACE_LOTTERY:
+			if (r->e.c) {
+				l->lottery_won++;
+			} else {
+				l->lottery_lost++;
+			}
+			break;
+
+		/* Recorded by the waiter that boosted the owner */
+		case TRACE_BOOST:
+			l->boosts++;
+			if (l->owner && l->owner == r->e.a &&
+			    l->owner_nice != r->e.b) {
+				end_hold(l, r->us);
+				l->owner_nice = r->e.b;
+			}
+			break;
+
+		/* Recorded by the owner, mostly once it let go already */
+		case TRACE_UNBOOST:
+			l->unboosts++;
+			if (l->owner == r->tid && l->owner_nice != l->owner_base) {
+				end_hold(l, r->us);
+				l->owner_nice = l->owner_base;
+			}
+			break;
+
+		case TRACE_MIGRATE:
+			t->migrations++;
+			break;
+		}
+	}
+}
+
+/* Who held l during the wait w, and for how long of it */
+static void print_owners(struct lock_state *l, struct interval *w)
+{
+	struct {
+		int tid, nice;
+		unsigned long holds;
+		double us;
+	} owners[MAX_OWNERS];
+	int nowners = 0, i;
+	double from, to;
+	struct hold *h;
+	long j;
+
+	for (j = 0; j < l->nholds && l->holds[j].start < w->end; j++) {
+		h = &l->holds[j];
+		if (h->end <= w->start) {
+			continue;
+		}
+
+		for (i = 0; i < nowners && (owners[i].tid != h->tid ||
+				owners[i].nice != h->nice); i++);
+		if (i == nowners) {
+			if (nowners == MAX_OWNERS) {
+				continue;
+			}
+			owners[nowners].tid = h->tid;
+			owners[nowners].nice = h->nice;
+			owners[nowners].holds = 0;
+			owners[nowners++].us = 0;
+		}
+
+		from = (h->start > w->start) ? h->start : w->start;
+		to = (h->end < w->end) ? h->end : w->end;
+		owners[i].holds++;
+		owners[i].us += to - from;
+	}
+
+	for (i = 0; i < nowners; i++) {
+		printf("    held by tid %d (nice %d) %lu times, %.1f us\n",
+			owners[i].tid, owners[i].nice, owners[i].holds, owners[i].us);
+	}
+}
+
+static void report(int top)
+{
+	struct lock_state *l;
+	struct interval *w;
+	long i;
+
+	printf("\n%-18s %9s %9s %12s %12s %12s %12s %7s %7s %7s\n", "lock",
+		"acquired", "waited", "wait us", "max wait us", "hold us",
+		"inversion us", "won", "lost", "boosts");
+	for (i = 0; i < nlocks; i++) {
+		l = &locks[i];
+		if (!l->acquisitions) {
+			continue;
+		}
+
+		printf("%#-18lx %9lu %9lu %12.1f %12.1f %12.1f %12.1f %7lu %7lu "
+			"%7lu\n", (unsigned long)l->addr, l->acquisitions,
+			l->contended, l->wait_us, l->max_wait_us, l->hold_us,
+			l->inversion_us, l->lottery_won, l->lottery_lost, l->boosts);
+	}
+
+	printf("\n%-8s %9s %12s %10s\n", "thread", "waits", "wait us",
+		"migrated");
+	for (i = 0; i < nthreads; i++) {
+		printf("%-8d %9lu %12.1f %10lu\n", threads[i].tid, threads[i].waits,
+			threads[i].wait_us, threads[i].migrations);
+	}
+
+	/* The waits on the critical path, and the holds that made them */
+	qsort(waits, nwaits, sizeof(*waits), compare_length);
+	printf("\nLongest waits:\n");
+
+	for (i = 0; i < nwaits && i < top; i++) {
+		w = &waits[i];
+		l = w->lock;
+
+		printf("  tid %d (nice %d) waited %.1f us for %#lx from %.3f, "
+			"%.1f us of it inverted\n", w->tid, w->nice, w->end - w->start,
+			(unsigned long)l->addr, w->start, w->inversion_us);
+
+		print_owners(l, w);
+	}
+
+	qsort(inversions, ninversions, sizeof(*inversions), compare_length);
+	printf("\nLongest priority inversions:\n");
+
+	for (i = 0; i < ninversions && i < top; i++) {
+		w = &inversions[i];
+
+		printf("  %#lx: tid %d (nice %d) waited %.1f us on tid %d (nice %d) "
+			"from %.3f\n", (unsigned long)w->lock->addr, w->tid, w->nice,
+			w->end - w->start, w->owner, w->owner_nice, w->start);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, fd, timeline = 0, top = DEFAULT_TOP;
+	struct trace_header *h;
+	unsigned long lost;
+	uint64_t only = 0;
+	struct stat st;
+
+	while ((opt = getopt(argc, argv, "htl:n:")) != -1) {
+		switch (opt) {
+			case 'h':
+				printf("Usage: %s [-t] [-l lock] [-n top] trace\n", argv[0]);
+				printf("\n");
+				printf("-t: print every event, in time order (us)\n");
+				printf("-l: only the events of this lock address\n");
+				printf("-n: how many of the longest waits and inversions "
+					"(default %d)\n", DEFAULT_TOP);
+				exit(EXIT_SUCCESS);
+			case 't':
+				timeline = 1;
+				break;
+			case 'l':
+				only = strtoull(optarg, NULL, 0);
+				break;
+			case 'n':
+				top = atoi(optarg);
+				break;
+			default:
+				exit(EXIT_FAILURE);
+		}
+	}
+
+	if (optind >= argc) {
+		fprintf(stderr, "Usage: %s [-t] [-l lock] [-n top] trace\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	if ((fd = open(argv[optind], O_RDONLY)) == -1 || fstat(fd, &st) == -1) {
+		errExit("Could not open the trace");
+	}
+
+	if ((size_t)st.st_size < sizeof(*h) || (h = mmap(NULL, st.st_size,
+			PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		errExit("Could not map the trace");
+	}
+	close(fd);
+
+	if (h->magic != TRACE_MAGIC || h->version != TRACE_VERSION ||
+	    !h->ring_events || (h->ring_events & (h->ring_events - 1))) {
+		fprintf(stderr, "%s is not a trace we know\n", argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+
+	lost = load(h, st.st_size);
+	index_recs();
+
+	printf("%ld events of %d threads over %.3f ms", nrecs, nthreads,
+		nrecs ? (recs[nrecs - 1].us - recs[0].us) / 1000 : 0.0);
+	printf(", %lu lost, %u threads without a ring\n", lost,
+		h->dropped_threads);
+	if (h->end_ticks <= h->start_ticks) {
+		printf("No clock readings at the end, times are in ticks\n");
+	}
+
+	if (timeline) {
+		printf("\n%14s  %-11s %-7s %-14s %s\n", "us", "thread", "cpu",
+			"lock", "event");
+	}
+	replay(timeline, only);
+	report(top);
+
+	return 0;
+}
@@ -0,0 +1,14 @@
+#include "util.h"
+
+__thread pid_t cached_tid = 0;
+
+/* The child of a fork() is a new thread with a copy of our TLS */
+static void forget_tid(void)
+{
+	cached_tid = 0;
+}
+
+__attribute__((constructor)) static void util_init(void)
+{
+	pthread_atfork(NULL, NULL, forget_tid);
+}
@@ -3,7 +3,9 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <sys/syscall.h>
 #include <pthread.h>
 #include <sched.h>
 #include <sys/sysinfo.h>
@@ -17,8 +19,43 @@
 
 #define gettid() syscall(SYS_gettid)
 
+/* gettid() is a syscall, so the fast paths use a per-thread copy. There is
+ * one for the whole program (util.c), and a forked child starts over. */
+#ifdef __cplusplus
+extern "C"
+#else
+extern
+#endif
+__thread pid_t cached_tid __attribute__((visibility("hidden")));
+
+static inline pid_t self_tid(void)
+{
+	if (__builtin_expect(cached_tid == 0, 0)) {
+		cached_tid = gettid();
+	}
+	return cached_tid;
+}
+
+/* Tell the CPU we are spinning */
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax() asm volatile("yield" ::: "memory")
+#else
+#define cpu_relax() asm volatile("" ::: "memory")
+#endif
+
 #define errExit(msg) do { perror(msg); exit(EXIT_FAILURE); } while (0)
 
+/* Monotonic clock in nanoseconds, served by the vDSO */
+static inline long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
 #ifdef DEBUG
 #define LOG_DEBUG(msg, ...) printf("DEBUG: " msg, __VA_ARGS__)
 #else